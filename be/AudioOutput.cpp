@@ -1,56 +1,77 @@
 /*
 	AudioOutput.cpp
+
+	Plays a BMediaTrack's audio as a voice of output_mixer.  The
+	track is decoded ahead by a feeder thread into a ring of PCM
+	several buffers deep, so that all the mixer's callback ever does
+	with it is copy out of the ring; a slow decode or a seek can't
+	hold it up.  The ring is single-producer, single-consumer, with
+	no locking between the two.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "AudioOutput.h"
 
-void AudioPlay(void *cookie, void *buffer, size_t bufferSize, const media_raw_audio_format &format)
-{
-	bool update_trackTime;
-	int64 frame_count;
-	uint32 filled;
-	status_t err;
-	AudioOutput *ao;
-	media_header mh;
+/* Read
 
-	ao = (AudioOutput*)cookie;
-	ao->Lock();
+	Called from output_mixer's callback.  Pads out with silence (and
+	counts an underrun) if the feeder hasn't kept up, so the track's
+	time keeps going with the mixer's.
+*/
 
-	update_trackTime = true;
+int32 AudioOutput::Read(void *data, int32 frames)
+{
+	uint8 *out = (uint8 *)data;
+	uint32 size = frames*frame_size;
+	uint32 available, count, offset, first;
 
-	if (ao->isPlaying)
+	// After a seek, skip whatever was decoded before it
+	if (atomic_and(&skip_pending, 0))
 	{
-		err = ao->track->ReadFrames((char*)buffer, &frame_count, &mh);
-		if ((err != B_OK) || (frame_count < 0))
-		{
-			memset((char*)buffer, ao->default_data, ao->buffer_size);
-			update_trackTime = false;
-		}
-		else
+		ring_read = skip_pos;
+		trackTime = skip_time;
+	}
+
+	if (isPlaying)
+	{
+		available = (uint32)(atomic_add(&ring_write, 0) - ring_read);
+		count = (available < size) ? available : size;
+		count -= count % frame_size;
+
+		offset = (uint32)ring_read & (ring_size-1);
+		first = ring_size - offset;
+		if (first > count) first = count;
+		memcpy(out, ring+offset, first);
+		memcpy(out+first, ring, count-first);
+		atomic_add(&ring_read, count);
+
+		if (count < size)
 		{
-			filled = ao->frame_size * frame_count;
-			if (filled < ao->buffer_size)
-				memset((char*)buffer+filled, ao->default_data, ao->buffer_size-filled);
-			if (err != B_OK)
-				update_trackTime = false;
+			memset(out+count, default_data, size-count);
+			if (!feed_end)
+				underruns++;
+			else if (finished_sem >= B_OK)
+				release_sem_etc(finished_sem, 1, B_DO_NOT_RESCHEDULE);
 		}
+
+		// There's room for more now
+		release_sem_etc(feed_sem, 1, B_DO_NOT_RESCHEDULE);
 	}
 	else
-		memset((char*)buffer, ao->default_data, ao->buffer_size);
+		memset(out, default_data, size);
 
-	ao->perfTime = ao->player->PerformanceTime();
+	perfTime = output_mixer.PerformanceTime();
 //KT
 // This seems to be screwing up some AVI sync
 //	if (update_trackTime)
-//		ao->trackTime = ao->track->CurrentTime();
+//		trackTime = track->CurrentTime();
 //	else
-		ao->trackTime +=
-			(bigtime_t)(1e6*(float)bufferSize/((float)ao->frame_size*ao->frame_rate));
+		trackTime += (bigtime_t)(1e6*(float)frames/frame_rate);
 
-	ao->Unlock();
+	return frames;
 }
 
 AudioOutput::AudioOutput(BMediaTrack *new_track, const char *name)
@@ -64,6 +85,19 @@ AudioOutput::AudioOutput(BMediaTrack *new_track, const char *name)
 	perfTime = -1;
 	perfTime = -1;
 	trackTime = 0;
+	mixing = false;
+	ring = feed_buffer = NULL;
+	ring_size = 0;
+	ring_read = ring_write = 0;
+	feed_thread = B_ERROR;
+	feed_sem = B_ERROR;
+	feed_quit = false;
+	feed_end = false;
+	skip_pending = 0;
+	skip_pos = 0;
+	skip_time = 0;
+	underruns = 0;
+	finished_sem = B_ERROR;
 	
 	track->DecodedFormat(&format);
 	switch (format.u.raw_audio.format)
@@ -85,7 +119,6 @@ AudioOutput::AudioOutput(BMediaTrack *new_track, const char *name)
 			frame_size = 4;
 			break;
 		default :
-			player = NULL;
 			return;
 	}
 	channelCount = format.u.raw_audio.channel_count;
@@ -93,31 +126,38 @@ AudioOutput::AudioOutput(BMediaTrack *new_track, const char *name)
 	buffer_size = format.u.raw_audio.buffer_size;
 	frame_rate = format.u.raw_audio.frame_rate;
 
-	player = new BSoundPlayer(&format.u.raw_audio, name, AudioPlay);
-	if (player->InitCheck() != B_OK)
-	{
-		delete player;
-		player = NULL;
-	}
-	else
-	{
-		player->SetCookie(this);
-		player->Start();
-		player->SetHasData(true);
-		// For some reason, SetVolume() doesn't override the
-		// mixer defaults (in /boot/home/config/settings/Media),
-		// but SetVolumeDB() does, thankfully.
-		player->SetVolumeDB(1.0);
-	}
+	if (!SetFormat(format.u.raw_audio)) return;
+
+	// Start decoding ahead before the mixer starts asking for it
+	for (ring_size = 1; ring_size < AUDIO_RING_BUFFERS*buffer_size; ring_size <<= 1);
+	ring = (uint8 *)malloc(ring_size);
+	feed_buffer = (uint8 *)malloc(buffer_size);
+	if (!ring || !feed_buffer) return;
+	if ((feed_sem = create_sem(0, "AudioOutput::feed_sem")) < B_OK) return;
+	feed_thread = spawn_thread(Feeder, "AudioOutput::Feeder",
+		B_URGENT_DISPLAY_PRIORITY, this);
+	if (feed_thread < B_OK || resume_thread(feed_thread)!=B_OK) return;
+
+	mixing = output_mixer.AddVoice(this);
 }
 
 AudioOutput::~AudioOutput()
 {
-	if (player) player->Stop();
-	delete player;
+	status_t result;
+
+	if (mixing) output_mixer.RemoveVoice(this);
+
+	feed_quit = true;
+	delete_sem(feed_sem);
+	wait_for_thread(feed_thread, &result);
+	free(ring);
+	free(feed_buffer);
+
 	delete_sem(lock_sem);
 }
 
+// Locks out Feed(), so the track is only ever read by one thread at
+// a time
 void AudioOutput::Lock()
 {
 	if (atomic_add(&lock_count, 1) > 0)
@@ -130,22 +170,95 @@ void AudioOutput::Unlock()
 		release_sem(lock_sem);
 }
 
+int32 AudioOutput::Feeder(void *arg)
+{
+	AudioOutput *ao = (AudioOutput *)arg;
+
+	// Read(), Play() and SeekToTime() release feed_sem whenever
+	// there's more to do; deleting it ends the thread
+	while (!ao->feed_quit)
+	{
+		ao->Feed();
+		if (acquire_sem(ao->feed_sem) < B_OK) break;
+	}
+	return 0;
+}
+
+// Decodes into the ring until it's full or the track runs out
+void AudioOutput::Feed()
+{
+	int64 frame_count;
+	media_header mh;
+	uint32 used, count, offset, first;
+
+	Lock();
+	while (!feed_end && !feed_quit)
+	{
+		used = (uint32)(ring_write - atomic_add(&ring_read, 0));
+		if (ring_size - used < buffer_size)
+			break;
+
+		status_t err = track->ReadFrames((char *)feed_buffer, &frame_count, &mh);
+		if (err != B_OK || frame_count <= 0)
+		{
+			feed_end = true;
+			break;
+		}
+
+		count = (uint32)frame_count*frame_size;
+		if (count > buffer_size) count = buffer_size;
+
+		offset = (uint32)ring_write & (ring_size-1);
+		first = ring_size - offset;
+		if (first > count) first = count;
+		memcpy(ring+offset, feed_buffer, first);
+		memcpy(ring, feed_buffer+first, count-first);
+
+		// Only now can Read() see it
+		atomic_add(&ring_write, count);
+	}
+	Unlock();
+}
+
+// Seeks as close as possible to *inout_time, then reads ahead until
+// less than 50ms short of it
 status_t AudioOutput::SeekToTime(bigtime_t *inout_time)
 {
+	bigtime_t target = *inout_time, last;
+	int64 frame_count;
+	media_header mh;
 	status_t err;
 
 	Lock();
 	err = track->SeekToTime(inout_time);
+	last = *inout_time;
+	while (target - *inout_time > 50000)
+	{
+		if (track->ReadFrames((char *)feed_buffer, &frame_count, &mh) != B_OK)
+			break;
+		*inout_time = mh.start_time;
+		if ((frame_count == 0) || (*inout_time <= last))
+			break;
+		last = *inout_time;
+	}
+	feed_end = false;
 	trackTime = *inout_time;
+
+	// Feed() is locked out, so ring_write is where the new audio
+	// will start
+	skip_time = *inout_time;
+	skip_pos = ring_write;
+	atomic_or(&skip_pending, 1);
 	Unlock();
+
+	release_sem(feed_sem);
 	return err;
 }
 
 status_t AudioOutput::Play()
 {
-	Lock();
 	isPlaying = true;
-	Unlock();
+	release_sem(feed_sem);
 	return B_NO_ERROR;
 }
 
@@ -155,6 +268,21 @@ status_t AudioOutput::Stop()
 	return B_NO_ERROR;
 }
 
+// True once everything up to the end of the track has been played
+bool AudioOutput::IsFinished()
+{
+	return (feed_end && !skip_pending &&
+		atomic_add(&ring_write, 0) == atomic_add(&ring_read, 0));
+}
+
+// How full the ring is, from 0 to 1
+float AudioOutput::FillLevel()
+{
+	if (!ring_size) return 0.0;
+	return (float)(uint32)(atomic_add(&ring_write, 0) - atomic_add(&ring_read, 0))
+		/ (float)ring_size;
+}
+
 bigtime_t AudioOutput::TrackTimebase()
 {
 	return perfTime - trackTime;
@@ -162,11 +290,11 @@ bigtime_t AudioOutput::TrackTimebase()
 
 status_t AudioOutput::SetVolume(float vol)
 {
-	player->SetVolume(vol);
+	SetGain(vol);
 	return B_NO_ERROR;
 }
 
 float AudioOutput::Volume()
 {
-	return player->Volume();
+	return Gain();
 }
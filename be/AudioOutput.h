@@ -5,29 +5,43 @@
 #ifndef _AUDIO_OUTPUT_H
 #define _AUDIO_OUTPUT_H
 
-#include <SoundPlayer.h>
 #include <OS.h>
 #include <MediaTrack.h>
 
-class AudioOutput {
+#include "Mixer.h"
+
+// How many of the track's buffers are decoded ahead
+#define AUDIO_RING_BUFFERS 8
+
+class AudioOutput : public MixerVoice {
 public :
 	AudioOutput(BMediaTrack *track, const char *name);
 	~AudioOutput();
-	status_t InitCheck() { return ((player != NULL)?B_OK:B_ERROR); };
+	status_t InitCheck() { return (mixing?B_OK:B_ERROR); };
 	BMediaTrack *Track() { return track; };
 	status_t SeekToTime(bigtime_t *inout_time);
 	status_t Play();
 	status_t Stop();
 	bool IsPlaying() { return isPlaying; };
+	bool IsFinished();
 	bigtime_t TrackTimebase();
 	status_t SetVolume(float vol);
 	float Volume();
 
+	int32 Underruns() { return underruns; };
+	float FillLevel();
+
+	// Released by Read() once it's played the last of the track
+	void SetFinishedSem(sem_id sem) { finished_sem = sem; };
+
+	virtual int32 Read(void *data, int32 frames);
+
 private :
-	friend void AudioPlay(void *, void *, size_t, const media_raw_audio_format &);
+	static int32 Feeder(void *arg);
 
 	void Lock();
 	void Unlock();
+	void Feed();
 
 	bool isPlaying;
 	int32 frameSize;
@@ -39,8 +53,30 @@ private :
 	uint32 buffer_size;
 	sem_id lock_sem;
 	BMediaTrack *track;
-	BSoundPlayer *player;
+	bool mixing;
 	bigtime_t perfTime, trackTime;
+
+	// The decoded PCM ring:  Feeder() is the only writer, Read()
+	// the only reader.  The positions are byte counts that only ever
+	// go up (wrapping at 2^32), so ring_write-ring_read is always the
+	// amount buffered; ring_size is a power of two.
+	uint8 *ring;
+	uint32 ring_size;
+	int32 ring_read, ring_write;
+	uint8 *feed_buffer;
+	thread_id feed_thread;
+	sem_id feed_sem;
+	volatile bool feed_quit;
+	volatile bool feed_end;		// the track has no more frames
+
+	// SeekToTime() asks Read() to skip ahead to skip_pos (and
+	// take up the time from skip_time) by setting skip_pending
+	int32 skip_pending;
+	int32 skip_pos;
+	bigtime_t skip_time;
+
+	int32 underruns;
+	sem_id finished_sem;
 };
 
 #endif
@@ -0,0 +1,824 @@
+/*
+	BitmapScale.cpp
+
+	Bilinear scaling of B_RGB32 bitmaps, used for graphics smoothing.
+
+	Each destination row is the blend of two horizontally-scaled
+	source rows, which are kept from one destination row to the next
+	so that each source row is only scaled once.  Everything walks
+	memory row by row, and taps and weights are looked up in tables
+	built once per size (in 16.16 fixed point, with 8-bit weights)
+	instead of being recomputed for every pixel.
+
+	With SSE2, the horizontal pass does two pixels at a time and the
+	vertical pass four; with AVX2, the vertical pass does eight.
+	Which of those the CPU has is checked when scaling, not when
+	compiling (see CPUFeatures.h); without either, the same
+	fixed-point math is done in plain C.
+
+	BilinearStretchBlt() splits the destination into horizontal
+	bands and scales them in parallel on a small pool of worker
+	threads, one per CPU.
+
+	HalveBitmap() is a 2x2 box filter, for building a pyramid of
+	half-size levels so that big downscales can start from a level
+	close to the final size instead of skipping over most of the
+	source pixels.
+
+	Build with BENCHMARK_PICTURE to get BenchmarkScaling(), which
+	compares this against the original floating-point version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Autolock.h>
+#include <OS.h>
+
+#include "BitmapScale.h"
+#include "CPUFeatures.h"
+
+BitmapScaler::BitmapScaler()
+{
+	src_width = src_height = 0;
+	dest_width = dest_height = 0;
+	x_index = y_index = NULL;
+	x_weight = y_weight = NULL;
+}
+
+BitmapScaler::~BitmapScaler()
+{
+	FreeTables();
+}
+
+void BitmapScaler::FreeTables()
+{
+	free(x_index);
+	free(x_weight);
+	free(y_index);
+	free(y_weight);
+	x_index = y_index = NULL;
+	x_weight = y_weight = NULL;
+}
+
+
+/* BuildTaps
+
+	Works out, for each of <dest> output pixels, the first of the two
+	source pixels it falls between and the weight (0-256) of the
+	second one, sampling at pixel centers.  At the far edge the pair
+	is folded back so that index+1 is always a valid pixel (unless
+	the source is only one pixel wide).
+*/
+
+static void BuildTaps(int32 src, int32 dest, int32 *index, int32 *weight)
+{
+	int64 step = ((int64)src << 16)/dest;
+	int64 pos = step/2 - 0x8000;
+
+	for (int32 i=0; i<dest; i++, pos+=step)
+	{
+		int64 p = (pos < 0) ? 0 : pos;
+		int32 n = (int32)(p >> 16);
+		int32 w = (int32)((p & 0xffff) >> 8);
+
+		if (n >= src-1)
+		{
+			if (src > 1)
+			{
+				n = src-2;
+				w = 256;
+			}
+			else
+			{
+				n = 0;
+				w = 0;
+			}
+		}
+		index[i] = n;
+		weight[i] = w;
+	}
+}
+
+bool BitmapScaler::SetSize(int32 sw, int32 sh, int32 dw, int32 dh)
+{
+	if (sw < 1 || sh < 1 || dw < 1 || dh < 1) return false;
+
+	if (x_index && sw==src_width && sh==src_height &&
+		dw==dest_width && dh==dest_height)
+	{
+		return true;
+	}
+
+	FreeTables();
+	x_index = (int32 *)malloc(dw*sizeof(int32));
+	x_weight = (int16 *)malloc(dw*8*sizeof(int16));
+	y_index = (int32 *)malloc(dh*sizeof(int32));
+	y_weight = (int16 *)malloc(dh*sizeof(int16));
+	int32 *weight = (int32 *)malloc(((dw > dh)?dw:dh)*sizeof(int32));
+	if (!x_index || !x_weight || !y_index || !y_weight || !weight)
+	{
+		FreeTables();
+		free(weight);
+		src_width = src_height = dest_width = dest_height = 0;
+		return false;
+	}
+
+	src_width = sw, src_height = sh;
+	dest_width = dw, dest_height = dh;
+
+	// The column weights are stored as they're used by the horizontal
+	// pass:  one 16-bit weight per channel of each of the two taps
+	BuildTaps(sw, dw, x_index, weight);
+	for (int32 x=0; x<dw; x++)
+	{
+		for (int c=0; c<4; c++)
+		{
+			x_weight[x*8+c] = (int16)(256-weight[x]);
+			x_weight[x*8+4+c] = (int16)weight[x];
+		}
+	}
+
+	BuildTaps(sh, dh, y_index, weight);
+	for (int32 y=0; y<dh; y++)
+		y_weight[y] = (int16)weight[y];
+
+	free(weight);
+	return true;
+}
+
+
+#if defined (HAVE_X86_SIMD)
+
+// Scales as many of the <dest_width> pixels as it can two at a time:
+// each one's pair of taps is loaded as 8 bytes, widened to 16 bits and
+// weighted, then the two halves are added.  Returns how many it did.
+TARGET_SSE2
+static int32 ScaleRowHorizontalSSE2(const uint8 *src, uint8 *out,
+	const int32 *x_index, const int16 *x_weight, int32 dest_width)
+{
+	__m128i zero = _mm_setzero_si128();
+	int32 x = 0;
+
+	for (; x+2<=dest_width; x+=2)
+	{
+		__m128i a = _mm_loadl_epi64((const __m128i *)(src + x_index[x]*4));
+		__m128i b = _mm_loadl_epi64((const __m128i *)(src + x_index[x+1]*4));
+		a = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero),
+			_mm_loadu_si128((const __m128i *)(x_weight + x*8)));
+		b = _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero),
+			_mm_loadu_si128((const __m128i *)(x_weight + (x+1)*8)));
+		__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(a, b),
+			_mm_unpackhi_epi64(a, b));
+		sum = _mm_srli_epi16(sum, 8);
+		_mm_storel_epi64((__m128i *)(out + x*4), _mm_packus_epi16(sum, sum));
+	}
+	return x;
+}
+
+#endif	// HAVE_X86_SIMD
+
+
+/* ScaleRowHorizontal
+
+	Scales one source row to dest_width pixels in <out>.
+*/
+
+void BitmapScaler::ScaleRowHorizontal(const uint8 *src, uint8 *out)
+{
+	int32 x = 0;
+
+#if defined (HAVE_X86_SIMD)
+	if (src_width > 1 && CPUHasSSE2())
+		x = ScaleRowHorizontalSSE2(src, out, x_index, x_weight, dest_width);
+#endif
+
+	for (; x<dest_width; x++)
+	{
+		const uint8 *p0 = src + x_index[x]*4;
+		const uint8 *p1 = (src_width > 1) ? p0+4 : p0;
+		int32 w0 = x_weight[x*8];
+		int32 w1 = x_weight[x*8+4];
+
+		for (int c=0; c<4; c++)
+			out[x*4+c] = (uint8)((p0[c]*w0 + p1[c]*w1) >> 8);
+	}
+}
+
+
+#if defined (HAVE_X86_SIMD)
+
+// These blend as much of the rows as they can, 32 or 16 bytes at a
+// time, as BlendRows() does, and return how far they got
+TARGET_AVX2
+static int32 BlendRowsAVX2(const uint8 *upper, const uint8 *lower, int32 w,
+	uint8 *dest, int32 bytes)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i vw0 = _mm256_set1_epi16((int16)(256-w));
+	__m256i vw1 = _mm256_set1_epi16((int16)w);
+	int32 i = 0;
+
+	// Unpacking and packing both work within 128-bit lanes, so
+	// the bytes come back out in their original order
+	for (; i+32<=bytes; i+=32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(upper+i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(lower+i));
+		__m256i lo = _mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), vw0),
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), vw1));
+		__m256i hi = _mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), vw0),
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), vw1));
+		lo = _mm256_srli_epi16(lo, 8);
+		hi = _mm256_srli_epi16(hi, 8);
+		_mm256_storeu_si256((__m256i *)(dest+i), _mm256_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+// Starts at byte <i>
+TARGET_SSE2
+static int32 BlendRowsSSE2(const uint8 *upper, const uint8 *lower, int32 w,
+	uint8 *dest, int32 bytes, int32 i)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i vw0 = _mm_set1_epi16((int16)(256-w));
+	__m128i vw1 = _mm_set1_epi16((int16)w);
+
+	for (; i+16<=bytes; i+=16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(upper+i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(lower+i));
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), vw0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), vw1));
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), vw0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), vw1));
+		lo = _mm_srli_epi16(lo, 8);
+		hi = _mm_srli_epi16(hi, 8);
+		_mm_storeu_si128((__m128i *)(dest+i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+#endif	// HAVE_X86_SIMD
+
+
+/* BlendRows
+
+	Writes <bytes> bytes of <upper> and <lower> blended together,
+	with <lower> weighted by <w> (0-256), to <dest>.
+*/
+
+static void BlendRows(const uint8 *upper, const uint8 *lower, int32 w,
+	uint8 *dest, int32 bytes)
+{
+	int32 i = 0;
+	int32 w0 = 256-w;
+
+	if (w==0)
+	{
+		memcpy(dest, upper, bytes);
+		return;
+	}
+	if (w==256)
+	{
+		memcpy(dest, lower, bytes);
+		return;
+	}
+
+#if defined (HAVE_X86_SIMD)
+	if (CPUHasAVX2())
+		i = BlendRowsAVX2(upper, lower, w, dest, bytes);
+	if (CPUHasSSE2())
+		i = BlendRowsSSE2(upper, lower, w, dest, bytes, i);
+#endif
+
+	for (; i<bytes; i++)
+		dest[i] = (uint8)((upper[i]*w0 + lower[i]*w) >> 8);
+}
+
+
+/* ScaleRows
+
+	Scales destination rows <first_row> through <last_row> (which
+	must be within the size given to SetSize()).  Different row
+	ranges may be scaled at the same time from different threads.
+*/
+
+void BitmapScaler::ScaleRows(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 first_row, int32 last_row)
+{
+	int32 row_bytes = dest_width*4;
+	uint8 *rows = (uint8 *)malloc(row_bytes*2);
+	if (!rows) return;
+
+	uint8 *upper = rows, *lower = rows+row_bytes;
+	int32 upper_index = -1, lower_index = -1;
+
+	for (int32 y=first_row; y<=last_row; y++)
+	{
+		int32 y0 = y_index[y];
+		int32 y1 = (src_height > 1) ? y0+1 : y0;
+
+		// Reuse the horizontally scaled rows from the last
+		// destination row where possible
+		if (y0!=upper_index)
+		{
+			if (y0==lower_index)
+			{
+				uint8 *temp = upper;
+				upper = lower;
+				lower = temp;
+				upper_index = lower_index;
+				lower_index = -1;
+			}
+			else
+			{
+				ScaleRowHorizontal(src + y0*src_bpr, upper);
+				upper_index = y0;
+			}
+		}
+		if (y1!=lower_index)
+		{
+			ScaleRowHorizontal(src + y1*src_bpr, lower);
+			lower_index = y1;
+		}
+
+		BlendRows(upper, lower, y_weight[y], dest + y*dest_bpr, row_bytes);
+	}
+
+	free(rows);
+}
+
+// Checks the color spaces and sets the size from the bitmaps
+bool BitmapScaler::Prepare(BBitmap *dest, BBitmap *src)
+{
+	color_space ds = dest->ColorSpace(), ss = src->ColorSpace();
+	if ((ds!=B_RGB32 && ds!=B_RGBA32) || (ss!=B_RGB32 && ss!=B_RGBA32))
+		return false;
+
+	return SetSize((int32)src->Bounds().Width()+1, (int32)src->Bounds().Height()+1,
+		(int32)dest->Bounds().Width()+1, (int32)dest->Bounds().Height()+1);
+}
+
+bool BitmapScaler::Scale(BBitmap *dest, BBitmap *src)
+{
+	if (!Prepare(dest, src)) return false;
+
+	ScaleRows((const uint8 *)src->Bits(), src->BytesPerRow(),
+		(uint8 *)dest->Bits(), dest->BytesPerRow(), 0, dest_height-1);
+
+	return true;
+}
+
+
+//---------------------------------------------------------------------------
+// Band-parallel scaling
+//---------------------------------------------------------------------------
+
+// Bands smaller than this aren't worth handing to another thread
+#define MIN_BAND_ROWS 32
+#define MAX_SCALE_THREADS 16
+
+struct scale_band
+{
+	BitmapScaler *scaler;
+	const uint8 *src;
+	int32 src_bpr;
+	uint8 *dest;
+	int32 dest_bpr;
+	int32 first_row, last_row;
+};
+
+static BLocker scale_pool_lock("BilinearStretchBlt pool");
+static int32 scale_threads = -1;	// workers, not counting the caller
+static sem_id scale_work_sem[MAX_SCALE_THREADS];
+static thread_id scale_thread[MAX_SCALE_THREADS];
+static sem_id scale_done_sem;
+static scale_band scale_bands[MAX_SCALE_THREADS+1];
+
+static int32 ScaleThread(void *data)
+{
+	int32 n = (int32)(addr_t)data;
+
+	while (acquire_sem(scale_work_sem[n])==B_OK)
+	{
+		scale_band *b = &scale_bands[n+1];
+		b->scaler->ScaleRows(b->src, b->src_bpr, b->dest, b->dest_bpr,
+			b->first_row, b->last_row);
+		release_sem(scale_done_sem);
+	}
+
+	return 0;
+}
+
+
+/* StartScaleThreads
+
+	Spawns one worker per CPU after the first (the calling thread
+	does a band itself) the first time a picture is scaled.  The
+	workers sleep on their semaphores between pictures and last
+	until StopScaleThreads().  Called with scale_pool_lock held.
+*/
+
+static void StartScaleThreads(void)
+{
+	system_info info;
+	int32 cpus = 1;
+
+	if (get_system_info(&info)==B_OK) cpus = info.cpu_count;
+	if (cpus > MAX_SCALE_THREADS+1) cpus = MAX_SCALE_THREADS+1;
+
+	scale_threads = 0;
+	if (cpus < 2) return;
+
+	if ((scale_done_sem = create_sem(0, "BilinearStretchBlt done")) < B_OK)
+		return;
+
+	for (int32 i=0; i<cpus-1; i++)
+	{
+		thread_id t;
+
+		if ((scale_work_sem[i] = create_sem(0, "BilinearStretchBlt work")) < B_OK)
+			break;
+		t = spawn_thread(ScaleThread, "BilinearStretchBlt band",
+			B_NORMAL_PRIORITY, (void *)(addr_t)i);
+		if (t < B_OK || resume_thread(t)!=B_OK)
+		{
+			if (t >= B_OK) kill_thread(t);
+			delete_sem(scale_work_sem[i]);
+			break;
+		}
+		scale_thread[i] = t;
+		scale_threads++;
+	}
+}
+
+
+/* StopScaleThreads
+
+	Called at quit.  Waits for any scaling in progress (by holding
+	scale_pool_lock), then has the workers quit and waits for them;
+	anything scaled after this is done on the calling thread alone.
+*/
+
+void StopScaleThreads(void)
+{
+	status_t result;
+
+	BAutolock autolock(&scale_pool_lock);
+
+	for (int32 i=0; i<scale_threads; i++)
+	{
+		delete_sem(scale_work_sem[i]);
+		wait_for_thread(scale_thread[i], &result);
+	}
+	if (scale_threads > 0) delete_sem(scale_done_sem);
+	scale_threads = 0;
+}
+
+
+/* BilinearStretchBlt
+
+	Scales all of <src_bmp> to fill <dest_bmp>, splitting the
+	destination into horizontal bands that are scaled at the same
+	time on the worker threads and the calling thread.  Returns
+	once every band is done, or false if either bitmap isn't 32-bit
+	RGB.
+*/
+
+bool BilinearStretchBlt(BBitmap *dest_bmp, BBitmap *src_bmp)
+{
+	BitmapScaler scaler;
+	int32 height = (int32)dest_bmp->Bounds().Height()+1;
+
+	BAutolock autolock(&scale_pool_lock);
+
+	if (scale_threads < 0) StartScaleThreads();
+
+	int32 bands = height/MIN_BAND_ROWS;
+	if (bands > scale_threads+1) bands = scale_threads+1;
+	if (bands < 2) return scaler.Scale(dest_bmp, src_bmp);
+
+	if (!scaler.Prepare(dest_bmp, src_bmp)) return false;
+
+	const uint8 *src = (const uint8 *)src_bmp->Bits();
+	uint8 *dest = (uint8 *)dest_bmp->Bits();
+	int32 row = 0;
+	for (int32 i=0; i<bands; i++)
+	{
+		scale_band *b = &scale_bands[i];
+		b->scaler = &scaler;
+		b->src = src;
+		b->src_bpr = src_bmp->BytesPerRow();
+		b->dest = dest;
+		b->dest_bpr = dest_bmp->BytesPerRow();
+		b->first_row = row;
+		row += (height-row)/(bands-i);
+		b->last_row = row-1;
+	}
+
+	// Band 0 is done here, the rest by the workers
+	for (int32 i=1; i<bands; i++)
+		release_sem(scale_work_sem[i-1]);
+
+	scaler.ScaleRows(src, scale_bands[0].src_bpr, dest, scale_bands[0].dest_bpr,
+		scale_bands[0].first_row, scale_bands[0].last_row);
+
+	acquire_sem_etc(scale_done_sem, bands-1, 0, 0);
+
+	return true;
+}
+
+
+//---------------------------------------------------------------------------
+// 2x2 box-filter halving
+//---------------------------------------------------------------------------
+
+#if defined (HAVE_X86_SIMD)
+
+// Halves as many of the <dw> output pixels as it can two at a time:
+// four source pixels from each row make two output pixels, with the
+// rows added as 16-bit values, then each pair of neighbouring pixels.
+// Returns how many it did.
+TARGET_SSE2
+static int32 HalveRowSSE2(const uint8 *r0, const uint8 *r1, uint8 *out,
+	int32 dw)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(2);
+	int32 x = 0;
+
+	for (; x+2<=dw; x+=2)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(r0 + x*8));
+		__m128i b = _mm_loadu_si128((const __m128i *)(r1 + x*8));
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+			_mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+			_mm_unpackhi_epi8(b, zero));
+		__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+			_mm_unpackhi_epi64(lo, hi));
+		sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+		_mm_storel_epi64((__m128i *)(out + x*4), _mm_packus_epi16(sum, sum));
+	}
+	return x;
+}
+
+#endif	// HAVE_X86_SIMD
+
+
+/* HalveBitmap
+
+	Returns a new bitmap half the size of <src> (rounded down, but
+	at least one pixel), each pixel the average of a 2x2 block, or
+	NULL if <src> isn't 32-bit RGB or there's no memory.  Used to
+	build the pyramid that big downscales are done from.
+*/
+
+BBitmap *HalveBitmap(BBitmap *src)
+{
+	color_space ss = src->ColorSpace();
+	if (ss!=B_RGB32 && ss!=B_RGBA32) return NULL;
+
+	int32 sw = (int32)src->Bounds().Width()+1;
+	int32 sh = (int32)src->Bounds().Height()+1;
+	int32 dw = (sw > 1) ? sw/2 : 1;
+	int32 dh = (sh > 1) ? sh/2 : 1;
+
+	BBitmap *dest = new BBitmap(BRect(0, 0, dw-1, dh-1), B_RGB32);
+	if (!dest->IsValid())
+	{
+		delete dest;
+		return NULL;
+	}
+
+	const uint8 *src_bits = (const uint8 *)src->Bits();
+	uint8 *dest_bits = (uint8 *)dest->Bits();
+	int32 src_bpr = src->BytesPerRow(), dest_bpr = dest->BytesPerRow();
+#if defined (HAVE_X86_SIMD)
+	bool sse2 = CPUHasSSE2();
+#endif
+
+	for (int32 y=0; y<dh; y++)
+	{
+		const uint8 *r0 = src_bits + (y*2)*src_bpr;
+		const uint8 *r1 = (sh > 1) ? r0+src_bpr : r0;
+		uint8 *out = dest_bits + y*dest_bpr;
+		int32 x = 0;
+
+#if defined (HAVE_X86_SIMD)
+		if (sw > 1 && sse2)
+			x = HalveRowSSE2(r0, r1, out, dw);
+#endif
+
+		for (; x<dw; x++)
+		{
+			const uint8 *p0 = r0 + x*8, *p1 = r1 + x*8;
+			int32 step = (sw > 1) ? 4 : 0;
+
+			for (int c=0; c<4; c++)
+				out[x*4+c] = (uint8)((p0[c] + p0[c+step] +
+					p1[c] + p1[c+step] + 2) >> 2);
+		}
+	}
+
+	return dest;
+}
+
+
+//---------------------------------------------------------------------------
+// Benchmarking
+//---------------------------------------------------------------------------
+
+#ifdef BENCHMARK_PICTURE
+
+#include <math.h>
+
+// The original column-major, double-precision BilinearStretchBlt,
+// kept for comparison
+
+inline rgb_color BitmapPixelAt(unsigned char *src, int bpr, int x, int y)
+{
+	rgb_color c;
+	c.red   = *(src + y*bpr + x*4+2);
+	c.green = *(src + y*bpr + x*4+1);
+	c.blue  = *(src + y*bpr + x*4);
+	return c;
+}
+
+inline void SetBitmapPixelAt(unsigned char *dest, int bpr, int x, int y, rgb_color c)
+{
+	*(dest + y*bpr + x*4+2) = c.red;
+	*(dest + y*bpr + x*4+1) = c.green;
+	*(dest + y*bpr + x*4)   = c.blue;
+}
+
+static bool ReferenceStretchBlt(BBitmap *dest_bmp, BBitmap *src_bmp)
+{
+	unsigned char *dest, *src;
+	int dest_width, dest_height, src_width, src_height;
+	int dest_bpr, src_bpr;
+	double nXFactor, nYFactor;
+	double fraction_x, fraction_y, one_minus_x, one_minus_y;
+	int ceil_x, ceil_y, floor_x, floor_y;
+	rgb_color c, c1, c2, c3, c4;
+	unsigned char b1, b2;
+	int x, y;
+
+	dest = (unsigned char *)dest_bmp->Bits();
+	dest_width = (int)dest_bmp->Bounds().Width();
+	dest_height = (int)dest_bmp->Bounds().Height();
+	dest_bpr = dest_bmp->BytesPerRow();
+	src = (unsigned char *)src_bmp->Bits();
+	src_width = (int)src_bmp->Bounds().Width();
+	src_height = (int)src_bmp->Bounds().Height();
+	src_bpr = src_bmp->BytesPerRow();
+
+	nXFactor = (double)src_width/(double)dest_width;
+	nYFactor = (double)src_height/(double)dest_height;
+
+	for (x=0; x<=dest_width; x++)
+	for (y=0; y<=dest_height; y++)
+	{
+		floor_x = (int)floor(x * nXFactor);
+		floor_y = (int)floor(y * nYFactor);
+		ceil_x = floor_x + 1;
+		if (ceil_x >= src_width) ceil_x = floor_x;
+		ceil_y = floor_y + 1;
+		if (ceil_y >= src_height) ceil_y = floor_y;
+		fraction_x = x * nXFactor - floor_x;
+		fraction_y = y * nYFactor - floor_y;
+		one_minus_x = 1.0 - fraction_x;
+		one_minus_y = 1.0 - fraction_y;
+
+		c1 = BitmapPixelAt(src, src_bpr, floor_x, floor_y);
+		c2 = BitmapPixelAt(src, src_bpr, ceil_x,  floor_y);
+		c3 = BitmapPixelAt(src, src_bpr, floor_x, ceil_y);
+		c4 = BitmapPixelAt(src, src_bpr, ceil_x,  ceil_y);
+
+		// Blue
+		b1 = (unsigned char)(one_minus_x * c1.blue + fraction_x * c2.blue);
+		b2 = (unsigned char)(one_minus_x * c3.blue + fraction_x * c4.blue);
+		c.blue = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
+
+		// Green
+		b1 = (unsigned char)(one_minus_x * c1.green + fraction_x * c2.green);
+		b2 = (unsigned char)(one_minus_x * c3.green + fraction_x * c4.green);
+		c.green = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
+
+		// Red
+		b1 = (unsigned char)(one_minus_x * c1.red + fraction_x * c2.red);
+		b2 = (unsigned char)(one_minus_x * c3.red + fraction_x * c4.red);
+		c.red = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
+
+		SetBitmapPixelAt(dest, dest_bpr, x, y, c);
+	}
+
+	return true;
+}
+
+#define BENCHMARK_RUNS 3
+
+static void BenchmarkSize(int32 sw, int32 sh, int32 dw, int32 dh)
+{
+	BBitmap src(BRect(0, 0, sw-1, sh-1), B_RGB32);
+	BBitmap dest(BRect(0, 0, dw-1, dh-1), B_RGB32);
+	BitmapScaler scaler;
+	bigtime_t t, ref_time = 0, serial_time = 0, parallel_time = 0;
+	int i;
+
+	// Something other than a flat color to chew on
+	uint8 *bits = (uint8 *)src.Bits();
+	for (i=0; i<src.BitsLength(); i++)
+		bits[i] = (uint8)(i*7 + i/4096);
+
+	// Best of BENCHMARK_RUNS for each
+	for (i=0; i<BENCHMARK_RUNS; i++)
+	{
+		t = system_time();
+		ReferenceStretchBlt(&dest, &src);
+		t = system_time()-t;
+		if (!ref_time || t < ref_time) ref_time = t;
+
+		t = system_time();
+		scaler.Scale(&dest, &src);
+		t = system_time()-t;
+		if (!serial_time || t < serial_time) serial_time = t;
+
+		t = system_time();
+		BilinearStretchBlt(&dest, &src);
+		t = system_time()-t;
+		if (!parallel_time || t < parallel_time) parallel_time = t;
+	}
+
+	if (!serial_time) serial_time = 1;
+	if (!parallel_time) parallel_time = 1;
+
+	// int32 and bigtime_t aren't long and long long everywhere
+	fprintf(stderr, "BenchmarkScaling: %ldx%ld -> %ldx%ld: original %lld us, "
+		"serial %lld us (%.1fx), %ld threads %lld us (%.1fx, %.1fx over serial)\n",
+		(long)sw, (long)sh, (long)dw, (long)dh, (long long)ref_time,
+		(long long)serial_time, (double)ref_time/(double)serial_time,
+		(long)scale_threads+1, (long long)parallel_time,
+		(double)ref_time/(double)parallel_time,
+		(double)serial_time/(double)parallel_time);
+}
+
+// A big downscale done directly, versus building the pyramid once
+// and then scaling from a level of it, as after a window resize
+static void BenchmarkPyramid(int32 sw, int32 sh, int32 dw, int32 dh)
+{
+	BBitmap src(BRect(0, 0, sw-1, sh-1), B_RGB32);
+	BBitmap dest(BRect(0, 0, dw-1, dh-1), B_RGB32);
+	BBitmap *level = &src, *half;
+	bigtime_t t, direct_time = 0, build_time, level_time = 0;
+	int i, levels = 0;
+
+	uint8 *bits = (uint8 *)src.Bits();
+	for (i=0; i<src.BitsLength(); i++)
+		bits[i] = (uint8)(i*7 + i/4096);
+
+	t = system_time();
+	while (level->Bounds().Width()+1 >= dw*2 && level->Bounds().Height()+1 >= dh*2)
+	{
+		if (!(half = HalveBitmap(level))) break;
+		if (levels) delete level;
+		level = half;
+		levels++;
+	}
+	build_time = system_time()-t;
+
+	for (i=0; i<BENCHMARK_RUNS; i++)
+	{
+		t = system_time();
+		BilinearStretchBlt(&dest, &src);
+		t = system_time()-t;
+		if (!direct_time || t < direct_time) direct_time = t;
+
+		t = system_time();
+		BilinearStretchBlt(&dest, level);
+		t = system_time()-t;
+		if (!level_time || t < level_time) level_time = t;
+	}
+	if (levels) delete level;
+
+	fprintf(stderr, "BenchmarkScaling: %ldx%ld -> %ldx%ld: direct %lld us, "
+		"building pyramid to level %d %lld us, then %lld us from it\n",
+		(long)sw, (long)sh, (long)dw, (long)dh, (long long)direct_time,
+		levels, (long long)build_time, (long long)level_time);
+}
+
+void BenchmarkScaling(void)
+{
+	BenchmarkSize(1024, 768, 1920, 1080);	// typical upscale
+	BenchmarkSize(2048, 1536, 1024, 768);	// 2x downscale
+	BenchmarkPyramid(4096, 3072, 800, 600);	// 5x downscale
+}
+
+#endif	// BENCHMARK_PICTURE
@@ -0,0 +1,50 @@
+/*
+	BitmapScale.h
+*/
+
+#ifndef _BITMAPSCALE_H
+#define _BITMAPSCALE_H
+
+#include <Bitmap.h>
+
+// A bilinear scaler for B_RGB32 pixels.  The per-column and per-row
+// taps and weights are worked out once by SetSize() (in 16.16 fixed
+// point), so the same BitmapScaler can be reused for any number of
+// bitmaps of the same dimensions.
+class BitmapScaler
+{
+public:
+	BitmapScaler();
+	~BitmapScaler();
+
+	bool SetSize(int32 src_width, int32 src_height,
+		int32 dest_width, int32 dest_height);
+
+	// Scales destination rows first_row through last_row, inclusive;
+	// different ranges may be scaled from different threads at once
+	void ScaleRows(const uint8 *src, int32 src_bpr,
+		uint8 *dest, int32 dest_bpr, int32 first_row, int32 last_row);
+	bool Prepare(BBitmap *dest, BBitmap *src);
+	bool Scale(BBitmap *dest, BBitmap *src);
+
+private:
+	void FreeTables();
+	void ScaleRowHorizontal(const uint8 *src, uint8 *out);
+
+	int32 src_width, src_height;
+	int32 dest_width, dest_height;
+	int32 *x_index;		// left tap, per destination column
+	int16 *x_weight;	// (256-w) x4, w x4 per destination column
+	int32 *y_index;		// upper tap, per destination row
+	int16 *y_weight;	// lower tap's weight (0-256), per row
+};
+
+bool BilinearStretchBlt(BBitmap *dest_bmp, BBitmap *src_bmp);
+void StopScaleThreads(void);
+BBitmap *HalveBitmap(BBitmap *src);
+
+#ifdef BENCHMARK_PICTURE
+void BenchmarkScaling(void);
+#endif
+
+#endif	// ifndef _BITMAPSCALE_H
@@ -0,0 +1,50 @@
+/*
+	CPUFeatures.h
+
+	Lets the SSE2 and AVX2 paths in BitmapScale.cpp, VideoConvert.cpp
+	and drv_be.cpp be built into every x86 binary, whatever it's
+	compiled for, and picked when they're run.  A function marked
+	TARGET_SSE2 or TARGET_AVX2 may use those intrinsics, but must only
+	be called once CPUHasSSE2() or CPUHasAVX2() says the CPU has them.
+
+	HAVE_X86_SIMD is only defined where the compiler can do this (gcc
+	4.9 or later, or clang); otherwise everything is plain C.
+*/
+
+#ifndef _CPUFEATURES_H
+#define _CPUFEATURES_H
+
+#if (defined (__i386__) || defined (__x86_64__)) && (defined (__clang__) || \
+	__GNUC__ > 4 || (__GNUC__==4 && __GNUC_MINOR__>=9))
+
+#define HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#define TARGET_SSE2 __attribute__ ((target ("sse2")))
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+
+// SSE2 is always there on x86-64 (where __SSE2__ is defined), so it's
+// only ever looked for on 32-bit x86.  __builtin_cpu_supports() only
+// reports AVX2 if the OS saves the AVX registers, too.
+static inline bool CPUHasSSE2(void)
+{
+#if defined (__SSE2__)
+	return true;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static inline bool CPUHasAVX2(void)
+{
+#if defined (__AVX2__)
+	return true;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif	// x86 and gcc 4.9 or clang
+
+#endif	// ifndef _CPUFEATURES_H
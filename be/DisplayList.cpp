@@ -0,0 +1,1187 @@
+/*
+	DisplayList.cpp
+
+	A retained model of what's on the screen:  every run of text
+	drawn by FlushBuffer() (with its font, colors and text window),
+	every window cleared and every picture displayed, in the order
+	they were drawn, and moved along as the screen scrolls.
+	Whatever is completely drawn over is dropped, so the list stays
+	about as big as the screen.
+
+	When the window is resized or the fonts or default colors are
+	changed, the list is rendered again with the new metrics in one
+	pass instead of leaving the old pixels (or a blank screen) until
+	the game gets around to repainting.  Text windows keep their
+	positions in character cells, and text keeps its line within its
+	window; text that continued a line is drawn right after what came
+	before it, so changing fonts doesn't leave gaps or overlaps.
+
+	The engine's metrics, current window and cursor belong to the
+	engine thread, so the main thread only asks for the change
+	(ChangeDisplay()); the engine thread makes it the next time it's
+	idle and moves the list to match (UpdateDisplay()), then waits
+	while the main thread draws it (RedrawDisplay()).
+*/
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Autolock.h>
+#include <Messenger.h>
+
+#include "behugo.h"
+#include "DisplayList.h"
+
+extern "C"
+{
+#include "heheader.h"
+}
+
+// From herun.c:
+extern int physical_lowest_windowbottom;
+
+// Beyond this many entries, the oldest are dropped
+#define MAX_DISPLAY_ENTRIES 1024
+
+enum
+{
+	DISPLAY_CLEAR,
+	DISPLAY_TEXT,
+	DISPLAY_PICTURE
+};
+
+struct display_entry
+{
+	int type;
+	BRect rect;			// where it was drawn (for a picture, the
+					// window it was fitted to)
+	BRect window;			// the text window at the time
+	bool full_width, full_height;	// whether the window reached the
+					// right/bottom edge of the screen
+	int charwidth, fixedlineheight;	// the fixed-font metrics then
+	int lineheight;			// the line height of its font then
+
+	// DISPLAY_TEXT and DISPLAY_CLEAR
+	char *text;
+	int font;
+	uint32 encoding;
+	int fcolor, bgcolor;
+	bool underline;
+	bool over;			// drawn without filling the background
+	bool follows;			// started where the last text ended
+
+	// DISPLAY_PICTURE
+	char *source_key, *filename;
+	long pos, length;
+
+	bool shift;			// used by RedrawDisplay()
+	display_entry *next;
+};
+
+static BLocker display_lock("display list");
+int32 display_changes = 0;	// DISPLAY_* flags for UpdateDisplay()
+static display_entry *display_list = NULL, *display_tail = NULL;
+static int32 display_count = 0;
+
+// The engine's metrics as of the last entry (or redraw), which its
+// current window and cursor are measured in
+static int display_charwidth, display_fixedlineheight, display_lineheight;
+
+// The hit-test index (see below) is rebuilt by the next lookup once
+// it's dirty
+static bool index_dirty = true;
+static void IndexAdd(display_entry *e);
+static void IndexRemove(display_entry *e);
+static void IndexCompact(void);
+static void IndexScroll(BRect rect, int distance);
+
+
+static void FreeEntry(display_entry *e)
+{
+	free(e->text);
+	free(e->source_key);
+	free(e->filename);
+	delete e;
+}
+
+// Drops every entry that <rect> completely covers; called with
+// display_lock held
+static void RemoveCovered(BRect rect)
+{
+	display_entry **p = &display_list, *e;
+
+	display_tail = NULL;
+	while ((e = *p))
+	{
+		if (rect.Contains(e->rect))
+		{
+			if (e->type==DISPLAY_TEXT) IndexRemove(e);
+			*p = e->next;
+			FreeEntry(e);
+			display_count--;
+		}
+		else
+		{
+			display_tail = e;
+			p = &e->next;
+		}
+	}
+	IndexCompact();
+}
+
+// Returns a new entry for the current text window
+static display_entry *NewEntry(int type, BRect rect)
+{
+	BRect screen(window->current_rect);
+	display_entry *e = new display_entry;
+
+	e->type = type;
+	e->rect = rect;
+	e->window = BRect(physical_windowleft, physical_windowtop,
+		physical_windowright, physical_windowbottom);
+	e->full_width = (physical_windowright >= (int)screen.right);
+	e->full_height = (physical_windowbottom >= (int)screen.bottom);
+	e->charwidth = display_charwidth = FIXEDCHARWIDTH;
+	e->fixedlineheight = display_fixedlineheight = FIXEDLINEHEIGHT;
+	e->lineheight = display_lineheight = lineheight;
+	e->text = e->source_key = e->filename = NULL;
+	e->font = e->fcolor = e->bgcolor = 0;
+	e->encoding = 0;
+	e->underline = e->over = e->follows = e->shift = false;
+	e->pos = e->length = 0;
+	e->next = NULL;
+
+	return e;
+}
+
+// Called with display_lock held
+static void AppendEntry(display_entry *e)
+{
+	if (display_tail)
+		display_tail->next = e;
+	else
+		display_list = e;
+	display_tail = e;
+	if (e->type==DISPLAY_TEXT) IndexAdd(e);
+
+	if (++display_count > MAX_DISPLAY_ENTRIES)
+	{
+		display_entry *old = display_list;
+		if (old->type==DISPLAY_TEXT)
+		{
+			IndexRemove(old);
+			IndexCompact();
+		}
+		display_list = old->next;
+		FreeEntry(old);
+		display_count--;
+	}
+}
+
+
+/* RecordText
+
+	Called by FlushBuffer() for each run of text it draws.
+*/
+
+void RecordText(const char *text, BRect rect, int font, uint32 encoding,
+	int fcolor, int bgcolor, bool underline, bool over)
+{
+	BAutolock autolock(&display_lock);
+	display_entry *e = NewEntry(DISPLAY_TEXT, rect);
+
+	e->text = strdup(text);
+	e->font = font;
+	e->encoding = encoding;
+	e->fcolor = fcolor;
+	e->bgcolor = bgcolor;
+	e->underline = underline;
+	e->over = over;
+
+	// Only what's actually painted over goes:  italic text doesn't
+	// fill its background
+	if (!over) RemoveCovered(rect);
+
+	if (display_tail && display_tail->type==DISPLAY_TEXT &&
+		display_tail->rect.top==rect.top &&
+		fabs(display_tail->rect.right-rect.left) <= 1)
+	{
+		e->follows = true;
+	}
+
+	AppendEntry(e);
+}
+
+
+/* RecordPicture
+
+	Called by hugo_displaypicture() with what it needs to display
+	the picture again; <filename> is the (resource) file it came
+	from.
+*/
+
+void RecordPicture(const char *source_key, const char *filename,
+	long pos, long length)
+{
+	BAutolock autolock(&display_lock);
+	BRect rect(physical_windowleft, physical_windowtop,
+		physical_windowright, physical_windowbottom);
+	display_entry *e = NewEntry(DISPLAY_PICTURE, rect);
+
+	e->source_key = strdup(source_key);
+	e->filename = strdup(filename);
+	e->pos = pos;
+	e->length = length;
+
+	RemoveCovered(rect);
+	AppendEntry(e);
+}
+
+
+/* RecordClear
+
+	Called when <rect> is cleared to <bgcolor>.
+*/
+
+void RecordClear(BRect rect, int bgcolor)
+{
+	BAutolock autolock(&display_lock);
+	display_entry *e = NewEntry(DISPLAY_CLEAR, rect);
+
+	// A clear is its own window
+	BRect screen(window->current_rect);
+	e->window = rect;
+	e->full_width = (rect.right >= screen.right);
+	e->full_height = (rect.bottom >= screen.bottom);
+	e->bgcolor = bgcolor;
+
+	RemoveCovered(rect);
+	AppendEntry(e);
+}
+
+
+/* RecordScroll
+
+	Called when everything in <rect> is scrolled up by <distance>
+	pixels.  Text that goes past the top of it is dropped, as are
+	pictures once they're completely gone; cleared areas stay where
+	they are, since they're the backgrounds of text windows.
+*/
+
+void RecordScroll(BRect rect, int distance)
+{
+	BAutolock autolock(&display_lock);
+	display_entry **p = &display_list, *e;
+
+	display_tail = NULL;
+	while ((e = *p))
+	{
+		if (e->type!=DISPLAY_CLEAR &&
+			e->rect.top >= rect.top && e->rect.top <= rect.bottom &&
+			e->rect.left >= rect.left && e->rect.left <= rect.right)
+		{
+			e->rect.OffsetBy(0, -distance);
+			if (e->type==DISPLAY_PICTURE)
+				e->window.OffsetBy(0, -distance);
+
+			if ((e->type==DISPLAY_TEXT && e->rect.top < rect.top) ||
+				e->rect.bottom < rect.top)
+			{
+				*p = e->next;
+				FreeEntry(e);
+				display_count--;
+				continue;
+			}
+		}
+		display_tail = e;
+		p = &e->next;
+	}
+
+	// Scrolling the full width of the screen keeps the lines in
+	// order, so the index can just be moved along with them
+	if (rect.left <= 0 && rect.right >= window->current_rect.right)
+		IndexScroll(rect, distance);
+	else
+		index_dirty = true;
+}
+
+
+//---------------------------------------------------------------------------
+// Redrawing
+//---------------------------------------------------------------------------
+
+// Sets up <font> the way hugo_font() would for <e>'s font
+static void GetEntryFont(display_entry *e, BFont *font)
+{
+	uint16 face = 0;
+
+	if (e->font & BOLD_FONT) face |= B_BOLD_FACE;
+	if (e->font & ITALIC_FONT) face |= B_ITALIC_FACE;
+
+	if (e->font & PROP_FONT)
+		*font = prop_font;
+	else
+		*font = fixed_font;
+	font->SetFace(face);
+	font->SetSpacing(B_BITMAP_SPACING);
+	font->SetEncoding(e->encoding);
+}
+
+// The line height hugo_font() would use for <font>
+static int FontLineHeight(BFont *font)
+{
+	font_height h;
+
+	font->GetHeight(&h);
+	int lh = (int)ceil(h.ascent + h.descent + h.leading);
+	if (lh < FIXEDLINEHEIGHT) lh = FIXEDLINEHEIGHT;
+	return lh;
+}
+
+// Where a text window measured in the given fixed-font metrics is
+// now, in the current metrics and screen size
+static BRect MapWindow(BRect w, bool full_width, bool full_height,
+	int charwidth, int fixedlineheight)
+{
+	BRect screen(window->current_rect);
+	BRect r;
+
+	r.left = floor(w.left*FIXEDCHARWIDTH/charwidth);
+	r.top = floor(w.top*FIXEDLINEHEIGHT/fixedlineheight);
+	if (full_width)
+		r.right = screen.right;
+	else
+		r.right = floor((w.right+1)*FIXEDCHARWIDTH/charwidth)-1;
+	if (full_height)
+		r.bottom = screen.bottom;
+	else
+		r.bottom = floor((w.bottom+1)*FIXEDLINEHEIGHT/fixedlineheight)-1;
+
+	return r;
+}
+
+static void DrawEntryText(display_entry *e)
+{
+	BFont font;
+	font_height fh;
+
+	GetEntryFont(e, &font);
+	font.GetHeight(&fh);
+
+	view->SetFont(&font);
+	view->SetHighColor(hugo_color(e->fcolor));
+	view->SetLowColor(hugo_color(e->bgcolor));
+
+	if (!e->over)
+		view->FillRect(e->rect, B_SOLID_LOW);
+	else
+		view->SetDrawingMode(B_OP_OVER);
+
+	view->DrawString(e->text, BPoint(e->rect.left,
+		e->rect.top+e->lineheight-(int)ceil(fh.descent)));
+	view->SetDrawingMode(B_OP_COPY);
+
+	if (e->underline)
+	{
+		float y = e->rect.top+e->lineheight-fh.descent;
+		view->StrokeLine(BPoint(e->rect.left, y), BPoint(e->rect.right-1, y));
+	}
+}
+
+
+/* ChangeDisplay
+
+	Called on the main thread when the window has been resized
+	(DISPLAY_RESIZED), the fonts have changed (DISPLAY_FONTS), or
+	anything else that needs the screen drawn again has
+	(DISPLAY_REDRAW); the engine thread makes the change next time
+	it's idle.
+*/
+
+void ChangeDisplay(int32 changes)
+{
+	atomic_or(&display_changes, changes);
+
+	// With no engine thread, there's nothing to wait for
+	if (!he_thread_running) UpdateDisplay();
+}
+
+
+/* RemapDisplay
+
+	Works out where everything in the display list goes at the
+	current window size and with the current fonts, and moves the
+	engine's current window and text position to match.  If the
+	text position would end up below the bottom of the screen, the
+	part of the screen that scrolls is shifted up, the same way
+	HugoWindow::FrameResized() shifts the bitmap.  Returns false if
+	there's nothing to redraw.
+*/
+
+static bool RemapDisplay(void)
+{
+	BAutolock autolock(&display_lock);
+	display_entry *e, *last_text = NULL, *prev_text = NULL;
+	BRect screen(window->current_rect);
+	int cursor_x, cursor_y, shift;
+
+	if (!display_list || !FIXEDCHARWIDTH || !display_charwidth) return false;
+
+	// The engine's current window and cursor, in the metrics they
+	// were set up with
+	BRect old_window(physical_windowleft, physical_windowtop,
+		physical_windowright, physical_windowbottom);
+	BRect new_window = MapWindow(old_window,
+		physical_windowright >= (int)screen.right,
+		physical_windowbottom >= (int)screen.bottom,
+		display_charwidth, display_fixedlineheight);
+	int old_lowest = physical_lowest_windowbottom;
+	int new_lowest = physical_lowest_windowbottom*FIXEDLINEHEIGHT/display_fixedlineheight;
+
+	for (e=display_list; e; e=e->next)
+	{
+		if (e->type==DISPLAY_TEXT) last_text = e;
+	}
+
+	// If the cursor is right after the last text (or, while the
+	// engine is waiting for input, anywhere on its line, since the
+	// input line isn't recorded), it stays right after it
+	bool cursor_follows = (last_text && last_text->rect.top==current_text_y &&
+		(getline_active || fabs(last_text->rect.right-current_text_x) <= 1));
+	cursor_x = (int)(new_window.left +
+		(current_text_x-old_window.left)*FIXEDCHARWIDTH/display_charwidth);
+	cursor_y = (int)(new_window.top +
+		(current_text_y-old_window.top)*lineheight/display_lineheight);
+
+	// First work out where everything goes now
+	for (e=display_list; e; e=e->next)
+	{
+		BRect w = MapWindow(e->window, e->full_width, e->full_height,
+			e->charwidth, e->fixedlineheight);
+
+		// Whatever scrolls with the cursor
+		if (inwindow)
+			e->shift = (e->window.left==old_window.left && e->window.top==old_window.top);
+		else
+			e->shift = (e->rect.top >= old_lowest);
+
+		if (e->type==DISPLAY_TEXT)
+		{
+			BFont font;
+			GetEntryFont(e, &font);
+			int lh = FontLineHeight(&font);
+			float width = font.StringWidth(e->text);
+
+			float x, y;
+			if (e->follows && prev_text)
+			{
+				x = prev_text->rect.right;
+				y = prev_text->rect.top;
+			}
+			else
+			{
+				x = floor(w.left + (e->rect.left-e->window.left)*FIXEDCHARWIDTH/e->charwidth);
+				y = floor(w.top + (e->rect.top-e->window.top)*lh/e->lineheight + 0.5);
+			}
+			e->rect.Set(x, y, x+width, y+lh-1);
+			e->lineheight = lh;
+			prev_text = e;
+
+			if (e==last_text && cursor_follows)
+			{
+				cursor_x = (int)e->rect.right;
+				cursor_y = (int)e->rect.top;
+			}
+		}
+		else
+			e->rect = w;
+
+		e->window = w;
+		e->charwidth = FIXEDCHARWIDTH;
+		e->fixedlineheight = FIXEDLINEHEIGHT;
+	}
+
+	// Then shift up the scrolling part if the cursor would otherwise
+	// be off the bottom
+	shift = cursor_y - (int)(new_window.bottom-lineheight);
+	if (shift > 0)
+	{
+		int top = inwindow ? (int)new_window.top : new_lowest;
+		display_entry **p = &display_list;
+
+		display_tail = NULL;
+		while ((e = *p))
+		{
+			if (e->shift && e->type!=DISPLAY_CLEAR)
+			{
+				e->rect.OffsetBy(0, -shift);
+				if (e->type==DISPLAY_PICTURE)
+					e->window.OffsetBy(0, -shift);
+				if ((e->type==DISPLAY_TEXT && e->rect.top < top) ||
+					e->rect.bottom < top)
+				{
+					*p = e->next;
+					FreeEntry(e);
+					display_count--;
+					continue;
+				}
+			}
+			display_tail = e;
+			p = &e->next;
+		}
+		cursor_y -= shift;
+	}
+
+	index_dirty = true;
+
+	// Move the engine's window and cursor to match
+	physical_windowleft = (int)new_window.left;
+	physical_windowtop = (int)new_window.top;
+	physical_windowright = (int)new_window.right;
+	physical_windowbottom = (int)new_window.bottom;
+	physical_windowwidth = physical_windowright-physical_windowleft+1;
+	physical_windowheight = physical_windowbottom-physical_windowtop+1;
+	physical_lowest_windowbottom = new_lowest;
+	current_text_x = cursor_x;
+	current_text_y = cursor_y;
+	ConstrainCursor();
+
+	display_charwidth = FIXEDCHARWIDTH;
+	display_fixedlineheight = FIXEDLINEHEIGHT;
+	display_lineheight = lineheight;
+
+	// RedrawDisplay() draws the whole bitmap from the top
+	view->scroll_offset = 0;
+
+	return true;
+}
+
+
+/* UpdateDisplay
+
+	Called by the engine thread whenever it's idle (see
+	IDLE_ENGINE_THREAD) to make the changes asked for by
+	ChangeDisplay(), so that nothing it's in the middle of drawing
+	sees its metrics, window or cursor change.  Once the display
+	list has been moved to match, the main thread draws it, and the
+	engine waits until it has.  If the engine is waiting for input,
+	the input line is then redrawn (see hugo_getline()).
+*/
+
+void UpdateDisplay(void)
+{
+	int32 changes = atomic_and(&display_changes, 0);
+	if (!changes) return;
+
+	FlushBuffer();
+	if (changes & DISPLAY_FONTS) ResetFontMetrics();
+	if (changes & DISPLAY_RESIZED) ScreenResized();
+
+	if (!RemapDisplay()) return;
+
+	if (find_thread(NULL)==he_thread)
+	{
+		// The reply comes when the message is done with, even if
+		// the window is quitting instead
+		BMessage reply;
+		BMessenger(window).SendMessage(MSG_REDRAW_DISPLAY, &reply);
+	}
+	else
+		RedrawDisplay();
+
+	if (getline_active) PushKeypress(REDRAW_INPUT_LINE);
+}
+
+
+/* RedrawDisplay
+
+	Renders the display list again from scratch, as UpdateDisplay()
+	has just laid it out.  Called on the main thread, while the
+	engine thread waits.
+*/
+
+bool RedrawDisplay(void)
+{
+	BAutolock autolock(&display_lock);
+	display_entry *e;
+	BRect screen(window->current_rect);
+
+	if (!display_list) return false;
+
+	if (!bitmap->Lock()) return false;
+
+	// The whole bitmap, including the scrolling area below the
+	// visible part, since RemapDisplay() reset scroll_offset
+	BRect all(screen);
+	all.bottom = all.bottom*2+1;
+	view->SetLowColor(hugo_color(bgcolor));
+	view->FillRect(all, B_SOLID_LOW);
+
+	for (e=display_list; e; e=e->next)
+	{
+		switch (e->type)
+		{
+			case DISPLAY_CLEAR:
+				view->SetLowColor(hugo_color(e->bgcolor));
+				view->FillRect(e->rect, B_SOLID_LOW);
+				break;
+			case DISPLAY_TEXT:
+				DrawEntryText(e);
+				break;
+			case DISPLAY_PICTURE:
+				// Displaying it locks picture_cache and then
+				// the bitmap, so don't hold the bitmap
+				bitmap->Unlock();
+				RedisplayPicture(e->source_key, e->filename,
+					e->pos, e->length, e->window);
+				if (!bitmap->Lock()) return false;
+				break;
+		}
+	}
+
+	view->SetFont(&current_font);
+	view->SetHighColor(current_text_color);
+	view->SetLowColor(current_back_color);
+	view->Sync();
+	bitmap->Unlock();
+
+	visible_view->Draw(screen);
+
+	return true;
+}
+
+
+//---------------------------------------------------------------------------
+// Hit testing
+//---------------------------------------------------------------------------
+
+/*
+	The text entries are indexed by line:  index_lines holds the
+	lines in order down the screen, each with its range of
+	index_spans, which are sorted left to right.  (Text on the same
+	line always has the same top, since it's all drawn at
+	current_text_y.)  Finding the text at a point is then a binary
+	search for the line, another for the span, and a third for the
+	character.
+
+	New text nearly always goes after everything else, at the end
+	of the last line or on a new line below it, so it's usually just
+	appended; otherwise it's inserted where it belongs.  Text that's
+	drawn over or dropped is taken out of its line, and scrolling the
+	full width of the screen just moves the lines up.  Anything else
+	(a partial-width scroll or a redraw) marks the index dirty, and
+	the next lookup rebuilds it.
+*/
+
+// The most text in one entry (MAX_FLUSH_BUFFER in hebe.cpp)
+#define MAX_SPAN_LENGTH 512
+
+struct index_line
+{
+	float top, bottom;
+	int32 first, count;	// in index_spans
+};
+
+static index_line *index_lines = NULL;
+static display_entry **index_spans = NULL;
+static int32 index_line_count = 0, index_span_count = 0;
+
+// How many spans IndexRemove() has set to NULL for IndexCompact() to
+// close up, and the first line with one
+static int32 index_holes = 0, index_hole_line = 0;
+
+// Allocates the index, the first time, with room for every entry
+// there can be (AppendEntry() adds one before dropping the oldest),
+// so that it never has to grow
+static bool IndexSpace(void)
+{
+	if (index_lines && index_spans) return true;
+
+	if (!index_lines)
+		index_lines = (index_line *)malloc((MAX_DISPLAY_ENTRIES+1)*sizeof(index_line));
+	if (!index_spans)
+		index_spans = (display_entry **)malloc((MAX_DISPLAY_ENTRIES+1)*
+			sizeof(display_entry *));
+	return (index_lines && index_spans);
+}
+
+// Returns the number of lines whose top is above <y>
+static int32 LinesAbove(float y)
+{
+	int32 lo = 0, hi = index_line_count;
+
+	while (lo < hi)
+	{
+		int32 mid = (lo+hi)/2;
+		if (index_lines[mid].top < y)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Called with display_lock held for every new text entry
+static void IndexAdd(display_entry *e)
+{
+	index_line *line;
+	int32 l, at, i;
+
+	if (index_dirty) return;
+	if (!IndexSpace())
+	{
+		index_dirty = true;
+		return;
+	}
+
+	l = LinesAbove(e->rect.top);
+	if (l < index_line_count && index_lines[l].top==e->rect.top)
+	{
+		// After every span on the line that starts at or left of it,
+		// which is usually all of them
+		line = &index_lines[l];
+		for (at=line->count; at > 0 &&
+			index_spans[line->first+at-1]->rect.left > e->rect.left; at--);
+		at += line->first;
+		line->count++;
+		if (e->rect.bottom > line->bottom) line->bottom = e->rect.bottom;
+	}
+	else
+	{
+		// A new line, usually below all the others
+		at = (l < index_line_count) ? index_lines[l].first : index_span_count;
+		memmove(&index_lines[l+1], &index_lines[l],
+			(index_line_count-l)*sizeof(index_line));
+		index_line_count++;
+		line = &index_lines[l];
+		line->top = e->rect.top;
+		line->bottom = e->rect.bottom;
+		line->first = at;
+		line->count = 1;
+	}
+
+	memmove(&index_spans[at+1], &index_spans[at],
+		(index_span_count-at)*sizeof(display_entry *));
+	index_spans[at] = e;
+	index_span_count++;
+	for (i=l+1; i<index_line_count; i++)
+		index_lines[i].first++;
+}
+
+// Takes <e> out of its line, leaving a hole; called with display_lock
+// held, and followed by IndexCompact() before the index is used again
+static void IndexRemove(display_entry *e)
+{
+	int32 l, i;
+
+	if (index_dirty) return;
+
+	l = LinesAbove(e->rect.top);
+	if (l < index_line_count && index_lines[l].top==e->rect.top)
+	{
+		index_line *line = &index_lines[l];
+
+		for (i=0; i<line->count; i++)
+		{
+			if (index_spans[line->first+i]==e)
+			{
+				index_spans[line->first+i] = NULL;
+				if (!index_holes++ || l < index_hole_line)
+					index_hole_line = l;
+				return;
+			}
+		}
+	}
+
+	// It isn't where it should be, so the index is out of step
+	index_dirty = true;
+}
+
+// Closes up the holes left by IndexRemove(), dropping any lines left
+// empty; the lines above the first hole stay as they are
+static void IndexCompact(void)
+{
+	int32 lines, spans, i, j;
+
+	if (!index_holes) return;
+	index_holes = 0;
+	if (index_dirty) return;
+
+	lines = index_hole_line;
+	spans = index_lines[lines].first;
+	for (i=index_hole_line; i<index_line_count; i++)
+	{
+		index_line line = index_lines[i];
+		int32 first = spans;
+		float bottom = line.top;
+
+		for (j=0; j<line.count; j++)
+		{
+			display_entry *e = index_spans[line.first+j];
+			if (!e) continue;
+			index_spans[spans++] = e;
+			if (e->rect.bottom > bottom) bottom = e->rect.bottom;
+		}
+		if (spans > first)
+		{
+			index_lines[lines].top = line.top;
+			index_lines[lines].bottom = bottom;
+			index_lines[lines].first = first;
+			index_lines[lines].count = spans-first;
+			lines++;
+		}
+	}
+	index_line_count = lines;
+	index_span_count = spans;
+}
+
+// Called by RecordScroll() after it has moved (and dropped) the
+// entries themselves
+static void IndexScroll(BRect rect, int distance)
+{
+	int32 start, end, gone, i;
+
+	if (index_dirty) return;
+
+	start = LinesAbove(rect.top);
+	for (end=start; end<index_line_count && index_lines[end].top<=rect.bottom; end++)
+	{
+		index_lines[end].top -= distance;
+		index_lines[end].bottom -= distance;
+	}
+
+	// The lines that went off the top, whose entries are gone
+	for (gone=start; gone<end && index_lines[gone].top<rect.top; gone++);
+	if (gone > start)
+	{
+		int32 first = index_lines[start].first;
+		int32 spans = ((gone < index_line_count) ?
+			index_lines[gone].first : index_span_count) - first;
+
+		memmove(&index_spans[first], &index_spans[first+spans],
+			(index_span_count-first-spans)*sizeof(display_entry *));
+		index_span_count -= spans;
+		memmove(&index_lines[start], &index_lines[gone],
+			(index_line_count-gone)*sizeof(index_line));
+		index_line_count -= gone-start;
+		for (i=start; i<index_line_count; i++)
+			index_lines[i].first -= spans;
+	}
+}
+
+static int CompareSpans(const void *a, const void *b)
+{
+	const display_entry *ea = *(const display_entry **)a;
+	const display_entry *eb = *(const display_entry **)b;
+
+	if (ea->rect.top!=eb->rect.top)
+		return (ea->rect.top < eb->rect.top) ? -1 : 1;
+	if (ea->rect.left!=eb->rect.left)
+		return (ea->rect.left < eb->rect.left) ? -1 : 1;
+	return 0;
+}
+
+static void RebuildIndex(void)
+{
+	display_entry *e;
+	int32 i;
+
+	index_line_count = index_span_count = 0;
+	index_holes = 0;
+	if (!IndexSpace()) return;
+
+	for (e=display_list; e; e=e->next)
+	{
+		if (e->type==DISPLAY_TEXT) index_spans[index_span_count++] = e;
+	}
+	qsort(index_spans, index_span_count, sizeof(display_entry *), CompareSpans);
+
+	for (i=0; i<index_span_count; i++)
+	{
+		e = index_spans[i];
+		if (index_line_count && index_lines[index_line_count-1].top==e->rect.top)
+		{
+			index_line *line = &index_lines[index_line_count-1];
+			line->count++;
+			if (e->rect.bottom > line->bottom) line->bottom = e->rect.bottom;
+		}
+		else
+		{
+			index_line *line = &index_lines[index_line_count++];
+			line->top = e->rect.top;
+			line->bottom = e->rect.bottom;
+			line->first = i;
+			line->count = 1;
+		}
+	}
+
+	index_dirty = false;
+}
+
+// Returns the last line whose top is at or above <y>, or -1
+static int32 FindLine(float y)
+{
+	int32 lo = 0, hi = index_line_count-1, found = -1;
+
+	while (lo <= hi)
+	{
+		int32 mid = (lo+hi)/2;
+		if (index_lines[mid].top <= y)
+		{
+			found = mid;
+			lo = mid+1;
+		}
+		else
+			hi = mid-1;
+	}
+	return found;
+}
+
+// Returns the last span on <line> (counting from 0) that starts at
+// or left of <x>, or -1
+static int32 FindSpan(index_line *line, float x)
+{
+	int32 lo = 0, hi = line->count-1, found = -1;
+
+	while (lo <= hi)
+	{
+		int32 mid = (lo+hi)/2;
+		if (index_spans[line->first+mid]->rect.left <= x)
+		{
+			found = mid;
+			lo = mid+1;
+		}
+		else
+			hi = mid-1;
+	}
+	return found;
+}
+
+// Returns the offset in <e>'s text of the character at <x> or, if
+// <nearest> is true, of the character boundary nearest <x>, and
+// sets *cx to where it is
+static int32 FindOffset(display_entry *e, float x, bool nearest, float *cx)
+{
+	int32 starts[MAX_SPAN_LENGTH+1], count = 0, i, lo, hi;
+	float dx = x - e->rect.left, w;
+	BFont font;
+
+	GetEntryFont(e, &font);
+
+	// In UTF-8, continuation bytes don't start characters
+	for (i=0; e->text[i] && i<MAX_SPAN_LENGTH; i++)
+	{
+		if (e->encoding!=B_UNICODE_UTF8 || (e->text[i] & 0xc0)!=0x80)
+			starts[count++] = i;
+	}
+	starts[count++] = i;
+
+	lo = 0, hi = count-1;
+	while (lo < hi)
+	{
+		int32 mid = (lo+hi+1)/2;
+		if (font.StringWidth(e->text, starts[mid]) <= dx)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+
+	w = font.StringWidth(e->text, starts[lo]);
+	if (nearest && lo+1 < count)
+	{
+		float next = font.StringWidth(e->text, starts[lo+1]);
+		if (next-dx < dx-w)
+		{
+			lo++;
+			w = next;
+		}
+	}
+	if (cx) *cx = e->rect.left + w;
+
+	return starts[lo];
+}
+
+// Copies the text of <line> to <text> (at most <size>-1 bytes), with
+// a space wherever there's a gap between spans, and returns its
+// length; if <at> isn't NULL, it's set to where <offset> in <span>
+// ends up
+static int32 LineText(index_line *line, char *text, int32 size,
+	int32 span, int32 offset, int32 *at)
+{
+	int32 len = 0, i, n;
+
+	for (i=0; i<line->count; i++)
+	{
+		display_entry *e = index_spans[line->first+i];
+
+		if (i > 0 && len < size-1 &&
+			e->rect.left - index_spans[line->first+i-1]->rect.right > 1)
+		{
+			text[len++] = ' ';
+		}
+		if (i==span && at) *at = len+offset;
+
+		n = strlen(e->text);
+		if (n > size-1-len) n = size-1-len;
+		memcpy(text+len, e->text, n);
+		len += n;
+	}
+	text[len] = '\0';
+	if (at && *at > len) *at = len;
+
+	return len;
+}
+
+
+/* FindDisplayPosition
+
+	Finds the character boundary in the text on the screen nearest
+	<point>:  on the line at or above it (or the first line), in the
+	span at or left of it.  Returns false if there's no text.
+*/
+
+bool FindDisplayPosition(BPoint point, display_position *pos)
+{
+	BAutolock autolock(&display_lock);
+	index_line *line;
+	display_entry *e;
+
+	if (index_dirty) RebuildIndex();
+	if (!index_line_count) return false;
+
+	pos->line = FindLine(point.y);
+	if (pos->line < 0) pos->line = 0;
+	line = &index_lines[pos->line];
+
+	pos->span = FindSpan(line, point.x);
+	if (pos->span < 0)
+	{
+		pos->span = 0;
+		pos->offset = 0;
+		pos->x = index_spans[line->first]->rect.left;
+	}
+	else
+	{
+		e = index_spans[line->first+pos->span];
+		pos->offset = FindOffset(e, point.x, true, &pos->x);
+	}
+
+	return true;
+}
+
+
+/* GetDisplayWord
+
+	Copies the word at <point> on the screen to <word>, which holds
+	<size> bytes.  The whole line is searched, so a word drawn in
+	more than one piece (e.g., partly in bold) is found whole.
+	Returns false if there's no word there.
+*/
+
+static bool IsWordChar(unsigned char c)
+{
+	return (isalnum(c) || c=='-' || c=='\'' || c>=0x80);
+}
+
+bool GetDisplayWord(BPoint point, char *word, int32 size)
+{
+	BAutolock autolock(&display_lock);
+	char text[MAX_SPAN_LENGTH*2];
+	int32 l, s, at, start, end;
+	index_line *line;
+	display_entry *e;
+
+	if (index_dirty) RebuildIndex();
+
+	if ((l = FindLine(point.y)) < 0) return false;
+	line = &index_lines[l];
+	if (point.y > line->bottom) return false;
+
+	if ((s = FindSpan(line, point.x)) < 0) return false;
+	e = index_spans[line->first+s];
+	if (point.x > e->rect.right) return false;
+
+	LineText(line, text, sizeof(text), s, FindOffset(e, point.x, false, NULL), &at);
+	if (!IsWordChar(text[at])) return false;
+
+	for (start=at; start>0 && IsWordChar(text[start-1]); start--);
+	for (end=at; text[end] && IsWordChar(text[end]); end++);
+	if (end-start > size-1) end = start+size-1;
+
+	memcpy(word, text+start, end-start);
+	word[end-start] = '\0';
+
+	return true;
+}
+
+
+/* GetDisplayText
+
+	Copies the text on the screen between two positions found by
+	FindDisplayPosition() to <text>, which holds <size> bytes,
+	with a newline between lines, and returns its length.
+*/
+
+int32 GetDisplayText(const display_position *from, const display_position *to,
+	char *text, int32 size)
+{
+	BAutolock autolock(&display_lock);
+	char line_text[MAX_SPAN_LENGTH*2];
+	int32 len = 0, l, start, end, n;
+
+	text[0] = '\0';
+	if (index_dirty) RebuildIndex();
+
+	// In order down the screen
+	if (to->line < from->line ||
+		(to->line==from->line && to->x < from->x))
+	{
+		const display_position *p = from;
+		from = to;
+		to = p;
+	}
+
+	for (l=from->line; l<=to->line && l<index_line_count; l++)
+	{
+		index_line *line = &index_lines[l];
+
+		n = LineText(line, line_text, sizeof(line_text),
+			(l==from->line) ? from->span : -1, from->offset, &start);
+		if (l!=from->line) start = 0;
+		end = n;
+		if (l==to->line) LineText(line, line_text, sizeof(line_text),
+			to->span, to->offset, &end);
+
+		if (l > from->line && len < size-1) text[len++] = '\n';
+		n = end-start;
+		if (n > size-1-len) n = size-1-len;
+		if (n > 0)
+		{
+			memcpy(text+len, line_text+start, n);
+			len += n;
+		}
+	}
+	text[len] = '\0';
+
+	return len;
+}
+
+
+/* GetDisplayLineRect
+
+	Returns the area taken up by the text on <line>.
+*/
+
+BRect GetDisplayLineRect(int32 line)
+{
+	BAutolock autolock(&display_lock);
+	index_line *l;
+
+	if (index_dirty) RebuildIndex();
+	if (line < 0 || line >= index_line_count) return BRect();
+
+	l = &index_lines[line];
+	return BRect(index_spans[l->first]->rect.left, l->top,
+		index_spans[l->first+l->count-1]->rect.right, l->bottom);
+}
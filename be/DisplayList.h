@@ -0,0 +1,50 @@
+/*
+	DisplayList.h
+*/
+
+#ifndef _DISPLAYLIST_H
+#define _DISPLAYLIST_H
+
+#include <Rect.h>
+#include <SupportDefs.h>
+
+// Called by the engine interface as it draws (see hebe.cpp and
+// picture.cpp); rects are in screen coordinates, i.e., without any
+// scroll_offset
+void RecordText(const char *text, BRect rect, int font, uint32 encoding,
+	int fcolor, int bgcolor, bool underline, bool over);
+void RecordPicture(const char *source_key, const char *filename,
+	long pos, long length);
+void RecordClear(BRect rect, int bgcolor);
+void RecordScroll(BRect rect, int distance);
+
+// What ChangeDisplay() can ask for
+enum
+{
+	DISPLAY_RESIZED = 1,
+	DISPLAY_FONTS = 2,
+	DISPLAY_REDRAW = 4
+};
+
+void ChangeDisplay(int32 changes);	// main thread
+void UpdateDisplay(void);		// engine thread
+bool RedrawDisplay(void);		// main thread, for MSG_REDRAW_DISPLAY
+
+extern int32 display_changes;
+
+// A place in the text on the screen, from FindDisplayPosition()
+struct display_position
+{
+	int32 line;		// counting down the screen
+	int32 span;		// separately drawn piece of text, left to right
+	int32 offset;		// in the span's text
+	float x;		// where that character starts
+};
+
+bool FindDisplayPosition(BPoint point, display_position *pos);
+bool GetDisplayWord(BPoint point, char *word, int32 size);
+int32 GetDisplayText(const display_position *from, const display_position *to,
+	char *text, int32 size);
+BRect GetDisplayLineRect(int32 line);
+
+#endif	// ifndef _DISPLAYLIST_H
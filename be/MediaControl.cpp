@@ -0,0 +1,168 @@
+/*
+	MediaControl.cpp
+
+	Media threads--the MediaView AudioThread, the MIDIThread and the
+	VideoThread--used to wake every 20ms to check enable_audio,
+	audio_factory_suspended, quit_he_thread and their own flags.
+	Now each opens a channel (a port) with media_control and blocks
+	on it, and whatever changes that state posts a message instead:
+	the window suspending or resuming audio, a stop, quitting, or
+	the media itself reaching its end.  With nothing changing, they
+	don't wake at all.
+
+	Every message about audio is the same MEDIA_CONTROL_AUDIO (or
+	MEDIA_CONTROL_VOLUME), and the thread asks AudioSuspended() (or
+	its volume setting) what the state is now, so if a channel is
+	ever full and a message is dropped, the one already waiting does
+	just as well.  A STOP or QUIT can't be dropped like that, so it's
+	also remembered for the channel, and Wait() returns it in place
+	of whatever it reads from then on.
+*/
+
+#include <stdio.h>
+
+#include "MediaControl.h"
+
+// Messages a channel holds before Post() gives up on it
+#define MEDIA_CONTROL_PORT_CAPACITY 8
+
+MediaControl media_control;
+
+MediaControl::MediaControl()
+	: BLocker("MediaControl")
+{
+	port_count = 0;
+	audio_suspended = false;
+	quitting = false;
+}
+
+
+/* Open
+
+	Returns the new channel, or an error if it can't be created
+	(or there are already MEDIA_CONTROL_MAX_CHANNELS).
+*/
+
+port_id MediaControl::Open(const char *name)
+{
+	port_id port;
+
+	Lock();
+	if (port_count >= MEDIA_CONTROL_MAX_CHANNELS)
+		port = B_NO_MORE_PORTS;
+	else if ((port = create_port(MEDIA_CONTROL_PORT_CAPACITY, name)) >= B_OK)
+	{
+		stops[port_count] = 0;
+		ports[port_count++] = port;
+
+		// In case it's too late to be told
+		if (quitting) Post(port, MEDIA_CONTROL_QUIT);
+	}
+	Unlock();
+
+	return port;
+}
+
+void MediaControl::Close(port_id port)
+{
+	Lock();
+	for (int32 i=0; i<port_count; i++)
+	{
+		if (ports[i]==port)
+		{
+			port_count--;
+			ports[i] = ports[port_count];
+			stops[i] = stops[port_count];
+			break;
+		}
+	}
+	Unlock();
+
+	delete_port(port);
+}
+
+
+/* Wait
+
+	Blocks until there's a message on <port>, and returns it, unless
+	a STOP or QUIT has been posted to it, in which case that's
+	returned instead.  If the port is gone, that's taken as
+	MEDIA_CONTROL_QUIT.
+*/
+
+int32 MediaControl::Wait(port_id port)
+{
+	int32 code;
+
+	if (read_port(port, &code, NULL, 0) < B_OK)
+		return MEDIA_CONTROL_QUIT;
+
+	Lock();
+	for (int32 i=0; i<port_count; i++)
+	{
+		if (ports[i]==port && stops[i])
+		{
+			code = stops[i];
+			break;
+		}
+	}
+	Unlock();
+
+	return code;
+}
+
+void MediaControl::Post(port_id port, int32 code)
+{
+	if (code==MEDIA_CONTROL_STOP || code==MEDIA_CONTROL_QUIT)
+	{
+		Lock();
+		for (int32 i=0; i<port_count; i++)
+		{
+			// (QUIT outranks STOP)
+			if (ports[i]==port && stops[i]!=MEDIA_CONTROL_QUIT)
+				stops[i] = code;
+		}
+		Unlock();
+	}
+
+	write_port_etc(port, code, NULL, 0, B_TIMEOUT, 0);
+}
+
+void MediaControl::Broadcast(int32 code)
+{
+	Lock();
+	for (int32 i=0; i<port_count; i++)
+		Post(ports[i], code);
+	Unlock();
+}
+
+void MediaControl::SetAudioSuspended(bool suspended)
+{
+	Lock();
+	if (suspended!=audio_suspended)
+	{
+		audio_suspended = suspended;
+#ifdef DEBUG_SOUND
+fprintf(stderr, "MediaControl: audio %s, %ld channels\n",
+	suspended?"suspended":"resumed", port_count);
+#endif
+		Broadcast(MEDIA_CONTROL_AUDIO);
+	}
+	Unlock();
+}
+
+void MediaControl::VolumeChanged()
+{
+	Broadcast(MEDIA_CONTROL_VOLUME);
+}
+
+void MediaControl::Quit()
+{
+	Lock();
+	if (!quitting)
+	{
+		quitting = true;
+		Broadcast(MEDIA_CONTROL_QUIT);
+	}
+	Unlock();
+}
@@ -0,0 +1,60 @@
+/*
+	MediaControl.h
+*/
+
+#ifndef _MEDIA_CONTROL_H
+#define _MEDIA_CONTROL_H
+
+#include <Locker.h>
+#include <OS.h>
+
+// What a media thread can be told on its channel
+enum
+{
+	MEDIA_CONTROL_AUDIO = 'mAud',		// see AudioSuspended()
+	MEDIA_CONTROL_VOLUME = 'mVol',		// see its volume setting
+	MEDIA_CONTROL_STOP = 'mStp',
+	MEDIA_CONTROL_QUIT = 'mQut',
+	MEDIA_CONTROL_FINISHED = 'mEnd'		// it's played to the end
+};
+
+#define MEDIA_CONTROL_MAX_CHANNELS 16
+
+class MediaControl : public BLocker
+{
+public:
+	MediaControl();
+
+	// A media thread opens a channel to hear about changes, and
+	// waits on it; Close() deletes it
+	port_id Open(const char *name);
+	void Close(port_id port);
+	int32 Wait(port_id port);
+
+	// Never blocks, and does nothing if <port> is gone; a STOP or
+	// QUIT is kept even if the channel is full (see Wait())
+	void Post(port_id port, int32 code);
+
+	// Tells every channel if it changes
+	void SetAudioSuspended(bool suspended);
+	bool AudioSuspended() const { return audio_suspended; }
+
+	// Tells every channel that music_volume or sample_volume has
+	// changed
+	void VolumeChanged();
+
+	void Quit();
+
+private:
+	void Broadcast(int32 code);
+
+	port_id ports[MEDIA_CONTROL_MAX_CHANNELS];
+	int32 stops[MEDIA_CONTROL_MAX_CHANNELS];	// STOP or QUIT posted
+	int32 port_count;
+	volatile bool audio_suspended;
+	bool quitting;
+};
+
+extern MediaControl media_control;
+
+#endif	// ifndef _MEDIA_CONTROL_H
@@ -19,10 +19,14 @@
 #include "MediaFile.h"
 #include "MediaTrack.h"
 #include "AudioOutput.h"
+#include "BitmapScale.h"
+#include "MediaControl.h"
+#include "VideoConvert.h"
 
 
 MediaView::MediaView(BRect frame, const char *name, uint32 resizeMask, uint32 flags)
-	: BView(frame, name, resizeMask, flags)
+	: BView(frame, name, resizeMask, flags),
+	fSeekLock("MediaView::fSeekLock")
 {
 	InitObject();
 }
@@ -119,6 +123,46 @@ status_t MediaView::SetMediaSource(BDataIO *source)
 			return err;
 		}
 
+		fWakeSem = create_sem(0, "MediaView::fWakeSem");
+		if (fWakeSem < B_NO_ERROR)
+		{
+			err = fWakeSem;
+			fWakeSem = B_ERROR;
+			Reset();
+			return err;
+		}
+		if (fAudioOutput != NULL)
+			fAudioOutput->SetFinishedSem(fWakeSem);
+
+		if (fVideoTrack != NULL)
+		{
+			fFreeSem = create_sem(VIDEO_QUEUE_LENGTH, "MediaView::fFreeSem");
+			fFilledSem = create_sem(0, "MediaView::fFilledSem");
+			fSeekSem = create_sem(0, "MediaView::fSeekSem");
+			if (fFreeSem < B_NO_ERROR || fFilledSem < B_NO_ERROR ||
+				fSeekSem < B_NO_ERROR)
+			{
+				kill_thread(fPlayerThread);
+				fPlayerThread = B_ERROR;
+				Reset();
+				return B_NO_MEMORY;
+			}
+
+			fDecoderThread = spawn_thread(MediaView::VideoDecoder,
+				"MediaView::VideoDecoder", B_DISPLAY_PRIORITY, this);
+			if (fDecoderThread < B_NO_ERROR ||
+				resume_thread(fDecoderThread)!=B_NO_ERROR)
+			{
+				err = fDecoderThread;
+				kill_thread(fDecoderThread);
+				fDecoderThread = B_ERROR;
+				kill_thread(fPlayerThread);
+				fPlayerThread = B_ERROR;
+				Reset();
+				return (err < B_NO_ERROR) ? err : B_ERROR;
+			}
+		}
+
 		err = resume_thread(fPlayerThread);
 	
 		if (err!=B_NO_ERROR)
@@ -195,9 +239,8 @@ void MediaView::GetPreferredSize(float *width, float *height)
 	}
 	else
 	{
-		BRect bitmapBounds = fBitmap->Bounds();
-		*width = bitmapBounds.Width();
-		*height = bitmapBounds.Height();
+		*width = fVideoBounds.Width();
+		*height = fVideoBounds.Height();
 	}
 }
 
@@ -214,6 +257,12 @@ void MediaView::DetachedFromWindow()
 
 void MediaView::FrameResized(float width, float height)
 {
+	// Frames from here on are scaled to the new size by VideoDecoder()
+	BRect bounds = Bounds();
+	fSeekLock.Lock();
+	fDisplayBounds.Set(0, 0, bounds.IntegerWidth(), bounds.IntegerHeight());
+	fSeekLock.Unlock();
+
 	Draw(Bounds());
 }
 
@@ -231,9 +280,31 @@ void MediaView::InitObject()
 	fPlayerThread = B_ERROR;
 	fPlaySem = B_ERROR;
 	fScrubSem = B_ERROR;
+	fWakeSem = B_ERROR;
+	fNotifyPort = B_ERROR;
 	fPlaying = false;
 	fSnoozing = false;
-	fAudioDumpingBuffer = NULL;
+
+	for (int32 i = 0; i < VIDEO_QUEUE_LENGTH; i++)
+		fFrames[i].bitmap = fFrames[i].display = NULL;
+	fFillIndex = fShowIndex = 0;
+	fFreeSem = B_ERROR;
+	fFilledSem = B_ERROR;
+	fSeekSem = B_ERROR;
+	fDecoderThread = B_ERROR;
+	fDecoderQuit = false;
+	fGeneration = 0;
+	fSeekTime = 0;
+	fFramesShown = fFramesDropped = fFramesLate = 0;
+	fClockBase = 0;
+	fClockValid = false;
+	fFramesSkipped = fCatchUps = 0;
+	fConverting = false;
+	fProcessing = false;
+	fScratchBitmap = NULL;
+	fScaler = NULL;
+	fDecodeSpace = B_NO_COLOR_SPACE;
+	fDecodeBytesPerRow = B_ANY_BYTES_PER_ROW;
 
 	SetViewColor(B_TRANSPARENT_32_BIT);
 	
@@ -269,10 +340,15 @@ status_t MediaView::SetVideoTrack(BMediaTrack *track, media_format *format)
 		delete fBitmap;
 		fBitmap = new BBitmap(bitmapBounds, 0, fBitmapDepth, bpr);
 		fUsingOverlay = false;
+
+		// Decoding to YCbCr and converting it here is much faster than
+		// having the codec produce RGB
+		if (fBitmap->ColorSpace() == B_RGB32)
+			SetConversion(bitmapBounds);
 	};
 
 	/* loop, asking the track for a format we can deal with */
-	for(;;)
+	while (!fConverting)
 	{
 		media_format mf, old_mf;
 
@@ -297,12 +373,38 @@ status_t MediaView::SetVideoTrack(BMediaTrack *track, media_format *format)
 		fBitmap = new BBitmap(bitmapBounds, 0, fBitmapDepth, bpr);
 	}
 
+	if (!fConverting)
+	{
+		fDecodeSpace = fBitmap->ColorSpace();
+		fDecodeBytesPerRow = fBitmap->BytesPerRow();
+	}
+
+	fVideoBounds = fDisplayBounds = bitmapBounds;
+	fProcessing = (!fUsingOverlay && fBitmap->ColorSpace() == B_RGB32);
+	if (fProcessing)
+		fScaler = new BitmapScaler;
+
+	if (!AllocateFrames(bitmapBounds))
+	{
+		FreeFrames();
+		delete fBitmap;
+		fBitmap = NULL;
+		fVideoTrack = NULL;
+		return B_NO_MEMORY;
+	}
+
 	media_header mh;
 	bigtime_t time = fCurTime;	
 	fVideoTrack->SeekToTime(&time);
 
 	int64 dummyNumFrames = 0;
-	fVideoTrack->ReadFrames((char *)fBitmap->Bits(), &dummyNumFrames, &mh);
+	if (fConverting)
+	{
+		fVideoTrack->ReadFrames((char *)fFrames[0].bitmap->Bits(), &dummyNumFrames, &mh);
+		ConvertVideoBitmap(fBitmap, fFrames[0].bitmap);
+	}
+	else
+		fVideoTrack->ReadFrames((char *)fBitmap->Bits(), &dummyNumFrames, &mh);
 
 	time = fCurTime;
 	fVideoTrack->SeekToTime(&time);	
@@ -322,6 +424,45 @@ status_t MediaView::SetVideoTrack(BMediaTrack *track, media_format *format)
 }
 
 
+// Tries to get the video track to decode to a YCbCr format that
+// ConvertVideoBitmap() can turn into B_RGB32 for fBitmap
+bool MediaView::SetConversion(BRect bounds)
+{
+	static const color_space spaces[] = { B_YCbCr422, B_YCbCr420 };
+
+	for (int32 i = 0; i < (int32)(sizeof(spaces)/sizeof(spaces[0])); i++)
+	{
+		BBitmap decoded(bounds, 0, spaces[i]);
+		if (decoded.InitCheck() != B_OK)
+			continue;
+
+		media_format mf, old_mf;
+		BuildMediaFormat(&decoded, &mf);
+		old_mf = mf;
+		fVideoTrack->DecodedFormat(&mf);
+		if (mf.u.raw_video.display.format != spaces[i] ||
+			mf.u.raw_video.display.bytes_per_row != old_mf.u.raw_video.display.bytes_per_row)
+		{
+			continue;
+		}
+
+		fScratchBitmap = new BBitmap(bounds, 0, B_RGB32);
+		if (fScratchBitmap->InitCheck() != B_OK)
+		{
+			delete fScratchBitmap;
+			fScratchBitmap = NULL;
+			return false;
+		}
+
+		fDecodeSpace = spaces[i];
+		fDecodeBytesPerRow = decoded.BytesPerRow();
+		fConverting = true;
+		return true;
+	}
+	return false;
+}
+
+
 status_t MediaView::SetAudioTrack(BMediaTrack *track, media_format *format)
 {
 	if (fAudioTrack != NULL)
@@ -340,8 +481,6 @@ status_t MediaView::SetAudioTrack(BMediaTrack *track, media_format *format)
 		return err;
 	}
 
-	fAudioDumpingBuffer = malloc(format->u.raw_audio.buffer_size);
-
 	return B_NO_ERROR;
 }
 
@@ -361,6 +500,7 @@ status_t MediaView::Stop()
 
 	acquire_sem(fPlaySem);
 	fPlaying = false;
+	release_sem(fWakeSem);
 
 	return B_NO_ERROR;
 }
@@ -373,9 +513,33 @@ void MediaView::Reset()
 	delete_sem(fScrubSem);
 	fScrubSem = B_ERROR;
 
+	delete_sem(fWakeSem);
+	fWakeSem = B_ERROR;
+
+	fDecoderQuit = true;
+	delete_sem(fFreeSem);
+	fFreeSem = B_ERROR;
+	delete_sem(fFilledSem);
+	fFilledSem = B_ERROR;
+	delete_sem(fSeekSem);
+	fSeekSem = B_ERROR;
+
 	status_t result = B_NO_ERROR;
 	wait_for_thread(fPlayerThread, &result);
 	fPlayerThread = B_ERROR;
+	wait_for_thread(fDecoderThread, &result);
+	fDecoderThread = B_ERROR;
+	fDecoderQuit = false;
+
+	FreeFrames();
+	fFillIndex = fShowIndex = 0;
+
+	delete (fScratchBitmap);
+	fScratchBitmap = NULL;
+	delete (fScaler);
+	fScaler = NULL;
+	fConverting = false;
+	fProcessing = false;
 
 	fVideoTrack = NULL;
 
@@ -389,9 +553,6 @@ void MediaView::Reset()
 
 	delete (fMediaFile);
 	fMediaFile = NULL;
-
-	free(fAudioDumpingBuffer);
-	fAudioDumpingBuffer = NULL;
 }
 
 BRect MediaView::VideoBounds() const
@@ -418,27 +579,287 @@ void MediaView::BuildMediaFormat(BBitmap *bitmap, media_format *format)
 	rvf->display.bytes_per_row = bitmap->BytesPerRow();
 }
 
+bool MediaView::AllocateFrames(BRect bounds)
+{
+	// The queued frames have to be laid out exactly as the track was
+	// told to decode
+	for (int32 i = 0; i < VIDEO_QUEUE_LENGTH; i++)
+	{
+		fFrames[i].bitmap = new BBitmap(bounds, 0, fDecodeSpace,
+			fDecodeBytesPerRow);
+		if (fFrames[i].bitmap->InitCheck() != B_OK)
+			return false;
+		fFrames[i].display = NULL;
+		fFrames[i].time = 0;
+		fFrames[i].generation = -1;
+		fFrames[i].end = false;
+	}
+	return true;
+}
+
+void MediaView::FreeFrames()
+{
+	for (int32 i = 0; i < VIDEO_QUEUE_LENGTH; i++)
+	{
+		delete (fFrames[i].bitmap);
+		fFrames[i].bitmap = NULL;
+		delete (fFrames[i].display);
+		fFrames[i].display = NULL;
+	}
+}
+
+void MediaView::GetFrameStats(int32 *shown, int32 *dropped, int32 *late) const
+{
+	*shown = fFramesShown;
+	*dropped = fFramesDropped;
+	*late = fFramesLate;
+}
+
+void MediaView::GetSkipStats(int32 *skipped, int32 *catchups) const
+{
+	*skipped = fFramesSkipped;
+	*catchups = fCatchUps;
+}
+
+// Takes the frame that's due off the queue, throwing away any from
+// before a seek, and skipping any that are already late when the one
+// after is due too.  With <resync>, the first good frame is taken
+// regardless.  Returns NULL if nothing is ready within 100ms.
+MediaView::video_frame *MediaView::NextFrame(bigtime_t startTime, bool resync)
+{
+	video_frame *frame, *next;
+	int32 filled;
+
+	for (;;)
+	{
+		if (acquire_sem_etc(fFilledSem, 1, B_TIMEOUT, 100000) != B_OK)
+			return NULL;
+
+		frame = &fFrames[fShowIndex];
+		fShowIndex = (fShowIndex + 1) % VIDEO_QUEUE_LENGTH;
+
+		if (frame->generation != fGeneration)
+		{
+			release_sem(fFreeSem);
+			continue;
+		}
+		if (frame->end || resync)
+			return frame;
+
+		if (get_sem_count(fFilledSem, &filled) == B_OK && filled > 0)
+		{
+			next = &fFrames[fShowIndex];
+			if (next->generation == fGeneration && !next->end &&
+				next->time <= system_time() - startTime)
+			{
+				fFramesDropped++;
+				release_sem(fFreeSem);
+				continue;
+			}
+		}
+		return frame;
+	}
+}
+
+// Called with the window locked
+void MediaView::ShowFrame(video_frame *frame)
+{
+	// The overlay bitmap is what's on the screen, so the frame has
+	// to be copied into it; otherwise the frame's display bitmap (or
+	// the decoded one, if there's no processing) just trades places
+	// with fBitmap
+	if (fProcessing)
+	{
+		BBitmap *shown = fBitmap;
+		fBitmap = frame->display;
+		frame->display = shown;
+		DrawBitmap(fBitmap, VideoBounds());
+	}
+	else if (fUsingOverlay)
+	{
+		int32 length = fBitmap->BitsLength();
+		if (frame->bitmap->BitsLength() < length)
+			length = frame->bitmap->BitsLength();
+
+		fBitmap->LockBits();
+		memcpy(fBitmap->Bits(), frame->bitmap->Bits(), length);
+		fBitmap->UnlockBits();
+	}
+	else
+	{
+		BBitmap *shown = fBitmap;
+		fBitmap = frame->bitmap;
+		frame->bitmap = shown;
+		DrawBitmap(fBitmap, VideoBounds());
+	}
+}
+
+// Returns the bitmap to decode <frame> into.  With fProcessing, first
+// makes sure its display bitmap is the size of <display>, which only
+// means allocating a new one after the view is resized.
+BBitmap *MediaView::DecodeTarget(video_frame *frame, BRect display)
+{
+	if (!fProcessing)
+		return frame->bitmap;
+
+	// At the video's own size, an unconverted frame can be decoded
+	// straight into its display bitmap, if that's laid out the same
+	bool direct = (display == fVideoBounds && !fConverting);
+	int32 bpr = (direct) ? fDecodeBytesPerRow : B_ANY_BYTES_PER_ROW;
+
+	if (frame->display == NULL || frame->display->Bounds() != display ||
+		(direct && frame->display->BytesPerRow() != bpr))
+	{
+		delete (frame->display);
+		frame->display = new BBitmap(display, 0, B_RGB32, bpr);
+		if (frame->display->InitCheck() != B_OK)
+		{
+			delete (frame->display);
+			frame->display = NULL;
+		}
+	}
+
+	if (direct && frame->display != NULL)
+		return frame->display;
+	return frame->bitmap;
+}
+
+// Converts and scales a decoded frame into its display bitmap, as
+// needed
+void MediaView::FinishFrame(video_frame *frame)
+{
+	if (!fProcessing || frame->display == NULL)
+		return;
+
+	if (frame->display->Bounds() == fVideoBounds)
+	{
+		// (If it isn't converted, it was decoded right there)
+		if (fConverting)
+			ConvertVideoBitmap(frame->display, frame->bitmap);
+	}
+	else if (fConverting)
+	{
+		ConvertVideoBitmap(fScratchBitmap, frame->bitmap);
+		fScaler->Scale(frame->display, fScratchBitmap);
+	}
+	else
+		fScaler->Scale(frame->display, frame->bitmap);
+}
+
+// Keeps the queue filled with decoded frames, and does the seeking
+// when MediaPlayer() asks for it
+int32 MediaView::VideoDecoder(void *arg)
+{
+	MediaView* view = (MediaView *)arg;
+	BMediaTrack* videoTrack = view->fVideoTrack;
+	int32 generation = view->fGeneration;
+	int64 count, skipFrom;
+	media_header mh;
+	bigtime_t seekTime, frameTime, lastTime, now, keyTime;
+	bigtime_t decodedTime = -1;
+	BRect display;
+	BBitmap *target;
+	bool clockValid;
+	status_t err;
+
+	while (acquire_sem(view->fFreeSem) == B_OK)
+	{
+		video_frame *frame = &view->fFrames[view->fFillIndex];
+		bool seekNeeded = false;
+
+		view->fSeekLock.Lock();
+		if (generation != view->fGeneration)
+		{
+			generation = view->fGeneration;
+			seekTime = view->fSeekTime;
+			seekNeeded = true;
+		}
+		clockValid = view->fClockValid;
+		now = system_time() - view->fClockBase;
+		display = view->fDisplayBounds;
+		view->fSeekLock.Unlock();
+
+		target = view->DecodeTarget(frame, display);
+
+		// If decoding has fallen well behind the clock, decoding every
+		// late frame only to have it dropped makes things worse, so
+		// jump ahead to the last keyframe before the clock instead
+		if (!seekNeeded && clockValid && decodedTime >= 0 &&
+			now - decodedTime > VIDEO_CATCHUP_LAG)
+		{
+			keyTime = now;
+			if (videoTrack->FindKeyFrameForTime(&keyTime,
+					B_MEDIA_SEEK_CLOSEST_BACKWARD) == B_OK &&
+				keyTime > decodedTime)
+			{
+				skipFrom = videoTrack->CurrentFrame();
+				if (videoTrack->SeekToTime(&keyTime,
+					B_MEDIA_SEEK_CLOSEST_BACKWARD) == B_OK)
+				{
+					view->fFramesSkipped += (int32)(videoTrack->CurrentFrame() - skipFrom);
+					view->fCatchUps++;
+#ifdef DEBUG_VIDEO
+	fprintf(stderr, "MediaView: %Ldms behind, skipped to keyframe at %Ldms\n",
+		(now - decodedTime)/1000, keyTime/1000);
+#endif
+				}
+			}
+		}
+
+		if (seekNeeded)
+		{
+			// Seek the seekTime as close as possible
+			frameTime = seekTime;
+			videoTrack->SeekToTime(&frameTime);
+
+			// Read frames until we get less than 50ms ahead.
+			lastTime = frameTime;
+			do
+			{
+				err = videoTrack->ReadFrames((char *)target->Bits(), &count, &mh);
+				if (err != B_OK || count == 0) break;
+				frameTime = mh.start_time;
+				if (frameTime <= lastTime) break;
+				lastTime = frameTime;
+			} while (seekTime - frameTime > 50000);
+		}
+		else
+			err = videoTrack->ReadFrames((char *)target->Bits(), &count, &mh);
+
+		frame->end = (err != B_OK || count == 0);
+		frame->time = mh.start_time;
+		frame->generation = generation;
+		decodedTime = (frame->end) ? -1 : frame->time;
+		if (!frame->end)
+			view->FinishFrame(frame);
+
+		view->fFillIndex = (view->fFillIndex + 1) % VIDEO_QUEUE_LENGTH;
+		release_sem(view->fFilledSem);
+
+		// Past the end, there's nothing to do until the next seek
+		// (or until Reset() deletes fSeekSem)
+		while (frame->end && generation == view->fGeneration && !view->fDecoderQuit)
+		{
+			if (acquire_sem(view->fSeekSem) != B_OK) break;
+		}
+	}
+
+	return B_NO_ERROR;
+}
+
 int32 MediaView::MediaPlayer(void *arg)
 {
 	MediaView* view = (MediaView *)arg;
 	BWindow* window = view->Window();
-	BBitmap* bitmap = view->fBitmap;
 	BMediaTrack* videoTrack = view->fVideoTrack;
 	BMediaTrack* audioTrack = view->fAudioTrack;
-	BMediaTrack* counterTrack = (videoTrack != NULL) ? videoTrack : audioTrack;
 	AudioOutput* audioOutput = view->fAudioOutput;
-	void *adBuffer = view->fAudioDumpingBuffer;
-	int64 numFrames = counterTrack->CountFrames();
-	int64 numFramesToSkip = 0;
-	int64 numSkippedFrames = 0;
 	bool scrubbing = false;
 	bool seekNeeded = false;
-	int64 dummy;
-	media_header mh;
+	bool resync = false;
+	video_frame *frame;
 	bigtime_t vStartTime, aStartTime, seekTime, snoozeTime, startTime;
-	bigtime_t curScrubbing, lastScrubbing, lastTime;
-bigtime_t watchdog = 0;
-int watchdog_count = 0;
+	bigtime_t curScrubbing, lastScrubbing;
 
 	curScrubbing = lastScrubbing = system_time();
 	seekTime = 0LL;
@@ -451,31 +872,21 @@ int watchdog_count = 0;
 		// as we are doing stop->start, restart audio if needed.
 		if (audioTrack != NULL)
 			audioOutput->Play();
-		startTime = system_time()-counterTrack->CurrentTime();		
-
-		// This will loop until the end of the stream
-		while ((counterTrack->CurrentFrame() < numFrames) || scrubbing)
+		// (The tracks are read ahead by VideoDecoder() and AudioOutput,
+		// so their current times aren't what's playing)
+		startTime = system_time()-view->fCurTime;
+
+		// This will loop until the end of the stream (which for video
+		// is when VideoDecoder() queues the end frame, and for audio
+		// when AudioOutput has played the last of it)
+		while ((videoTrack != NULL) || !audioOutput->IsFinished() || scrubbing)
 		{
 			if (view->paused)
 			{
+				view->fClockValid = false;
 				snooze(20000);
 				continue;
 			}
-// There's some trouble with playing (MP3s), where counterTrack->CurrentFrame()
-// never gets to equal numFrames, so look out for that if we're not paused
-else
-{
-	if (watchdog==counterTrack->CurrentFrame())
-		watchdog_count++;
-	else
-		watchdog_count = 0;
-	watchdog = counterTrack->CurrentFrame();
-	if (watchdog_count>=10)
-	{
-		numFrames = counterTrack->CurrentFrame();
-		watchdog_count = 0;
-	}
-}
 			
 			// We are in scrub mode
 			if (acquire_sem(view->fScrubSem) == B_OK)
@@ -504,119 +915,129 @@ else
 			// Handle seeking
 			if (seekNeeded)
 			{
+				// VideoDecoder() does the seeking, and anything it
+				// has already queued gets thrown away
 				if (videoTrack)
 				{
-					// Seek the seekTime as close as possible
-					vStartTime = seekTime;
-					videoTrack->SeekToTime(&vStartTime);
-					
-					// Read frames until we get less than 50ms ahead.
-					lastTime = vStartTime;
-					do
-					{
-						bitmap->LockBits();
-						status_t err = videoTrack->ReadFrames((char*)bitmap->Bits(), &dummy, &mh);
-						bitmap->UnlockBits();
-						if (err != B_OK) break;
-						vStartTime = mh.start_time;
-						if ((dummy == 0) || (vStartTime <= lastTime))
-							break;
-						lastTime = vStartTime;
-					} while (seekTime - vStartTime > 50000);
+					view->fSeekLock.Lock();
+					view->fSeekTime = seekTime;
+					view->fGeneration++;
+					view->fClockValid = false;
+					view->fSeekLock.Unlock();
+					release_sem(view->fSeekSem);
+					resync = true;
 				}
 				
+				// (AudioOutput reads ahead to within 50ms of it)
 				if (audioTrack)
 				{
-					// Seek the extractor as close as possible
 					aStartTime = seekTime;
 					audioOutput->SeekToTime(&aStartTime);
-					
-					// Read frames until we get less than 50ms ahead.
-					lastTime = aStartTime;
-					while (seekTime - aStartTime > 50000) {
-						if (audioTrack->ReadFrames((char *)adBuffer, &dummy, &mh) != B_OK)
-							break;
-						aStartTime = mh.start_time;
-						if ((dummy == 0) || (aStartTime <= lastTime))
-							break;
-						lastTime = aStartTime;
-					}
 				}
-				else startTime = system_time() - vStartTime;
 				
 				// Set the current time
 				view->fCurTime = seekTime;	
 			
 				seekNeeded = false;
 			}		
-			// Handle normal playing mode
-			else
+
+			// Get the frame that's due, if any
+			frame = NULL;
+			if (audioTrack != NULL)
+				startTime = audioOutput->TrackTimebase();
+			if (videoTrack != NULL)
 			{
-				// Get the next video frame, if any
-				if (videoTrack != NULL)
+				frame = view->NextFrame(startTime, resync);
+				if (frame != NULL)
 				{
-					bitmap->LockBits();
-					status_t err = videoTrack->ReadFrames((char*)bitmap->Bits(), &dummy, &mh);
-					bitmap->UnlockBits();
-					if (err != B_OK) goto do_reset;
-					if (dummy == 0)
+					if (frame->end)
+					{
+						release_sem(view->fFreeSem);
 						goto do_reset;
-					vStartTime = mh.start_time;
+					}
+					vStartTime = frame->time;
+					if (resync && audioTrack == NULL)
+						startTime = system_time() - vStartTime;
+					resync = false;
 				}
 
-				// Estimated snoozeTime
-				if (audioTrack != NULL)
-					startTime = audioOutput->TrackTimebase();
-				if (videoTrack != NULL)
-					snoozeTime = vStartTime - (system_time() - startTime);
-				else
-					snoozeTime = 25000;
-
-				// Handle timing issues
-				if (snoozeTime > 5000LL)
-				{
-					view->fSnoozing = true;
-					snooze(snoozeTime-1000);
-					view->fSnoozing = false;
-				}
-				else if (snoozeTime < -5000)
+				// Let VideoDecoder() know where the clock is
+				if (!resync && !scrubbing)
 				{
-					numSkippedFrames++;
-					numFramesToSkip++;
+					view->fSeekLock.Lock();
+					view->fClockBase = startTime;
+					view->fClockValid = true;
+					view->fSeekLock.Unlock();
 				}
+			}
+
+			// Wait until it's time for it.  With only audio, there's
+			// nothing to do until AudioOutput plays the last of it or
+			// Stop() is called, and either releases fWakeSem.
+			if (frame != NULL)
+				snoozeTime = vStartTime - (system_time() - startTime);
+			else if (videoTrack == NULL && !scrubbing)
+			{
+				view->fSnoozing = true;
+				acquire_sem(view->fWakeSem);
+				view->fSnoozing = false;
+				snoozeTime = 0;
+			}
+			else if (videoTrack == NULL)
+				snoozeTime = 25000;
+			else
+				snoozeTime = 0;
+			if (snoozeTime > 5000LL)
+			{
+				view->fSnoozing = true;
+				snooze(snoozeTime-1000);
+				view->fSnoozing = false;
+			}
 				
-				// Set the current time
-				if (!scrubbing)
+			// Set the current time
+			if (!scrubbing)
+			{
+				view->fCurTime = system_time() - startTime;
+				if (view->fCurTime < seekTime)
+					view->fCurTime = seekTime;
+			}				
+				
+			// Handle the drawing.  If we can't lock the window after 50ms,
+			// better to give up on that frame
+			if (frame != NULL)
+			{
+				bigtime_t late = (system_time() - startTime) - vStartTime;
+
+				// (With fProcessing, VideoDecoder() may have been unable
+				// to allocate a display bitmap)
+				if (view->fProcessing && frame->display == NULL)
+					view->fFramesDropped++;
+				else if (window->LockWithTimeout(50000) == B_OK)
 				{
-					view->fCurTime = system_time() - startTime;
-					if (view->fCurTime < seekTime)
-						view->fCurTime = seekTime;
-				}				
+					view->ShowFrame(frame);
+					window->Unlock();
+					view->fFramesShown++;
+					if (late > 5000LL)
+						view->fFramesLate++;
+				}
+				else
+					view->fFramesDropped++;
+
+				release_sem(view->fFreeSem);
 			}
-				
-			// Handle the drawing; no drawing if we need to skip a frame
-			if (numSkippedFrames > 0)
-				numSkippedFrames--;
-			// If we can't lock the window after 50ms, better to give up for
-			// that frame
-			else if (window->LockWithTimeout(50000) == B_OK)
+
+			// In scrub mode, don't scrub more than 10 times a second
+			if (scrubbing)
 			{
-				if ((videoTrack != NULL) && !view->fUsingOverlay)
-					view->DrawBitmap(bitmap, view->VideoBounds());
-				window->Unlock();
-				// In scrub mode, don't scrub more than 10 times a second
-				if (scrubbing)
+				snoozeTime = (100000LL+lastScrubbing) - system_time();
+				if (snoozeTime > 4000LL)
 				{
-					snoozeTime = (100000LL+lastScrubbing) - system_time();
-					if (snoozeTime > 4000LL)
-					{
-						view->fSnoozing = true;
-						snooze(snoozeTime-1000LL);
-						view->fSnoozing = false;
-					}
-					lastScrubbing = curScrubbing;
+					view->fSnoozing = true;
+					snooze(snoozeTime-1000LL);
+					view->fSnoozing = false;
 				}
-			}				
+				lastScrubbing = curScrubbing;
+			}
 			
 			// Check if we are required to stop.
 			if (acquire_sem_etc(view->fPlaySem, 1, B_TIMEOUT, 0) == B_OK)
@@ -626,17 +1047,19 @@ else
 			{
 				if (audioTrack != NULL)
 					audioOutput->Stop();
+				view->fClockValid = false;
 				goto do_restart;
 			}
 		}		
 
 		// If we exited the main streaming loop because we are at the end,
 		// then we need to loop.
-		if (counterTrack->CurrentFrame() >= numFrames)
+		if (videoTrack == NULL && audioOutput->IsFinished())
 		{
 do_reset:
 			if (audioTrack != NULL)
 				audioOutput->Stop();
+			view->fClockValid = false;
 				
 			if (view->loop)
 			{
@@ -647,12 +1070,23 @@ do_reset:
 			else
 			{
 				view->fPlaying = false;
+				if (view->fNotifyPort >= B_OK)
+					media_control.Post(view->fNotifyPort, MEDIA_CONTROL_FINISHED);
 				break;
 			}
 		}
 do_restart:;
 	}
 
+#ifdef DEBUG_VIDEO
+	fprintf(stderr, "MediaView: %ld frames shown, %ld dropped, %ld late\n",
+		view->fFramesShown, view->fFramesDropped, view->fFramesLate);
+	fprintf(stderr, "MediaView: %ld frames skipped undecoded in %ld catch-ups\n",
+		view->fFramesSkipped, view->fCatchUps);
+	if (audioOutput != NULL)
+		fprintf(stderr, "MediaView: %ld audio underruns\n",
+			audioOutput->Underruns());
+#endif
 	return B_NO_ERROR;
 }
 
@@ -662,6 +1096,12 @@ status_t MediaView::SetVolume(float vol)
 	return B_NO_ERROR;
 }
 
+status_t MediaView::FadeVolume(float vol, bigtime_t duration)
+{
+	if (fAudioOutput) fAudioOutput->FadeTo(vol, duration);
+	return B_NO_ERROR;
+}
+
 float MediaView::Volume()
 {
 	if (fAudioOutput) return fAudioOutput->Volume();
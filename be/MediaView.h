@@ -5,9 +5,16 @@
 #ifndef _MEDIA_VIEW_H
 #define _MEDIA_VIEW_H
 
+#include <Locker.h>
 #include <View.h>
 #include <MediaDefs.h>
 
+// How many video frames are decoded ahead of the one showing
+#define VIDEO_QUEUE_LENGTH 4
+
+// How far decoding can fall behind before skipping to a keyframe
+#define VIDEO_CATCHUP_LAG 100000	// microseconds
+
 enum media_action
 {
 	MEDIA_PLAY,
@@ -19,6 +26,7 @@ class BMediaFile;
 class BMediaTrack;
 class AudioOutput;
 class BBitmap;
+class BitmapScaler;
 
 class MediaView : public BView
 {
@@ -49,8 +57,27 @@ public:
 
 	virtual status_t SetVolume(float vol);
 	virtual float Volume();
+	// Moves the volume to <vol> over <duration>, in the mixer
+	status_t FadeVolume(float vol, bigtime_t duration);
+
+	// Has MEDIA_CONTROL_FINISHED posted to <port> (see MediaControl.h)
+	// when it's played to the end
+	void SetNotifyPort(port_id port) { fNotifyPort = port; }
+
+	void GetFrameStats(int32 *shown, int32 *dropped, int32 *late) const;
+	void GetSkipStats(int32 *skipped, int32 *catchups) const;
 
 private:
+	// A decoded frame in the queue
+	struct video_frame
+	{
+		BBitmap *bitmap;	// as decoded
+		BBitmap *display;	// B_RGB32, ready to show (with fProcessing)
+		bigtime_t time;
+		int32 generation;	// fGeneration when it was decoded
+		bool end;		// past the end of the track
+	};
+
 	void InitObject();
 
 	status_t SetVideoTrack(BMediaTrack *track, media_format *format);
@@ -63,8 +90,17 @@ private:
 
 	BRect VideoBounds() const;
 
+	bool SetConversion(BRect bounds);
+	bool AllocateFrames(BRect bounds);
+	void FreeFrames();
+	BBitmap *DecodeTarget(video_frame *frame, BRect display);
+	void FinishFrame(video_frame *frame);
+	video_frame *NextFrame(bigtime_t startTime, bool resync);
+	void ShowFrame(video_frame *frame);
+
 	static void BuildMediaFormat(BBitmap *bitmap, media_format *format);
 	static int32 MediaPlayer(void *arg);
+	static int32 VideoDecoder(void *arg);
 
 private:
 	BMediaFile* fMediaFile;
@@ -78,10 +114,49 @@ private:
 	thread_id fPlayerThread;
 	sem_id fPlaySem;
 	sem_id fScrubSem;
+	sem_id fWakeSem;		// for MediaPlayer() with only audio
+	port_id fNotifyPort;
 	bool fPlaying;
 	bool fSnoozing;
 	bool fUsingOverlay;
-	void *fAudioDumpingBuffer;
+
+	// The decode-ahead queue:  VideoDecoder() fills the frames in
+	// order as fFreeSem lets it, and MediaPlayer() takes them in the
+	// same order as fFilledSem lets it
+	video_frame fFrames[VIDEO_QUEUE_LENGTH];
+	int32 fFillIndex, fShowIndex;
+	sem_id fFreeSem;
+	sem_id fFilledSem;
+	sem_id fSeekSem;		// wakes VideoDecoder() past the end
+	thread_id fDecoderThread;
+	volatile bool fDecoderQuit;
+
+	// Seeking bumps fGeneration; frames from before it are thrown away
+	BLocker fSeekLock;
+	volatile int32 fGeneration;
+	bigtime_t fSeekTime;
+
+	// The presentation clock, for VideoDecoder() to check it's keeping
+	// up (also under fSeekLock)
+	bigtime_t fClockBase;
+	volatile bool fClockValid;
+
+	int32 fFramesShown, fFramesDropped, fFramesLate;
+	int32 fFramesSkipped, fCatchUps;
+
+	// Without an overlay, frames may be decoded as YCbCr and converted
+	// to B_RGB32 (fConverting); either way, if fBitmap is B_RGB32,
+	// VideoDecoder() makes each frame's display bitmap exactly the
+	// size of the view (fProcessing), converting and scaling as needed,
+	// so that drawing it is a 1:1 blit
+	bool fConverting;
+	bool fProcessing;
+	color_space fDecodeSpace;
+	int32 fDecodeBytesPerRow;
+	BRect fVideoBounds;
+	BRect fDisplayBounds;		// under fSeekLock
+	BBitmap* fScratchBitmap;	// converted, before scaling
+	BitmapScaler* fScaler;
 };
 
 #endif
@@ -0,0 +1,32 @@
+/*
+	MikModSetup.h
+
+	How MikMod is set up for playing music, shared by InitPlayer()
+	in sound.cpp and the modrender tool, so that what modrender
+	renders offline is what BeHugo plays.  Include it after
+	mikmod.h, then register a driver and call SetupMikMod() before
+	MikMod_Init().
+*/
+
+#ifndef _MIKMODSETUP_H
+#define _MIKMODSETUP_H
+
+#define MAXCHANNELS 32			/* for MikMod */
+
+static inline void SetupMikMod(void)
+{
+	MikMod_RegisterLoader(&load_mod);	/* module loaders */
+	MikMod_RegisterLoader(&load_s3m);
+	MikMod_RegisterLoader(&load_xm);
+
+	md_mixfreq = 44100;			/* standard mixing frequency */
+	md_mode = DMODE_16BITS | DMODE_STEREO |
+		// software mixing
+		DMODE_SOFT_MUSIC | DMODE_SOFT_SNDFX;
+	md_device = 0;				/* standard device: autodetect */
+
+	// This is 6 by default, but that's too much
+	md_reverb = 0;
+}
+
+#endif	// ifndef _MIKMODSETUP_H
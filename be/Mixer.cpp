@@ -0,0 +1,423 @@
+/*
+	Mixer.cpp
+
+	All of BeHugo's audio--MikMod music, and the tracks of the
+	MediaViews that play MP3 music, samples and video sound--goes
+	out through one BSoundPlayer, as voices of output_mixer.  Each
+	voice is read in its own format and at its own rate, converted to
+	stereo floats, resampled (by linear interpolation) to
+	MIXER_FRAME_RATE, scaled by its gain and summed.  A voice's gain
+	can be faded, sample by sample, for crossfades.
+
+	The callback mixes with the mixer locked, so once RemoveVoice()
+	returns, the voice is no longer being read and can be deleted.
+	The callback waits for the lock, so other threads only ever hold
+	it briefly:  never around anything that allocates or starts the
+	output stream.
+
+	GetMixStats() reports the time spent in the callback; build with
+	DEBUG_MIXER to have it printed every so often.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <OS.h>
+
+#include "Mixer.h"
+
+// Source frames a voice converts at a time
+#define SOURCE_FRAMES (MIXER_BUFFER_FRAMES*2)
+
+Mixer output_mixer;
+
+
+//---------------------------------------------------------------------------
+// MixerVoice
+//---------------------------------------------------------------------------
+
+MixerVoice::MixerVoice()
+{
+	memset(&format, 0, sizeof(format));
+	frame_size = 0;
+	gain = 1.0;
+	fade_target = 1.0;
+	fade_step = 0.0;
+	fade_frames = 0;
+	source = NULL;
+	source_count = 0;
+	position = 0.0;
+	step = 1.0;
+	raw = NULL;
+	raw_frame_size = 0;
+}
+
+MixerVoice::~MixerVoice()
+{
+	free(source);
+	free(raw);
+}
+
+
+/* SetFormat
+
+	Returns false if the mixer can't read <f>.
+*/
+
+bool MixerVoice::SetFormat(const media_raw_audio_format &f)
+{
+	uint32 sample_size;
+
+	switch (f.format)
+	{
+		case media_raw_audio_format::B_AUDIO_UCHAR:
+			sample_size = 1;
+			break;
+		case media_raw_audio_format::B_AUDIO_SHORT:
+			sample_size = 2;
+			break;
+		case media_raw_audio_format::B_AUDIO_INT:
+		case media_raw_audio_format::B_AUDIO_FLOAT:
+			sample_size = 4;
+			break;
+		default:
+			return false;
+	}
+	if (f.channel_count < 1 || f.frame_rate <= 0.0) return false;
+
+	format = f;
+	frame_size = sample_size*f.channel_count;
+	step = f.frame_rate/MIXER_FRAME_RATE;
+	source_count = 0;
+	position = 0.0;
+
+	return Reserve(frame_size);
+}
+
+
+/* Reserve
+
+	Makes sure there's room to convert frames of up to
+	<max_frame_size> bytes, so that a voice that changes format as it
+	goes--but never past that--only allocates here, once.
+*/
+
+bool MixerVoice::Reserve(uint32 max_frame_size)
+{
+	// (Two extra for the frames interpolated from)
+	if (!source)
+		source = (float *)malloc((SOURCE_FRAMES+2)*2*sizeof(float));
+
+	if (max_frame_size > raw_frame_size)
+	{
+		free(raw);
+		raw = (uint8 *)malloc(SOURCE_FRAMES*max_frame_size);
+		raw_frame_size = raw ? max_frame_size : 0;
+	}
+
+	return (source && raw);
+}
+
+// (The mixer is locked so that the callback never sees a fade half
+// set up)
+void MixerVoice::SetGain(float g)
+{
+	output_mixer.Lock();
+	gain = g;
+	fade_frames = 0;
+	output_mixer.Unlock();
+}
+
+void MixerVoice::FadeTo(float g, bigtime_t duration)
+{
+	int32 frames = (int32)(duration*MIXER_FRAME_RATE/1000000.0);
+
+	output_mixer.Lock();
+	if (frames > 0)
+	{
+		fade_target = g;
+		fade_step = (g-gain)/frames;
+		fade_frames = frames;
+	}
+	else
+	{
+		gain = g;
+		fade_frames = 0;
+	}
+	output_mixer.Unlock();
+}
+
+static inline float SourceSample(const uint8 *raw, uint32 format, int32 i)
+{
+	switch (format)
+	{
+		case media_raw_audio_format::B_AUDIO_UCHAR:
+			return (float)(raw[i]-128)*(1.0/128.0);
+		case media_raw_audio_format::B_AUDIO_SHORT:
+			return (float)((int16 *)raw)[i]*(1.0/32768.0);
+		case media_raw_audio_format::B_AUDIO_INT:
+			return (float)((int32 *)raw)[i]*(1.0/2147483648.0);
+		default:
+			return ((float *)raw)[i];
+	}
+}
+
+
+/* Fill
+
+	Drops the source frames the voice has moved past and reads and
+	converts more, trying for <needed> counting from the current
+	position.  Returns false if Read() gave nothing.
+*/
+
+bool MixerVoice::Fill(int32 needed)
+{
+	int32 skip, count, i;
+	uint32 channels = format.channel_count;
+	float *s;
+
+	skip = (int32)position;
+	if (skip > source_count) skip = source_count;
+	if (skip > 0)
+	{
+		memmove(source, source+skip*2, (source_count-skip)*2*sizeof(float));
+		source_count -= skip;
+		position -= skip;
+	}
+
+	if (needed > SOURCE_FRAMES+2) needed = SOURCE_FRAMES+2;
+	if (needed-source_count > SOURCE_FRAMES) needed = source_count+SOURCE_FRAMES;
+	if (needed <= source_count) return true;
+
+	s = source + source_count*2;
+
+	// Stereo floats need no converting
+	if (format.format == media_raw_audio_format::B_AUDIO_FLOAT && channels == 2)
+	{
+		count = Read(s, needed-source_count);
+		if (count <= 0) return false;
+	}
+	else
+	{
+		count = Read(raw, needed-source_count);
+		if (count <= 0) return false;
+
+		for (i=0; i<count; i++, s+=2)
+		{
+			s[0] = SourceSample(raw, format.format, i*channels);
+			s[1] = (channels > 1) ? SourceSample(raw, format.format, i*channels+1) : s[0];
+		}
+	}
+	source_count += count;
+
+	return true;
+}
+
+
+//---------------------------------------------------------------------------
+// Mixer
+//---------------------------------------------------------------------------
+
+Mixer::Mixer()
+	: BLocker("Mixer"), start_lock("Mixer start")
+{
+	player = NULL;
+	failed = false;
+	voice_count = 0;
+	mix_buffer = NULL;
+	perf_time = 0;
+	mix_time = mix_peak = 0;
+	mix_count = 0;
+}
+
+Mixer::~Mixer()
+{
+	if (player)
+	{
+		player->Stop();
+		delete player;
+	}
+	free(mix_buffer);
+}
+
+bool Mixer::Start()
+{
+	media_raw_audio_format format;
+
+	format.frame_rate = MIXER_FRAME_RATE;
+	format.channel_count = 2;
+	format.format = media_raw_audio_format::B_AUDIO_FLOAT;
+	format.byte_order = B_MEDIA_HOST_ENDIAN;
+	format.buffer_size = MIXER_BUFFER_FRAMES*2*sizeof(float);
+
+	BSoundPlayer *p;
+
+	mix_buffer = (float *)malloc(MIXER_BUFFER_FRAMES*2*sizeof(float));
+	p = new BSoundPlayer(&format, "BeHugo", Play, NULL, this);
+	if (!mix_buffer || p->InitCheck() != B_OK)
+	{
+		delete p;
+		failed = true;
+		return false;
+	}
+
+	// (Set before it starts, since the callback uses it)
+	player = p;
+	player->Start();
+	player->SetHasData(true);
+	// For some reason, SetVolume() doesn't override the
+	// mixer defaults (in /boot/home/config/settings/Media),
+	// but SetVolumeDB() does, thankfully.
+	player->SetVolumeDB(1.0);
+
+	return true;
+}
+
+
+/* AddVoice
+
+	Returns false if the output stream can't be started or there are
+	already MIXER_MAX_VOICES.
+*/
+
+bool Mixer::AddVoice(MixerVoice *voice)
+{
+	bool added = false;
+
+	// Starting the output stream takes a while, so it's done before
+	// the mixer is locked, with start_lock keeping it to one thread
+	start_lock.Lock();
+	if (!player && !failed) Start();
+	start_lock.Unlock();
+	if (!player) return false;
+
+	voice->source_count = 0;
+	voice->position = 0.0;
+
+	Lock();
+	if (voice_count < MIXER_MAX_VOICES && voice->source && voice->raw)
+	{
+		voices[voice_count++] = voice;
+		added = true;
+	}
+	Unlock();
+
+	return added;
+}
+
+void Mixer::RemoveVoice(MixerVoice *voice)
+{
+	Lock();
+	for (int32 i=0; i<voice_count; i++)
+	{
+		if (voices[i]==voice)
+		{
+			memmove(&voices[i], &voices[i+1], (voice_count-i-1)*sizeof(MixerVoice *));
+			voice_count--;
+			break;
+		}
+	}
+	Unlock();
+}
+
+void Mixer::GetMixStats(bigtime_t *average, bigtime_t *peak, int32 *count)
+{
+	*average = mix_count ? mix_time/mix_count : 0;
+	*peak = mix_peak;
+	*count = mix_count;
+}
+
+void Mixer::Play(void *cookie, void *buffer, size_t size,
+	const media_raw_audio_format &format)
+{
+	Mixer *m = (Mixer *)cookie;
+	bigtime_t start = system_time(), t;
+	int32 frames, count, i;
+
+	m->perf_time = m->player->PerformanceTime();
+
+	if (format.format == media_raw_audio_format::B_AUDIO_FLOAT)
+	{
+		m->Mix((float *)buffer, size/(2*sizeof(float)));
+	}
+	// In case the media server gave us something other than we asked for
+	else if (format.format == media_raw_audio_format::B_AUDIO_SHORT)
+	{
+		int16 *out = (int16 *)buffer;
+
+		for (frames = size/(2*sizeof(int16)); frames > 0; frames -= count)
+		{
+			count = (frames < MIXER_BUFFER_FRAMES) ? frames : MIXER_BUFFER_FRAMES;
+			m->Mix(m->mix_buffer, count);
+			for (i=0; i<count*2; i++)
+			{
+				float v = m->mix_buffer[i]*32767.0;
+				*out++ = (int16)((v > 32767.0) ? 32767 : ((v < -32768.0) ? -32768 : v));
+			}
+		}
+	}
+	else
+		memset(buffer, 0, size);
+
+	t = system_time() - start;
+	m->mix_time += t;
+	if (t > m->mix_peak) m->mix_peak = t;
+	m->mix_count++;
+
+#ifdef DEBUG_MIXER
+if (m->mix_count % 500 == 0)
+	fprintf(stderr, "Mixer: %ld voices, %lld us average, %lld us peak per callback\n",
+		(long)m->voice_count, (long long)(m->mix_time/m->mix_count),
+		(long long)m->mix_peak);
+#endif
+}
+
+
+/* Mix
+
+	Fills <buffer> with <frames> stereo frames of all the voices.
+*/
+
+void Mixer::Mix(float *buffer, int32 frames)
+{
+	memset(buffer, 0, frames*2*sizeof(float));
+
+	Lock();
+	for (int32 v=0; v<voice_count; v++)
+	{
+		MixerVoice *voice = voices[v];
+		float gain = voice->gain;
+		int32 fade = voice->fade_frames;
+		float *out = buffer;
+		int32 done = 0, i;
+
+		while (done < frames)
+		{
+			// Get enough source frames for the rest of the buffer
+			if ((int32)voice->position+1 >= voice->source_count)
+			{
+				voice->Fill((int32)(voice->position + (frames-done)*voice->step) + 2);
+				if ((int32)voice->position+1 >= voice->source_count)
+					break;
+			}
+
+			while (done < frames && (i = (int32)voice->position)+1 < voice->source_count)
+			{
+				const float *s = voice->source + i*2;
+				float f = voice->position - i;
+
+				out[0] += gain*(s[0] + f*(s[2]-s[0]));
+				out[1] += gain*(s[1] + f*(s[3]-s[1]));
+				out += 2;
+				voice->position += voice->step;
+				done++;
+
+				if (fade > 0)
+					gain = (--fade > 0) ? gain+voice->fade_step : voice->fade_target;
+			}
+		}
+		voice->gain = gain;
+		voice->fade_frames = fade;
+	}
+	Unlock();
+}
@@ -0,0 +1,98 @@
+/*
+	Mixer.h
+*/
+
+#ifndef _MIXER_H
+#define _MIXER_H
+
+#include <Locker.h>
+#include <MediaDefs.h>
+#include <SoundPlayer.h>
+
+// The mixer's output:  stereo floats at MIXER_FRAME_RATE, handed to
+// the media server MIXER_BUFFER_FRAMES at a time
+#define MIXER_FRAME_RATE 44100.0
+#define MIXER_BUFFER_FRAMES 1024
+#define MIXER_MAX_VOICES 16
+
+class MixerVoice
+{
+public:
+	MixerVoice();
+	virtual ~MixerVoice();
+
+	// Called from the mixer's callback, so it mustn't block:  fills
+	// <data> with up to <frames> frames in the voice's own format,
+	// and returns how many it filled
+	virtual int32 Read(void *data, int32 frames) = 0;
+
+	// Must be called before the voice is added to the mixer--or, for
+	// a format that fits what Reserve() allocated, with it locked
+	bool SetFormat(const media_raw_audio_format &format);
+	bool Reserve(uint32 max_frame_size);
+	const media_raw_audio_format &Format() const { return format; }
+
+	// SetGain() cancels any fade; FadeTo() moves the gain to <g>
+	// steadily over <duration>
+	void SetGain(float g);
+	void FadeTo(float g, bigtime_t duration);
+	float Gain() const { return gain; }
+
+private:
+	friend class Mixer;
+
+	bool Fill(int32 needed);
+
+	media_raw_audio_format format;
+	uint32 frame_size;
+	float gain;
+	float fade_target, fade_step;	// per output frame
+	int32 fade_frames;		// still to go
+
+	// Rate conversion:  source frames already converted to stereo
+	// floats, and the position between them of the next output frame
+	// (which advances by <step> source frames per output frame)
+	float *source;
+	int32 source_count;
+	double position, step;
+	uint8 *raw;
+	uint32 raw_frame_size;		// the largest <raw> has room for
+};
+
+class Mixer : public BLocker
+{
+public:
+	Mixer();
+	~Mixer();
+
+	// Adding the first voice starts the output stream
+	bool AddVoice(MixerVoice *voice);
+	void RemoveVoice(MixerVoice *voice);
+
+	// When the buffer currently being mixed will be heard
+	bigtime_t PerformanceTime() const { return perf_time; }
+
+	// Time spent per callback mixing, in microseconds
+	void GetMixStats(bigtime_t *average, bigtime_t *peak, int32 *count);
+
+private:
+	static void Play(void *cookie, void *buffer, size_t size,
+		const media_raw_audio_format &format);
+	bool Start();
+	void Mix(float *buffer, int32 frames);
+
+	BLocker start_lock;
+	BSoundPlayer * volatile player;
+	bool failed;
+	MixerVoice *voices[MIXER_MAX_VOICES];
+	int32 voice_count;
+	float *mix_buffer;		// if the output isn't floats
+	volatile bigtime_t perf_time;
+
+	bigtime_t mix_time, mix_peak;
+	int32 mix_count;
+};
+
+extern Mixer output_mixer;
+
+#endif	// ifndef _MIXER_H
@@ -0,0 +1,174 @@
+/*
+	PictureCache.cpp
+
+	A memory-bounded LRU cache of finished pictures, i.e., decoded
+	and (if necessary) scaled BBitmaps ready to be blitted, along
+	with where they go relative to the window they were drawn in.
+	It also holds the half-size levels that big pictures are
+	downscaled from.  Keys are built by the caller; see
+	hugo_displaypicture() and ScaleFromPyramid().
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PictureCache.h"
+
+#define DEFAULT_PICTURE_CACHE_SIZE (16*1024*1024)
+
+PictureCache picture_cache(DEFAULT_PICTURE_CACHE_SIZE);
+
+PictureCache::PictureCache(size_t _budget)
+	: BLocker("PictureCache")
+{
+	head = tail = NULL;
+	budget = _budget;
+	used = 0;
+	hits = misses = 0;
+}
+
+PictureCache::~PictureCache()
+{
+	Clear();
+}
+
+
+/* Find
+
+	Returns the bitmap cached under <key>, or NULL, and counts the
+	hit or miss.  A hit becomes the most recently used entry.
+*/
+
+BBitmap *PictureCache::Find(const char *key, BRect *rect)
+{
+	cache_entry *e;
+
+	for (e=head; e; e=e->next)
+	{
+		if (!strcmp(e->key, key))
+		{
+			// Move to the front
+			if (e!=head)
+			{
+				Unlink(e);
+				e->next = head;
+				head->prev = e;
+				head = e;
+			}
+			if (rect) *rect = e->rect;
+			hits++;
+			return e->bitmap;
+		}
+	}
+
+	misses++;
+	return NULL;
+}
+
+
+/* Add
+
+	Adds <bitmap> as the most recently used entry, evicting from the
+	least recently used end to stay within the budget.  If it's
+	added, the cache owns the bitmap; if it is too big to fit at all,
+	false is returned and the caller still owns it.
+*/
+
+bool PictureCache::Add(const char *key, BBitmap *bitmap, BRect rect)
+{
+	size_t bytes = bitmap->BitsLength();
+	if (bytes > budget) return false;
+
+	// Replace any existing entry with the same key
+	for (cache_entry *e=head; e; e=e->next)
+	{
+		if (!strcmp(e->key, key))
+		{
+			Unlink(e);
+			used -= e->bytes;
+			if (e->bitmap!=bitmap) delete e->bitmap;
+			free(e->key);
+			delete e;
+			break;
+		}
+	}
+
+	Evict(bytes);
+
+	cache_entry *e = new cache_entry;
+	e->key = strdup(key);
+	e->bitmap = bitmap;
+	e->rect = rect;
+	e->bytes = bytes;
+	e->prev = NULL;
+	e->next = head;
+	if (head) head->prev = e;
+	head = e;
+	if (!tail) tail = e;
+	used += bytes;
+
+	return true;
+}
+
+/* Take
+
+	Removes the entry for <key> and returns its bitmap, which the
+	caller then owns, or NULL.  Not counted as a hit or miss.
+*/
+
+BBitmap *PictureCache::Take(const char *key, BRect *rect)
+{
+	for (cache_entry *e=head; e; e=e->next)
+	{
+		if (!strcmp(e->key, key))
+		{
+			BBitmap *bitmap = e->bitmap;
+			if (rect) *rect = e->rect;
+			Unlink(e);
+			used -= e->bytes;
+			free(e->key);
+			delete e;
+			return bitmap;
+		}
+	}
+
+	return NULL;
+}
+
+void PictureCache::Clear()
+{
+	Evict(budget);
+}
+
+void PictureCache::SetBudget(size_t _budget)
+{
+	budget = _budget;
+	Evict(0);
+}
+
+void PictureCache::Unlink(cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+// Evicts least recently used entries until <needed> more bytes fit
+void PictureCache::Evict(size_t needed)
+{
+	while (tail && used+needed > budget)
+	{
+		cache_entry *e = tail;
+		Unlink(e);
+		used -= e->bytes;
+		delete e->bitmap;
+		free(e->key);
+		delete e;
+	}
+}
@@ -0,0 +1,50 @@
+/*
+	PictureCache.h
+*/
+
+#ifndef _PICTURECACHE_H
+#define _PICTURECACHE_H
+
+#include <Bitmap.h>
+#include <Locker.h>
+
+class PictureCache : public BLocker
+{
+public:
+	PictureCache(size_t budget);
+	~PictureCache();
+
+	// The cache must be locked around Find() and any use of the
+	// bitmap it returns
+	BBitmap *Find(const char *key, BRect *rect = NULL);
+	bool Add(const char *key, BBitmap *bitmap, BRect rect);
+	BBitmap *Take(const char *key, BRect *rect = NULL);
+	void Clear();
+
+	void SetBudget(size_t budget);
+	size_t Budget() const { return budget; }
+	size_t Used() const { return used; }
+	int32 Hits() const { return hits; }
+	int32 Misses() const { return misses; }
+
+private:
+	struct cache_entry
+	{
+		char *key;
+		BBitmap *bitmap;
+		BRect rect;
+		size_t bytes;
+		cache_entry *prev, *next;
+	};
+
+	void Unlink(cache_entry *e);
+	void Evict(size_t needed);
+
+	cache_entry *head, *tail;	// most to least recently used
+	size_t budget, used;
+	int32 hits, misses;
+};
+
+extern PictureCache picture_cache;
+
+#endif	// ifndef _PICTURECACHE_H
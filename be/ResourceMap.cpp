@@ -0,0 +1,173 @@
+/*
+	ResourceMap.cpp
+
+	Resource files are memory-mapped once per session and shared by
+	everything that reads resources out of them:  pictures, MediaView
+	audio/video, and MikMod.  Instead of reopening the file and
+	copying a resource into a private buffer, consumers get a
+	read-only BMemoryIO (or, for MikMod, a FILE *) over the
+	(offset, length) slice of the mapping, so repeated access is
+	served straight from the shared page cache.
+
+	Mappings are never unmapped; they last until the process exits.
+
+	Each newly mapped file is handed to the prefetcher (see
+	ResourcePrefetch.cpp), which is told about every resource read
+	out of it.
+*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Autolock.h>
+#include <File.h>
+
+#include "behugo.h"
+#include "ResourceMap.h"
+#include "ResourcePrefetch.h"
+#include "SubsetIO.h"
+
+extern "C"
+{
+#include "heheader.h"
+}
+
+ResourceMap *ResourceMap::first = NULL;
+BLocker ResourceMap::locker("ResourceMap::locker");
+
+ResourceMap::ResourceMap(const char *_name, const char *_path, char *_base, off_t _size)
+{
+	name = strdup(_name);
+	path = strdup(_path);
+	base = _base;
+	size = _size;
+	next = NULL;
+}
+
+
+/* ResourceMap::Map
+
+	Returns the session-wide mapping of the given file, mapping it
+	the first time it is asked for.  The file is located the same
+	way TrytoOpenBFile() does.  Returns NULL if the file can't be
+	found or mapped, in which case the caller should fall back to
+	reading it through a BFile.
+*/
+
+ResourceMap *ResourceMap::Map(char *name, char *where)
+{
+	BAutolock autolock(&locker);
+	ResourceMap *map;
+	char path[MAXPATH];
+
+	for (map=first; map; map=map->next)
+	{
+		if (!strcmp(map->name, name)) return map;
+	}
+
+	if (!TrytoFindFile(name, where, path)) return NULL;
+
+	// The same file may have been asked for by another name
+	for (map=first; map; map=map->next)
+	{
+		if (!strcmp(map->path, path)) return map;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size==0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping holds its own reference to the file
+	close(fd);
+	if (base==MAP_FAILED) return NULL;
+
+	map = new ResourceMap(name, path, (char *)base, st.st_size);
+	map->next = first;
+	first = map;
+
+	PrefetchResourceFile(map);
+
+	return map;
+}
+
+bool ResourceMap::Contains(off_t start, off_t length) const
+{
+	return (start >= 0 && length >= 0 && start+length <= size);
+}
+
+
+/* ResourceMap::MemoryIO
+
+	Returns a zero-copy, read-only BMemoryIO over the given slice;
+	the caller deletes it.
+*/
+
+BMemoryIO *ResourceMap::MemoryIO(off_t start, off_t length) const
+{
+	if (!Contains(start, length)) return NULL;
+	return new BMemoryIO((const void *)(base+start), (size_t)length);
+}
+
+
+/* ResourceMap::Stream
+
+	Returns a FILE * reading the given slice out of the mapping,
+	positioned at its start, for libraries like MikMod that want
+	stdio; the caller fcloses it.  Returns NULL on failure.
+*/
+
+FILE *ResourceMap::Stream(off_t start, off_t length) const
+{
+	if (!Contains(start, length) || length==0) return NULL;
+	return fmemopen(base+start, (size_t)length, "rb");
+}
+
+
+/* OpenResourceSubset
+
+	Builds the subset_io_data handed to the MediaView threads for the
+	resource at <start> in the file <name>, preferring a view of the
+	mapped file and falling back to a positioned BFile.  Returns NULL
+	if the file can't be opened.
+*/
+
+subset_io_data *OpenResourceSubset(char *name, off_t start, off_t length)
+{
+	ResourceMap *map;
+
+	if (!(map = ResourceMap::Map(name, "games")))
+		map = ResourceMap::Map(name, "object");
+	if (map && map->Contains(start, length))
+	{
+		PrefetchAccessed(map, start);
+		return new subset_io_data(map, start, length);
+	}
+
+	// Create a BFile from the path and position it; the thread
+	// will delete it when it deletes the subset_io_data
+	BFile *file;
+	if (!(file = TrytoOpenBFile(name, "games")))
+	{
+		if (!(file = TrytoOpenBFile(name, "object")))
+		{
+			return NULL;
+		}
+	}
+	if (file->InitCheck()!=B_OK)
+	{
+		delete file;
+		return NULL;
+	}
+
+	return new subset_io_data(file, start, length);
+}
@@ -0,0 +1,43 @@
+/*
+	ResourceMap.h
+*/
+
+#ifndef _RESOURCEMAP_H
+#define _RESOURCEMAP_H
+
+#include <stdio.h>
+#include <DataIO.h>
+#include <Locker.h>
+
+class subset_io_data;
+
+class ResourceMap
+{
+public:
+	static ResourceMap *Map(char *name, char *where);
+
+	const char *Name() const { return name; }
+	const char *Path() const { return path; }
+	off_t Size() const { return size; }
+	bool Contains(off_t start, off_t length) const;
+	const char *Data(off_t start) const { return base + start; }
+
+	BMemoryIO *MemoryIO(off_t start, off_t length) const;
+	FILE *Stream(off_t start, off_t length) const;
+
+private:
+	ResourceMap(const char *_name, const char *_path, char *_base, off_t _size);
+
+	char *name;
+	char *path;
+	char *base;
+	off_t size;
+	ResourceMap *next;
+
+	static ResourceMap *first;
+	static BLocker locker;
+};
+
+subset_io_data *OpenResourceSubset(char *name, off_t start, off_t length);
+
+#endif	// ifndef _RESOURCEMAP_H
@@ -0,0 +1,464 @@
+/*
+	ResourcePrefetch.cpp
+
+	Games tend to use their resources in the order they're stored in
+	the resource file, so once a resource file has been mapped (see
+	ResourceMap::Map()), a low-priority thread reads its index and
+	keeps the page cache warm for the resources following the last
+	one used, up to prefetch_budget bytes ahead.  It does that by
+	touching every page of those resources in the mapping, so that a
+	later MemoryIO() or Stream() of one--or the engine's own fread()
+	of it--doesn't have to wait for the disk.
+
+	If prefetch_pictures is set, that many of the JPEGs in the range
+	are also decoded and left in picture_cache, where the picture
+	thread takes them from instead of decoding them itself.
+
+	Build with DEBUG_PREFETCH for hit rates on stderr.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Autolock.h>
+#include <OS.h>
+#include <TranslationUtils.h>
+
+#include "behugo.h"
+#include "PictureCache.h"
+#include "ResourceMap.h"
+#include "ResourcePrefetch.h"
+
+extern "C"
+{
+#include "heheader.h"
+}
+
+#define DEFAULT_PREFETCH_BUDGET (8*1024*1024)
+
+size_t prefetch_budget = DEFAULT_PREFETCH_BUDGET;
+int32 prefetch_pictures = 0;
+
+struct resource_entry
+{
+	char name[256];
+	off_t start, length;	// in the file, not relative to the data
+	bool prefetched;
+	bool decoded;
+};
+
+struct prefetch_file
+{
+	ResourceMap *map;
+	resource_entry *entries;	// in file order
+	int32 count;			// -1 until the index is read
+	off_t index_length;
+	int32 cursor;			// the last entry used, or -1
+	int32 next;			// the next entry to prefetch
+	off_t accessed;			// used before the index was read, or -1
+	prefetch_file *next_file;
+};
+
+static BLocker prefetch_lock("prefetch");
+static prefetch_file *prefetch_files = NULL;
+static sem_id prefetch_sem = -1;
+static thread_id prefetch_thread = -1;
+static volatile bool prefetch_quit = false;
+
+static int32 prefetch_hits = 0, prefetch_misses = 0;
+static int32 pictures_decoded = 0, pictures_used = 0;
+
+static int32 PrefetchThread(void *data);
+
+
+/* PrefetchResourceFile
+
+	Called by ResourceMap::Map() the first time a file is mapped.
+	The index is read on the prefetch thread, not here, so that the
+	caller doesn't wait for it.
+*/
+
+void PrefetchResourceFile(ResourceMap *map)
+{
+	if (prefetch_budget==0 || prefetch_quit) return;
+
+	BAutolock autolock(&prefetch_lock);
+
+	if (prefetch_thread < B_OK)
+	{
+		if ((prefetch_sem = create_sem(0, "prefetch")) < B_OK) return;
+		prefetch_thread = spawn_thread(PrefetchThread, "Hugo prefetch thread",
+			B_LOW_PRIORITY, NULL);
+		if (prefetch_thread < B_OK || resume_thread(prefetch_thread)!=B_OK)
+		{
+			delete_sem(prefetch_sem);
+			prefetch_thread = -1;
+			return;
+		}
+	}
+
+	prefetch_file *f = new prefetch_file;
+	f->map = map;
+	f->entries = NULL;
+	f->count = -1;
+	f->index_length = 0;
+	f->cursor = -1;
+	f->next = 0;
+	f->accessed = -1;
+	f->next_file = prefetch_files;
+	prefetch_files = f;
+
+	release_sem(prefetch_sem);
+}
+
+
+// Returns the entry starting at <start>, or -1; called with
+// prefetch_lock held
+static int32 FindEntry(prefetch_file *f, off_t start)
+{
+	int32 lo = 0, hi = f->count-1;
+
+	while (lo <= hi)
+	{
+		int32 mid = (lo+hi)/2;
+		if (f->entries[mid].start==start) return mid;
+		if (f->entries[mid].start < start)
+			lo = mid+1;
+		else
+			hi = mid-1;
+	}
+	return -1;
+}
+
+static void EntryAccessed(prefetch_file *f, int32 n)
+{
+	if (f->entries[n].prefetched)
+		prefetch_hits++;
+	else
+		prefetch_misses++;
+
+	f->cursor = n;
+	if (f->next < n+1) f->next = n+1;
+
+#ifdef DEBUG_PREFETCH
+fprintf(stderr, "PrefetchAccessed: %s %s (%ld hits, %ld misses; %ld of %ld decoded pictures used)\n",
+	f->entries[n].name, f->entries[n].prefetched?"hit":"miss",
+	prefetch_hits, prefetch_misses, pictures_used, pictures_decoded);
+#endif
+}
+
+
+/* PrefetchAccessed
+
+	Called whenever a resource is read out of a mapped file, to count
+	a hit or a miss and move the prefetch window along.
+*/
+
+void PrefetchAccessed(ResourceMap *map, off_t start)
+{
+	BAutolock autolock(&prefetch_lock);
+	prefetch_file *f;
+
+	for (f=prefetch_files; f; f=f->next_file)
+	{
+		if (f->map==map) break;
+	}
+	if (!f) return;
+
+	if (f->count < 0)
+	{
+		f->accessed = start;
+		return;
+	}
+
+	int32 n = FindEntry(f, start);
+	if (n < 0) return;
+
+	EntryAccessed(f, n);
+	release_sem(prefetch_sem);
+}
+
+
+/* TakePrefetchedPicture
+
+	Returns the picture the prefetcher decoded for <source_key> (see
+	hugo_displaypicture()), which the caller then owns, or NULL.
+*/
+
+BBitmap *TakePrefetchedPicture(const char *source_key)
+{
+	char key[MAXPATH*2+40];
+	BBitmap *img = NULL;
+
+	sprintf(key, "%s#0", source_key);
+	if (picture_cache.Lock())
+	{
+		img = picture_cache.Take(key);
+		picture_cache.Unlock();
+	}
+	if (img) atomic_add(&pictures_used, 1);
+
+	return img;
+}
+
+
+//---------------------------------------------------------------------------
+// The prefetch thread
+//---------------------------------------------------------------------------
+
+static off_t ReadNumber(const uint8 *p, int bytes)
+{
+	off_t n = 0;
+	for (int i=bytes-1; i>=0; i--)
+		n = n*256 + p[i];
+	return n;
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+	off_t sa = ((const resource_entry *)a)->start;
+	off_t sb = ((const resource_entry *)b)->start;
+	return (sa < sb) ? -1 : (sa > sb);
+}
+
+
+/* ReadResourceIndex
+
+	Reads the index at the start of a Hugo resource file:  'R' (for
+	24-bit positions and lengths) or 'r' (32-bit), a version byte,
+	the 16-bit number of resources and the 16-bit size of the index,
+	then for each resource its name (a length byte and the
+	characters), its position relative to the end of the index, and
+	its length.  Everything is checked against the size of the file,
+	so one that isn't a resource file (like a module or sample that
+	was loaded directly) just ends up with no entries.
+*/
+
+static void ReadResourceIndex(prefetch_file *f)
+{
+	const uint8 *p = (const uint8 *)f->map->Data(0);
+	off_t size = f->map->Size(), i, index_size;
+	resource_entry *entries = NULL;
+	int32 count = 0, n;
+	int bytes;
+
+	if (size < 6) goto BadIndex;
+
+	if (p[0]=='R')
+		bytes = 3;
+	else if (p[0]=='r')
+		bytes = 4;
+	else
+		goto BadIndex;
+
+	count = p[2] | p[3]<<8;
+	index_size = p[4] | p[5]<<8;
+	if (count==0) goto BadIndex;
+
+	entries = (resource_entry *)malloc(count*sizeof(resource_entry));
+	if (!entries) goto BadIndex;
+
+	for (i=6, n=0; n<count; n++)
+	{
+		if (i >= size) goto BadIndex;
+		int len = p[i++];
+		if (i+len+bytes*2 > size) goto BadIndex;
+
+		memcpy(entries[n].name, p+i, len);
+		entries[n].name[len] = '\0';
+		i += len;
+		entries[n].start = ReadNumber(p+i, bytes);
+		i += bytes;
+		entries[n].length = ReadNumber(p+i, bytes);
+		i += bytes;
+		entries[n].prefetched = entries[n].decoded = false;
+	}
+
+	// The index size may or may not count the 6-byte header, but the
+	// data has to start right where the index ends
+	if (index_size!=i && index_size!=i-6) goto BadIndex;
+
+	for (n=0; n<count; n++)
+	{
+		entries[n].start += i;
+		if (!f->map->Contains(entries[n].start, entries[n].length))
+			goto BadIndex;
+	}
+
+	qsort(entries, count, sizeof(resource_entry), CompareEntries);
+
+	prefetch_lock.Lock();
+	f->entries = entries;
+	f->count = count;
+	f->index_length = i;
+	if (f->accessed >= 0)
+	{
+		if ((n = FindEntry(f, f->accessed)) >= 0) EntryAccessed(f, n);
+	}
+	prefetch_lock.Unlock();
+	return;
+
+BadIndex:
+	free(entries);
+	prefetch_lock.Lock();
+	f->count = 0;
+	prefetch_lock.Unlock();
+}
+
+// What TouchPages() read, kept so that the reads can't be dropped
+static volatile char touched_sum;
+
+// Brings every page of the given part of the mapping into memory
+static void TouchPages(ResourceMap *map, off_t start, off_t length)
+{
+	const volatile char *p = map->Data(start);
+	char sum = 0;
+
+	for (off_t i=0; i<length; i+=B_PAGE_SIZE)
+		sum += p[i];
+	if (length) sum += p[length-1];
+	touched_sum = sum;
+}
+
+static void DecodePicture(prefetch_file *f, resource_entry *e)
+{
+	const uint8 *p = (const uint8 *)f->map->Data(e->start);
+	char key[MAXPATH*2+40];
+
+	// Only JPEGs are displayed, so don't bother with anything else
+	if (e->length < 2 || p[0]!=0xff || p[1]!=0xd8) return;
+
+	BMemoryIO *io = f->map->MemoryIO(e->start, e->length);
+	if (!io) return;
+	BBitmap *img = BTranslationUtils::GetBitmap(io);
+	delete io;
+	if (!img) return;
+
+	// Keyed the same way as in hugo_displaypicture()
+	sprintf(key, "%s|%s#0", f->map->Name(), e->name);
+	strupr(key);
+
+	// Don't let one decoded picture push everything else out of
+	// the cache
+	bool cached = false;
+	if (picture_cache.Lock())
+	{
+		if ((size_t)img->BitsLength() <= picture_cache.Budget()/4)
+			cached = picture_cache.Add(key, img, img->Bounds());
+		picture_cache.Unlock();
+	}
+	if (cached)
+	{
+		prefetch_lock.Lock();
+		e->decoded = true;
+		prefetch_lock.Unlock();
+		atomic_add(&pictures_decoded, 1);
+	}
+	else
+		delete img;
+}
+
+
+/* PrefetchNext
+
+	Prefetches the next entry of <f> if it's within prefetch_budget
+	bytes of the last one used; returns false if there's nothing
+	more to do for now.
+*/
+
+static bool PrefetchNext(prefetch_file *f)
+{
+	resource_entry *e;
+	bool decode;
+
+	prefetch_lock.Lock();
+	int32 n = f->next;
+	if (f->count <= 0 || n >= f->count)
+	{
+		prefetch_lock.Unlock();
+		return false;
+	}
+	e = &f->entries[n];
+	off_t window_start = f->entries[f->cursor+1].start;
+	if (e->start + e->length - window_start > (off_t)prefetch_budget)
+	{
+		prefetch_lock.Unlock();
+		return false;
+	}
+	f->next = n+1;
+	decode = (n - f->cursor <= prefetch_pictures && !e->decoded);
+	prefetch_lock.Unlock();
+
+	TouchPages(f->map, e->start, e->length);
+	prefetch_lock.Lock();
+	e->prefetched = true;
+	prefetch_lock.Unlock();
+
+	if (decode) DecodePicture(f, e);
+
+	return true;
+}
+
+static int32 PrefetchThread(void *data)
+{
+	prefetch_file *f;
+	bool more;
+
+	while (acquire_sem(prefetch_sem)==B_OK)
+	{
+		// Files are never removed from the list, so they can be
+		// walked without holding the lock
+		do
+		{
+			more = false;
+
+			prefetch_lock.Lock();
+			f = prefetch_files;
+			prefetch_lock.Unlock();
+
+			for (; f && !prefetch_quit; f=f->next_file)
+			{
+				if (f->count < 0)
+				{
+					ReadResourceIndex(f);
+					TouchPages(f->map, 0, f->index_length);
+				}
+				if (PrefetchNext(f)) more = true;
+			}
+		}
+		while (more && prefetch_budget && !prefetch_quit);
+	}
+
+	return 0;
+}
+
+
+/* ExitPrefetch
+
+	Called at quit:  stops the prefetch thread after whatever entry
+	it's reading or decoding, waits for it, and frees the files'
+	indexes (their maps belong to ResourceMap).
+*/
+
+void ExitPrefetch(void)
+{
+	prefetch_file *f;
+	status_t result;
+
+	prefetch_lock.Lock();
+	prefetch_quit = true;
+	if (prefetch_thread >= B_OK) delete_sem(prefetch_sem);
+	prefetch_lock.Unlock();
+
+	if (prefetch_thread >= B_OK) wait_for_thread(prefetch_thread, &result);
+	prefetch_thread = -1;
+
+	prefetch_lock.Lock();
+	while ((f = prefetch_files))
+	{
+		prefetch_files = f->next_file;
+		free(f->entries);
+		delete f;
+	}
+	prefetch_lock.Unlock();
+}
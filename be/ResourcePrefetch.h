@@ -0,0 +1,24 @@
+/*
+	ResourcePrefetch.h
+*/
+
+#ifndef _RESOURCEPREFETCH_H
+#define _RESOURCEPREFETCH_H
+
+#include <SupportDefs.h>
+
+class BBitmap;
+class ResourceMap;
+
+void PrefetchResourceFile(ResourceMap *map);
+void PrefetchAccessed(ResourceMap *map, off_t start);
+BBitmap *TakePrefetchedPicture(const char *source_key);
+void ExitPrefetch(void);
+
+// Settings:  how far ahead of the last resource used to read, in
+// bytes, and how many of the pictures in that range to decode into
+// picture_cache as well (0 for none)
+extern size_t prefetch_budget;
+extern int32 prefetch_pictures;
+
+#endif	// ifndef _RESOURCEPREFETCH_H
@@ -8,10 +8,20 @@
 
 #include <stdio.h>
 #include "SubsetIO.h"
+#include "ResourceMap.h"
 
 subset_io_data::subset_io_data(BFile *_file, off_t _start, off_t _length)
 {
 	file = _file;
+	map = NULL;
+	start = _start;
+	length = _length;
+}
+
+subset_io_data::subset_io_data(ResourceMap *_map, off_t _start, off_t _length)
+{
+	file = NULL;
+	map = _map;
 	start = _start;
 	length = _length;
 }
@@ -22,49 +32,83 @@ subset_io_data::~subset_io_data()
 	delete file;
 }
 
+// Returns a stream over the resource:  a zero-copy view if the
+// resource file is mapped, otherwise a SubsetIO over the BFile.
+// The caller deletes it.
+BPositionIO *subset_io_data::CreateIO()
+{
+	if (map)
+		return map->MemoryIO(start, length);
+	return new SubsetIO(file, start, start+length);
+}
+
 SubsetIO::SubsetIO(BPositionIO* io, off_t from, off_t to) :
 		m_io(io),
 		m_beginOffset(from),
-		m_endOffset(-m_beginOffset)
+		m_length(to - from),
+		m_position(0)
 	{
+		// Don't run past the end of the underlying file
 		off_t end = m_io->Seek(0, SEEK_END);
-		if (end >= to)
-			m_endOffset += (to - end);
+		if (end < to)
+			m_length = end - from;
+		if (m_length < 0)
+			m_length = 0;
 	}
 
 SubsetIO::~SubsetIO()
 {
 }
+
+// The position is kept here, relative to the start of the subset,
+// rather than in m_io; reads go through ReadAt() so that several
+// SubsetIOs can share one file.
   
 ssize_t SubsetIO::Read(void *buffer, size_t size)
 {
-	ssize_t ret = ReadAt(Position(), buffer, size);
-	Seek(size, SEEK_CUR);
+	ssize_t ret = ReadAt(m_position, buffer, size);
+	if (ret > 0) m_position += ret;
 	return ret;
 }
 
 ssize_t SubsetIO::ReadAt(off_t pos, void* buffer, size_t size)
 {
+	if (pos < 0) return B_BAD_VALUE;
+	if (pos >= m_length) return 0;
+	if ((off_t)size > m_length - pos) size = (size_t)(m_length - pos);
 	return m_io->ReadAt(pos + m_beginOffset, buffer, size);
 }
 
 ssize_t SubsetIO::WriteAt(off_t pos, const void* buffer, size_t size)
 {
-	return m_io->WriteAt(pos + m_beginOffset, buffer, size);
+	return B_NOT_ALLOWED;
 }
 
 off_t SubsetIO::Seek(off_t position, uint32 seek_mode)
 {
-	off_t ret = m_io->Seek(position, seek_mode);
-	return (seek_mode == SEEK_END) ? ret + m_endOffset : ret;
+	switch (seek_mode)
+	{
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			position += m_position;
+			break;
+		case SEEK_END:
+			position += m_length;
+			break;
+		default:
+			return B_BAD_VALUE;
+	}
+	if (position < 0) return B_BAD_VALUE;
+	return m_position = position;
 }
 
 off_t SubsetIO::Position() const
 {
-	return m_io->Position();
+	return m_position;
 }
 
 status_t SubsetIO::SetSize(off_t size)
 {
-	return m_io->SetSize(size);
+	return B_NOT_ALLOWED;
 }
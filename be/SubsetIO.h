@@ -8,13 +8,19 @@
 #include <DataIO.h>
 #include <File.h>
 
+class ResourceMap;
+
 class subset_io_data
 {
 public:
 	subset_io_data(BFile *_file, off_t _start, off_t _length);
+	subset_io_data(ResourceMap *_map, off_t _start, off_t _length);
 	~subset_io_data();
 	
+	BPositionIO *CreateIO();
+	
 	BFile *file;
+	ResourceMap *map;
 	off_t start;
 	off_t length;
 };
@@ -36,7 +42,8 @@ public:
 private:
 	BPositionIO* m_io;
 	off_t m_beginOffset;
-	off_t m_endOffset;
+	off_t m_length;
+	off_t m_position;
 };
 
 #endif	// ifndef _SUBSETIO_H
@@ -0,0 +1,459 @@
+/*
+	VideoConvert.cpp
+
+	YCbCr to B_RGB32 conversion for video, used when there's no
+	overlay and the picture has to be drawn as an ordinary bitmap.
+	Decoding to YCbCr and converting here in one pass over each row
+	is much cheaper than leaving the conversion to the codec's
+	generic per-pixel path.
+
+	Both formats are as defined in GraphicsDefs.h:
+
+	B_YCbCr422:  Y0 Cb0 Y1 Cr0  Y2 Cb2 Y3 Cr2 ...
+	B_YCbCr420:  Cb0 Y0 Y1  Cb2 Y2 Y3 ...  on even lines, and
+	             Cr0 Y0 Y1  Cr2 Y2 Y3 ...  on odd lines
+
+	The conversion is ITU-R BT.601 (16-235 luma), in fixed point with
+	six fractional bits:
+
+	R = (74*(Y-16) + 102*Cr' + 32) >> 6
+	G = (74*(Y-16) -  25*Cb' - 52*Cr' + 32) >> 6
+	B = (74*(Y-16) + 129*Cb' + 32) >> 6
+
+	where Cb' and Cr' are Cb-128 and Cr-128.  The sums fit in 16 bits
+	except where they'd be clamped to 255 anyway, so SSE2 does eight
+	pixels at a time and AVX2 sixteen, with saturating adds; plain C
+	does the same math and gets the same result.  Which of those the
+	CPU has is checked when converting, not when compiling (see
+	CPUFeatures.h).
+
+	Build with BENCHMARK_VIDEO to get BenchmarkVideoConversion(),
+	which compares this against straightforward floating-point
+	conversion.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <OS.h>
+
+#include "CPUFeatures.h"
+#include "VideoConvert.h"
+
+// For converting B_YCbCr420, which is deinterleaved this many pixels
+// at a time into buffers on the stack
+#define CHUNK_PIXELS 256
+
+static inline uint8 ClampPixel(int32 v)
+{
+	v >>= 6;
+	return (uint8)((v < 0) ? 0 : ((v > 255) ? 255 : v));
+}
+
+static inline void ConvertPixel(int32 y, int32 cb, int32 cr, uint8 *dest)
+{
+	int32 yy = 74*(y-16) + 32;
+
+	dest[0] = ClampPixel(yy + 129*cb);
+	dest[1] = ClampPixel(yy - 25*cb - 52*cr);
+	dest[2] = ClampPixel(yy + 102*cr);
+	dest[3] = 255;
+}
+
+
+//---------------------------------------------------------------------------
+// Vector kernels
+//---------------------------------------------------------------------------
+
+#if defined (HAVE_X86_SIMD)
+
+/* StoreBGRA8
+
+	Converts eight pixels, given as 16-bit Y and (already offset)
+	Cb and Cr, one of each per pixel, and stores them at <dest>.
+*/
+
+TARGET_SSE2
+static inline void StoreBGRA8(__m128i y, __m128i cb, __m128i cr, uint8 *dest)
+{
+	__m128i yy = _mm_add_epi16(_mm_mullo_epi16(
+		_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(74)),
+		_mm_set1_epi16(32));
+
+	__m128i b = _mm_adds_epi16(yy, _mm_mullo_epi16(cb, _mm_set1_epi16(129)));
+	__m128i g = _mm_subs_epi16(_mm_subs_epi16(yy,
+		_mm_mullo_epi16(cb, _mm_set1_epi16(25))),
+		_mm_mullo_epi16(cr, _mm_set1_epi16(52)));
+	__m128i r = _mm_adds_epi16(yy, _mm_mullo_epi16(cr, _mm_set1_epi16(102)));
+
+	b = _mm_srai_epi16(b, 6);
+	g = _mm_srai_epi16(g, 6);
+	r = _mm_srai_epi16(r, 6);
+
+	// B G pairs and R A pairs, then the two together
+	__m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+	__m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_set1_epi8((char)0xff));
+	_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dest+16), _mm_unpackhi_epi16(bg, ra));
+}
+
+// The same for sixteen pixels; everything works within 128-bit
+// lanes, so the low lane ends up with pixels 0-7 and the high lane
+// with 8-15
+TARGET_AVX2
+static inline void StoreBGRA16(__m256i y, __m256i cb, __m256i cr, uint8 *dest)
+{
+	__m256i yy = _mm256_add_epi16(_mm256_mullo_epi16(
+		_mm256_sub_epi16(y, _mm256_set1_epi16(16)), _mm256_set1_epi16(74)),
+		_mm256_set1_epi16(32));
+
+	__m256i b = _mm256_adds_epi16(yy, _mm256_mullo_epi16(cb, _mm256_set1_epi16(129)));
+	__m256i g = _mm256_subs_epi16(_mm256_subs_epi16(yy,
+		_mm256_mullo_epi16(cb, _mm256_set1_epi16(25))),
+		_mm256_mullo_epi16(cr, _mm256_set1_epi16(52)));
+	__m256i r = _mm256_adds_epi16(yy, _mm256_mullo_epi16(cr, _mm256_set1_epi16(102)));
+
+	b = _mm256_srai_epi16(b, 6);
+	g = _mm256_srai_epi16(g, 6);
+	r = _mm256_srai_epi16(r, 6);
+
+	__m256i bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+	__m256i ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), _mm256_set1_epi8((char)0xff));
+	__m256i lo = _mm256_unpacklo_epi16(bg, ra);	// pixels 0-3, 8-11
+	__m256i hi = _mm256_unpackhi_epi16(bg, ra);	// pixels 4-7, 12-15
+	_mm256_storeu_si256((__m256i *)dest, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(dest+32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+
+/* ConvertRow422AVX2, ConvertRow422SSE2
+
+	Convert as much of a ConvertRow422() row as they can, sixteen or
+	eight pixels at a time, and return how far they got; the SSE2
+	one starts at pixel <x>.
+*/
+
+TARGET_AVX2
+static int32 ConvertRow422AVX2(const uint8 *src, uint8 *dest, int32 width)
+{
+	__m256i lowbytes = _mm256_set1_epi16(0x00ff);
+	__m256i lowwords = _mm256_set1_epi32(0x0000ffff);
+	__m256i offset = _mm256_set1_epi16(128);
+	int32 x = 0;
+
+	for (; x+16<=width; x+=16)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + x*2));
+		__m256i y = _mm256_and_si256(p, lowbytes);
+		__m256i c = _mm256_srli_epi16(p, 8);	// Cb Cr Cb Cr ...
+		__m256i cb = _mm256_and_si256(c, lowwords);
+		__m256i cr = _mm256_srli_epi32(c, 16);
+		cb = _mm256_sub_epi16(_mm256_or_si256(cb, _mm256_slli_epi32(cb, 16)), offset);
+		cr = _mm256_sub_epi16(_mm256_or_si256(cr, _mm256_slli_epi32(cr, 16)), offset);
+		StoreBGRA16(y, cb, cr, dest + x*4);
+	}
+	return x;
+}
+
+TARGET_SSE2
+static int32 ConvertRow422SSE2(const uint8 *src, uint8 *dest, int32 width,
+	int32 x)
+{
+	__m128i lowbytes = _mm_set1_epi16(0x00ff);
+	__m128i lowwords = _mm_set1_epi32(0x0000ffff);
+	__m128i offset = _mm_set1_epi16(128);
+
+	// Eight pixels (sixteen bytes) per pass:  the Ys are the
+	// low bytes of each 16-bit word, and each Cb and Cr is
+	// copied to both pixels of its pair
+	for (; x+8<=width; x+=8)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + x*2));
+		__m128i y = _mm_and_si128(p, lowbytes);
+		__m128i c = _mm_srli_epi16(p, 8);	// Cb Cr Cb Cr ...
+		__m128i cb = _mm_and_si128(c, lowwords);
+		__m128i cr = _mm_srli_epi32(c, 16);
+		cb = _mm_sub_epi16(_mm_or_si128(cb, _mm_slli_epi32(cb, 16)), offset);
+		cr = _mm_sub_epi16(_mm_or_si128(cr, _mm_slli_epi32(cr, 16)), offset);
+		StoreBGRA8(y, cb, cr, dest + x*4);
+	}
+	return x;
+}
+
+
+/* ConvertRowPlanarAVX2, ConvertRowPlanarSSE2
+
+	The same for ConvertRowPlanar().
+*/
+
+TARGET_AVX2
+static int32 ConvertRowPlanarAVX2(const uint8 *y, const uint8 *cb,
+	const uint8 *cr, uint8 *dest, int32 width)
+{
+	__m256i offset = _mm256_set1_epi16(128);
+	int32 x = 0;
+
+	for (; x+16<=width; x+=16)
+	{
+		__m256i vy = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y+x)));
+		__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + x/2)),
+			_mm_setzero_si128());
+		__m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + x/2)),
+			_mm_setzero_si128());
+		__m256i vcb = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_unpacklo_epi16(b, b)), _mm_unpackhi_epi16(b, b), 1);
+		__m256i vcr = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_unpacklo_epi16(r, r)), _mm_unpackhi_epi16(r, r), 1);
+		StoreBGRA16(vy, _mm256_sub_epi16(vcb, offset),
+			_mm256_sub_epi16(vcr, offset), dest + x*4);
+	}
+	return x;
+}
+
+TARGET_SSE2
+static int32 ConvertRowPlanarSSE2(const uint8 *y, const uint8 *cb,
+	const uint8 *cr, uint8 *dest, int32 width, int32 x)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i offset = _mm_set1_epi16(128);
+
+	for (; x+8<=width; x+=8)
+	{
+		int32 b4, r4;
+		memcpy(&b4, cb + x/2, 4);
+		memcpy(&r4, cr + x/2, 4);
+
+		__m128i vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y+x)), zero);
+		__m128i vcb = _mm_unpacklo_epi8(_mm_cvtsi32_si128(b4), zero);
+		__m128i vcr = _mm_unpacklo_epi8(_mm_cvtsi32_si128(r4), zero);
+		StoreBGRA8(vy, _mm_sub_epi16(_mm_unpacklo_epi16(vcb, vcb), offset),
+			_mm_sub_epi16(_mm_unpacklo_epi16(vcr, vcr), offset), dest + x*4);
+	}
+	return x;
+}
+
+#endif	// HAVE_X86_SIMD
+
+
+//---------------------------------------------------------------------------
+// Rows
+//---------------------------------------------------------------------------
+
+/* ConvertRow422
+
+	Converts one row of <width> B_YCbCr422 pixels.
+*/
+
+static void ConvertRow422(const uint8 *src, uint8 *dest, int32 width)
+{
+	int32 x = 0;
+
+#if defined (HAVE_X86_SIMD)
+	if (CPUHasAVX2())
+		x = ConvertRow422AVX2(src, dest, width);
+	if (CPUHasSSE2())
+		x = ConvertRow422SSE2(src, dest, width, x);
+#endif
+
+	for (; x<width; x+=2)
+	{
+		const uint8 *p = src + x*2;
+		int32 cb = p[1]-128, cr = p[3]-128;
+
+		ConvertPixel(p[0], cb, cr, dest + x*4);
+		if (x+1 < width) ConvertPixel(p[2], cb, cr, dest + x*4+4);
+	}
+}
+
+
+/* ConvertRowPlanar
+
+	Converts one row of <width> pixels from separate Y, Cb and Cr,
+	with one Cb and Cr for every two pixels.
+*/
+
+static void ConvertRowPlanar(const uint8 *y, const uint8 *cb, const uint8 *cr,
+	uint8 *dest, int32 width)
+{
+	int32 x = 0;
+
+#if defined (HAVE_X86_SIMD)
+	if (CPUHasAVX2())
+		x = ConvertRowPlanarAVX2(y, cb, cr, dest, width);
+	if (CPUHasSSE2())
+		x = ConvertRowPlanarSSE2(y, cb, cr, dest, width, x);
+#endif
+
+	for (; x<width; x++)
+		ConvertPixel(y[x], cb[x/2]-128, cr[x/2]-128, dest + x*4);
+}
+
+
+//---------------------------------------------------------------------------
+// Frames
+//---------------------------------------------------------------------------
+
+void ConvertYCbCr422(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 width, int32 height)
+{
+	for (int32 row=0; row<height; row++)
+		ConvertRow422(src + row*src_bpr, dest + row*dest_bpr, width);
+}
+
+void ConvertYCbCr420(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 width, int32 height)
+{
+	uint8 y0[CHUNK_PIXELS], y1[CHUNK_PIXELS];
+	uint8 cb[CHUNK_PIXELS/2], cr[CHUNK_PIXELS/2];
+
+	// Each pair of lines shares the Cb from the even one and the Cr
+	// from the odd one; they're pulled apart a chunk at a time so
+	// that the planar kernel can do the rest
+	for (int32 row=0; row<height; row+=2)
+	{
+		const uint8 *even = src + row*src_bpr;
+		const uint8 *odd = (row+1 < height) ? even+src_bpr : NULL;
+
+		for (int32 x=0; x<width; x+=CHUNK_PIXELS)
+		{
+			int32 n = width-x, i;
+			if (n > CHUNK_PIXELS) n = CHUNK_PIXELS;
+
+			const uint8 *e = even + (x/2)*3;
+			const uint8 *o = (odd) ? odd + (x/2)*3 : e;
+			for (i=0; i<n; i+=2)
+			{
+				cb[i/2] = e[0];
+				y0[i] = e[1];
+				y0[i+1] = e[2];
+				cr[i/2] = o[0];
+				y1[i] = o[1];
+				y1[i+1] = o[2];
+				e += 3;
+				o += 3;
+			}
+
+			ConvertRowPlanar(y0, cb, cr, dest + row*dest_bpr + x*4, n);
+			if (odd)
+				ConvertRowPlanar(y1, cb, cr, dest + (row+1)*dest_bpr + x*4, n);
+		}
+	}
+}
+
+bool ConvertVideoBitmap(BBitmap *dest, const BBitmap *src)
+{
+	BRect bounds = src->Bounds();
+	int32 width = bounds.IntegerWidth()+1;
+	int32 height = bounds.IntegerHeight()+1;
+
+	if (dest->ColorSpace()!=B_RGB32 || dest->Bounds()!=bounds)
+		return false;
+
+	switch (src->ColorSpace())
+	{
+		case B_YCbCr422:
+			ConvertYCbCr422((const uint8 *)src->Bits(), src->BytesPerRow(),
+				(uint8 *)dest->Bits(), dest->BytesPerRow(), width, height);
+			return true;
+
+		case B_YCbCr420:
+			ConvertYCbCr420((const uint8 *)src->Bits(), src->BytesPerRow(),
+				(uint8 *)dest->Bits(), dest->BytesPerRow(), width, height);
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+//---------------------------------------------------------------------------
+// Benchmarking
+//---------------------------------------------------------------------------
+
+#ifdef BENCHMARK_VIDEO
+
+// Straightforward per-pixel floating-point conversion of B_YCbCr422,
+// for comparison
+
+static inline uint8 ReferenceClamp(double v)
+{
+	return (uint8)((v < 0.0) ? 0 : ((v > 255.0) ? 255 : (int)(v+0.5)));
+}
+
+static void ReferenceYCbCr422(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 width, int32 height)
+{
+	for (int32 row=0; row<height; row++)
+	{
+		for (int32 x=0; x<width; x++)
+		{
+			const uint8 *p = src + row*src_bpr + (x & ~1)*2;
+			double y = 1.164*((x & 1) ? p[2]-16 : p[0]-16);
+			double cb = p[1]-128.0, cr = p[3]-128.0;
+			uint8 *out = dest + row*dest_bpr + x*4;
+
+			out[0] = ReferenceClamp(y + 2.018*cb);
+			out[1] = ReferenceClamp(y - 0.391*cb - 0.813*cr);
+			out[2] = ReferenceClamp(y + 1.596*cr);
+			out[3] = 255;
+		}
+	}
+}
+
+#define BENCHMARK_RUNS 5
+
+static void BenchmarkSize(int32 w, int32 h)
+{
+	BBitmap yuv422(BRect(0, 0, w-1, h-1), B_YCbCr422);
+	BBitmap yuv420(BRect(0, 0, w-1, h-1), B_YCbCr420);
+	BBitmap rgb(BRect(0, 0, w-1, h-1), B_RGB32);
+	bigtime_t t, ref_time = 0, time422 = 0, time420 = 0;
+	int i;
+
+	// Something other than a flat color to chew on
+	uint8 *bits = (uint8 *)yuv422.Bits();
+	for (i=0; i<yuv422.BitsLength(); i++)
+		bits[i] = (uint8)(i*7 + i/4096);
+	bits = (uint8 *)yuv420.Bits();
+	for (i=0; i<yuv420.BitsLength(); i++)
+		bits[i] = (uint8)(i*7 + i/4096);
+
+	// Best of BENCHMARK_RUNS for each
+	for (i=0; i<BENCHMARK_RUNS; i++)
+	{
+		t = system_time();
+		ReferenceYCbCr422((const uint8 *)yuv422.Bits(), yuv422.BytesPerRow(),
+			(uint8 *)rgb.Bits(), rgb.BytesPerRow(), w, h);
+		t = system_time()-t;
+		if (!ref_time || t < ref_time) ref_time = t;
+
+		t = system_time();
+		ConvertVideoBitmap(&rgb, &yuv422);
+		t = system_time()-t;
+		if (!time422 || t < time422) time422 = t;
+
+		t = system_time();
+		ConvertVideoBitmap(&rgb, &yuv420);
+		t = system_time()-t;
+		if (!time420 || t < time420) time420 = t;
+	}
+
+	if (!time422) time422 = 1;
+	if (!time420) time420 = 1;
+
+	// int32 and bigtime_t aren't long and long long everywhere
+	fprintf(stderr, "BenchmarkVideoConversion: %ldx%ld: floating-point 4:2:2 %lld us, "
+		"4:2:2 %lld us (%.1fx), 4:2:0 %lld us (%.1fx)\n",
+		(long)w, (long)h, (long long)ref_time,
+		(long long)time422, (double)ref_time/(double)time422,
+		(long long)time420, (double)ref_time/(double)time420);
+}
+
+void BenchmarkVideoConversion(void)
+{
+	BenchmarkSize(640, 480);
+	BenchmarkSize(1280, 720);
+}
+
+#endif	// BENCHMARK_VIDEO
@@ -0,0 +1,26 @@
+/*
+	VideoConvert.h
+*/
+
+#ifndef _VIDEOCONVERT_H
+#define _VIDEOCONVERT_H
+
+#include <Bitmap.h>
+
+// Conversion of decoded YCbCr video to B_RGB32 (B, G, R, A in
+// memory), for playback without an overlay; <width> and <height> are
+// in pixels
+void ConvertYCbCr422(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 width, int32 height);
+void ConvertYCbCr420(const uint8 *src, int32 src_bpr,
+	uint8 *dest, int32 dest_bpr, int32 width, int32 height);
+
+// Converts <src> (B_YCbCr422 or B_YCbCr420) to <dest> (B_RGB32, the
+// same size); returns false if it can't
+bool ConvertVideoBitmap(BBitmap *dest, const BBitmap *src);
+
+#ifdef BENCHMARK_VIDEO
+void BenchmarkVideoConversion(void);
+#endif
+
+#endif	// ifndef _VIDEOCONVERT_H
@@ -23,10 +23,14 @@
 	HugoView view - off-screen view for drawing bitmap
 */
 
+#include <math.h>
+#include <stdlib.h>
+#include <Clipboard.h>
 #include <Directory.h>
 #include <FindDirectory.h>
 #include <MenuBar.h>
 #include <MenuItem.h>
+#include <MessageQueue.h>
 #include <Mime.h>
 #include <Path.h>
 #include <Roster.h>
@@ -46,8 +50,14 @@
 #include "behugo.h"
 #include "icons.h"
 #include "AboutBox.h"
+#include "BitmapScale.h"
 #include "ColorSelector.h"
 #include "CompassRose.h"
+#include "DisplayList.h"
+#include "MediaControl.h"
+#include "PictureCache.h"
+#include "ResourcePrefetch.h"
+#include "VideoConvert.h"
 
 extern "C"
 {
@@ -72,12 +82,10 @@ bool fast_scrolling = true, full_screen = true,
 	display_graphics = true, show_compass = false;
 bool graphics_smoothing = false;
 bool enable_audio = true, audio_grayed_out = false;
+bool text_selection = true;
 BMenuItem *smartformatting_menu, *fast_scrolling_menu, *full_screen_menu,
 	*display_graphics_menu, *graphics_smoothing_menu,
-	*enable_audio_menu, *show_compass_menu;
-#ifdef USE_TEXTBUFFER
-BMenuItem *text_select_menu;
-#endif
+	*enable_audio_menu, *show_compass_menu, *text_select_menu;
 BFilePanel *file_panel;
 char file_selected[MAXPATH];
 
@@ -213,13 +221,24 @@ void LoadSettings()
 	// Other settings
 	msg.FindBool("full_screen", &full_screen);
 	msg.FindBool("fast_scrolling", &fast_scrolling);
-#ifdef USE_TEXTBUFFER
-	bool b;
-	msg.FindBool("allow_text_selection", &b);
-	allow_text_selection = b;
-#endif
+	msg.FindBool("allow_text_selection", &text_selection);
 	msg.FindBool("display_graphics", &display_graphics);
 	msg.FindBool("graphics_smoothing", &graphics_smoothing);
+	if (msg.FindInt32("picture_cache_size", &fdata)==B_OK)	// in KB
+		picture_cache.SetBudget((size_t)fdata*1024);
+	if (msg.FindInt32("prefetch_size", &fdata)==B_OK)	// in KB
+		prefetch_budget = (size_t)fdata*1024;
+	msg.FindInt32("prefetch_pictures", &prefetch_pictures);
+#ifndef NO_SOUND
+	if (msg.FindInt32("module_cache_size", &fdata)==B_OK)	// in KB
+		module_cache_budget = (size_t)fdata*1024;
+	msg.FindInt32("music_crossfade", &music_crossfade);	// in ms
+	if (msg.FindInt32("sample_cache_size", &fdata)==B_OK)	// in KB
+		sample_cache_budget = (size_t)fdata*1024;
+	if (msg.FindInt32("max_cached_sample", &fdata)==B_OK)	// in KB
+		max_cached_sample = (size_t)fdata*1024;
+	msg.FindInt32("sample_polyphony", &sample_polyphony);
+#endif
 	msg.FindBool("enable_audio", &enable_audio);
 	msg.FindBool("show_compass", &show_compass);
 	if (msg.FindPoint("compass_point", &compass_point)!=B_OK) compass_point = BPoint(0, 0);
@@ -271,11 +290,19 @@ void SaveSettings()
 	// Other settings
 	msg.AddBool("full_screen", full_screen);
 	msg.AddBool("fast_scrolling", fast_scrolling);
-#ifdef USE_TEXTBUFFER
-	msg.AddBool("allow_text_selection", allow_text_selection);
-#endif
+	msg.AddBool("allow_text_selection", text_selection);
 	msg.AddBool("display_graphics", display_graphics);
 	msg.AddBool("graphics_smoothing", graphics_smoothing);
+	msg.AddInt32("picture_cache_size", picture_cache.Budget()/1024);
+	msg.AddInt32("prefetch_size", prefetch_budget/1024);
+	msg.AddInt32("prefetch_pictures", prefetch_pictures);
+#ifndef NO_SOUND
+	msg.AddInt32("module_cache_size", module_cache_budget/1024);
+	msg.AddInt32("music_crossfade", music_crossfade);
+	msg.AddInt32("sample_cache_size", sample_cache_budget/1024);
+	msg.AddInt32("max_cached_sample", max_cached_sample/1024);
+	msg.AddInt32("sample_polyphony", sample_polyphony);
+#endif
 	msg.AddBool("enable_audio", enable_audio);
 	msg.AddBool("show_compass", show_compass);
 	msg.AddPoint("compass_point", compass_point);
@@ -407,6 +434,14 @@ HugoApplication::HugoApplication()
 	
 	// After defaults are initialized, we can try to read saved settings
 	LoadSettings();
+	media_control.SetAudioSuspended(!enable_audio);
+
+#ifdef BENCHMARK_PICTURE
+	BenchmarkScaling();
+#endif
+#ifdef BENCHMARK_VIDEO
+	BenchmarkVideoConversion();
+#endif
 	
 	// Set up a rectangle and instantiate the main window
 	window = new HugoWindow(default_rect);
@@ -525,6 +560,7 @@ bool HugoApplication::QuitRequested()
 	hugo_stopmusic();
 	hugo_stopsample();
 	hugo_stopvideo();
+	media_control.Quit();
 	
 	// Kill the engine thread if it's still running
 	while (he_thread_running)
@@ -532,6 +568,12 @@ bool HugoApplication::QuitRequested()
 		quit_he_thread = true;
 		snooze(5000);
 	}
+	ExitPictures();
+	ExitPrefetch();
+	StopScaleThreads();
+#ifndef NO_SOUND
+	ExitPlayer();
+#endif
 	
 	return BApplication::QuitRequested();
 }
@@ -562,6 +604,7 @@ HugoWindow::HugoWindow(BRect frame)
 {
 	isactive = false;
 	resizing = 0;
+	resize_sem = create_sem(1, "resize");
 
 	// Start with the menu
 	menubar = new BMenuBar(Bounds(), "Hugo menubar");
@@ -699,11 +742,9 @@ HugoWindow::HugoWindow(BRect frame)
 	fast_scrolling_menu = new BMenuItem("Fast Scrolling", new BMessage(MSG_FAST_SCROLLING));
 	fast_scrolling_menu->SetMarked(fast_scrolling!=0);
 	options_menu->AddItem(fast_scrolling_menu);
-#ifdef USE_TEXTBUFFER
 	text_select_menu = new BMenuItem("Allow Text Selection", new BMessage(MSG_TEXT_SELECT));
-	text_select_menu->SetMarked(allow_text_selection!=0);
+	text_select_menu->SetMarked(text_selection!=0);
 	options_menu->AddItem(text_select_menu);
-#endif
 	display_graphics_menu = new BMenuItem("Display Graphics", new BMessage(MSG_DISPLAY_GRAPHICS));
 	display_graphics_menu->SetMarked(display_graphics!=0);
 	graphics_smoothing_menu = new BMenuItem("Graphics Smoothing", new BMessage(MSG_GRAPHICS_SMOOTHING));
@@ -750,6 +791,7 @@ HugoWindow::HugoWindow(BRect frame)
 	view = new HugoView(rect, "Hugo view");
 	bitmap = new HugoBitmap(rect, B_RGB32, true);
 	bitmap->AddChild(view);
+	bitmap_rect = rect;
 	
 	// Create the scrollback window
 	rect = Bounds();
@@ -942,9 +984,9 @@ void HugoWindow::MessageReceived(BMessage *msg)
 				if (visible_view->caret_drawn) visible_view->DrawCaret();
 				prop_font.SetFamilyAndStyle(family, NULL);
 				prop_font_precalc_done = false;
-				if (currentfont & PROP_FONT) hugo_font(currentfont);
 				SaveSettings();
 				display_needs_repaint = true;
+				ChangeDisplay(DISPLAY_FONTS);
 			}
 			break;
 		}
@@ -957,9 +999,9 @@ void HugoWindow::MessageReceived(BMessage *msg)
 				if (visible_view->caret_drawn) visible_view->DrawCaret();
 				prop_font.SetSize((float)size);
 				prop_font_precalc_done = false;
-				if (currentfont & PROP_FONT) hugo_font(currentfont);
 				SaveSettings();
 				display_needs_repaint = true;
+				ChangeDisplay(DISPLAY_FONTS);
 			}
 			break;
 		}
@@ -972,9 +1014,9 @@ void HugoWindow::MessageReceived(BMessage *msg)
 				strcpy(family, name);
 				if (visible_view->caret_drawn) visible_view->DrawCaret();
 				fixed_font.SetFamilyAndStyle(family, NULL);
-				if (!(currentfont & PROP_FONT)) hugo_font(currentfont);
 				SaveSettings();
 				display_needs_repaint = true;
+				ChangeDisplay(DISPLAY_FONTS);
 			}
 			break;
 		}
@@ -985,9 +1027,9 @@ void HugoWindow::MessageReceived(BMessage *msg)
 			{
 				if (visible_view->caret_drawn) visible_view->DrawCaret();
 				fixed_font.SetSize((float)size);
-				if (!(currentfont & PROP_FONT))	hugo_font(currentfont);
 				SaveSettings();
 				display_needs_repaint = true;
+				ChangeDisplay(DISPLAY_FONTS);
 			}
 			break;
 		}
@@ -1087,6 +1129,7 @@ void HugoWindow::MessageReceived(BMessage *msg)
 				memcpy(color, data, size);
 				SaveSettings();
 				display_needs_repaint = true;
+				ChangeDisplay(DISPLAY_REDRAW);
 			}	
 			delete color_msg;
 			break;
@@ -1099,6 +1142,7 @@ void HugoWindow::MessageReceived(BMessage *msg)
 			def_slbgcolor = hugo_color(DEF_SLBGCOLOR);
 			update_bgcolor = def_bgcolor;
 			display_needs_repaint = true;
+			ChangeDisplay(DISPLAY_REDRAW);
 			break;
 		}
 		
@@ -1138,6 +1182,7 @@ void HugoWindow::MessageReceived(BMessage *msg)
 			}
 			full_screen = !full_screen;
 			full_screen_menu->SetMarked(full_screen!=0);
+			// (The display is redrawn by FrameResized())
 			display_needs_repaint = true;
 			break;
 		}
@@ -1147,19 +1192,19 @@ void HugoWindow::MessageReceived(BMessage *msg)
 			fast_scrolling_menu->SetMarked(fast_scrolling!=0);
 			break;
 		}
-#ifdef USE_TEXTBUFFER
 		case MSG_TEXT_SELECT:
 		{
-			allow_text_selection = !allow_text_selection;
-			text_select_menu->SetMarked(allow_text_selection!=0);
+			text_selection = !text_selection;
+			text_select_menu->SetMarked(text_selection!=0);
 			break;
 		}
-#endif
 		case MSG_DISPLAY_GRAPHICS:
 		{
 			display_graphics = !display_graphics;
 			display_graphics_menu->SetMarked(display_graphics!=0);
+			if (!display_graphics) hugo_stopvideo();
 			display_needs_repaint = true;
+			ChangeDisplay(DISPLAY_REDRAW);
 			break;
 		}
 		case MSG_GRAPHICS_SMOOTHING:
@@ -1172,6 +1217,15 @@ void HugoWindow::MessageReceived(BMessage *msg)
 		{
 			enable_audio = !enable_audio;
 			enable_audio_menu->SetMarked(enable_audio!=0);
+#ifndef NO_SOUND
+			if (enable_audio)
+				ResumeAudio();
+			else
+				SuspendAudio();
+			media_control.SetAudioSuspended(!enable_audio || audio_factory_suspended);
+#else
+			media_control.SetAudioSuspended(!enable_audio);
+#endif
 			break;
 		}
 		case MSG_UNFREEZE_WINDOWS:
@@ -1198,6 +1252,11 @@ void HugoWindow::MessageReceived(BMessage *msg)
 			view->Update(true);
 			break;
 		}
+		case MSG_REDRAW_DISPLAY:	// sent by UpdateDisplay()
+		{
+			RedrawDisplay();
+			break;
+		}
 		case MSG_SHOW_COMPASS:
 		{
 			// In the scrollback window, use Alt+C to copy, not
@@ -1276,6 +1335,7 @@ bool HugoWindow::QuitRequested()
 		default_rect = Frame();		// save current window coords.
 //	RemoveChild(menubar);
 	quit_he_thread = true;
+	media_control.Quit();
 	be_app->PostMessage(B_QUIT_REQUESTED);
 	return true;
 }
@@ -1286,17 +1346,24 @@ void HugoWindow::WindowActivated(bool active)
 	if (!active)
 	{
 		audio_factory_suspended = true;
+		SuspendAudio();
 	}
 	else if (audio_factory_suspended)
 	{
 		audio_factory_suspended = false;
+		ResumeAudio();
 	}
+	media_control.SetAudioSuspended(!enable_audio || audio_factory_suspended);
 #endif
 	isactive = active;
 }
 
 void HugoWindow::FrameResized(float width, float height)
 {
+	// While the window is being dragged, there may be a run of these
+	// queued up; only the last one needs to do anything
+	if (MessageQueue()->FindMessage(B_WINDOW_RESIZED, 0)) return;
+
 	// Let's use the client width/height instead of the frame
 	width = Bounds().Width();
 	height = Bounds().Height()-(menubar->Bounds().Height());
@@ -1318,20 +1385,10 @@ void HugoWindow::FrameResized(float width, float height)
 		view->Update(true);
 	}
 	
+	// The engine thread sets itself up for the new size and, rather
+	// than waiting for the game to repaint, has what was there
+	// redrawn right away (see ResizeBitmap())
 	ResizeBitmap();
-	hugo_settextmode();
-
-	// Do engine-internal post-resize metric tweaking
-	if (!inwindow)
-	{
-		physical_windowright = (int)width;
-		physical_windowwidth = (int)width - physical_windowleft + 1;
-		physical_windowbottom = (int)height;
-		physical_windowheight = (int)height - physical_windowtop + 1;
-
-		if (currentline > physical_windowheight/lineheight)
-			currentline = physical_windowheight / lineheight;
-	}
 }
 
 void HugoWindow::Zoom(BPoint origin, float width, float height)
@@ -1340,62 +1397,96 @@ void HugoWindow::Zoom(BPoint origin, float width, float height)
 	ResizeBitmap();
 }
 
+// When the off-screen bitmap has to grow, it's made this much bigger
+// than it needs to be, so that most resizes (e.g., while the window
+// is being dragged larger) fit in the existing one
+#define BITMAP_SLACK 1.25
+
 void HugoWindow::ResizeBitmap()
 {
-	// Every time we resize the window, this gets called in order to copy the
-	// existing bitmap, destroy it, create a new resized bitmap, and copy
-	// the old contents back to it
-	
-	HugoBitmap *bitmapCopy = NULL;
+	// Every time we resize the window, this gets called to make sure
+	// the off-screen bitmap (twice the height of the window, for
+	// scrolling) can hold the new size.  Usually it already can, and
+	// only the newly exposed parts need to be cleared; otherwise a
+	// bigger one is created and the surviving rows are copied across.
 	
 	if (!bitmap) return;
+
+	BRect rect = window->Bounds();
+	rect.bottom*=2;
+	if (rect==bitmap_rect) return;
+
 	if (!bitmap->Lock()) return;
 	
+	acquire_sem(resize_sem);
 	resizing = true;
-	
-	// Copy the existing bitmap before we kill it
-	bitmapCopy = new HugoBitmap(bitmap->Bounds(), B_RGB32, true);
-	HugoView viewCopy(bitmap->Bounds(), "Hugo view copy");
-	if (bitmapCopy)
-	{
-		bitmapCopy->Lock();
-		bitmapCopy->AddChild(&viewCopy);
-		viewCopy.DrawBitmap(bitmap, BPoint(0, 0));
-		bitmapCopy->RemoveChild(&viewCopy);
-		bitmapCopy->Unlock();
-	}
 
-	// Get rid of the old bitmap and view and create new resized ones
-	bitmap->RemoveChild(view);
-	BRect rect = window->Bounds();
-	rect.bottom*=2;
-	delete bitmap;
-	delete view;
-	bitmap = new HugoBitmap(rect, B_RGB32, true);
-	bitmap->Lock();
-	view = new HugoView(rect, "Hugo view");
-	bitmap->AddChild(view);
+	// The part of the existing contents that survives (when
+	// shrinking, only the visible portion)
+	BRect keep(bitmap_rect);
+	if (keep.bottom > rect.bottom)
+		keep.bottom = rect.bottom/2;
+	if (keep.right > rect.right)
+		keep.right = rect.right;
 
-	// Clear the newly recreated view to the background color
-	view->SetLowColor(update_bgcolor);
-	view->FillRect(rect, B_SOLID_LOW);
+	BRect capacity(bitmap->Bounds());
+	bool shrink = ((rect.Width()+1)*(rect.Height()+1)*4 <
+		(capacity.Width()+1)*(capacity.Height()+1));
 
-	// Copy the contents of the old bitmap back to the (new) memory bitmap
-	if (bitmapCopy)
+	if (rect.right > capacity.right || rect.bottom > capacity.bottom || shrink)
 	{
-		BRect brect(bitmapCopy->Bounds());
-		if (brect.bottom > rect.bottom)
-			brect.bottom = rect.bottom/2;	// only copy the visible portion
-		view->DrawBitmap(bitmapCopy, brect, brect);
-		delete bitmapCopy;
+		BRect new_capacity(capacity);
+		if (rect.right > capacity.right)
+			new_capacity.right = floor((rect.right+1)*BITMAP_SLACK)-1;
+		else if (shrink)
+			new_capacity.right = rect.right;
+		if (rect.bottom > capacity.bottom)
+			new_capacity.bottom = floor((rect.bottom+1)*BITMAP_SLACK)-1;
+		else if (shrink)
+			new_capacity.bottom = rect.bottom;
+
+		HugoBitmap *new_bitmap = new HugoBitmap(new_capacity, B_RGB32, true);
+
+		// If there isn't memory for it, make do with the old one,
+		// drawing only as much as fits (the next resize tries again)
+		if (!new_bitmap->IsValid())
+		{
+			delete new_bitmap;
+			rect = rect & capacity;
+			if (keep.right > rect.right) keep.right = rect.right;
+			if (keep.bottom > rect.bottom) keep.bottom = rect.bottom;
+		}
+		else
+		{
+			// Copy the surviving rows straight across
+			view->Sync();
+			uint8 *src = (uint8 *)bitmap->Bits();
+			uint8 *dest = (uint8 *)new_bitmap->Bits();
+			int32 src_bpr = bitmap->BytesPerRow();
+			int32 dest_bpr = new_bitmap->BytesPerRow();
+			size_t row_bytes = ((int32)keep.right+1)*4;
+			for (int32 y=0; y<=(int32)keep.bottom; y++)
+				memcpy(dest + y*dest_bpr, src + y*src_bpr, row_bytes);
+
+			// Get rid of the old bitmap and view and switch to the new ones
+			bitmap->RemoveChild(view);
+			delete bitmap;
+			delete view;
+			bitmap = new_bitmap;
+			bitmap->Lock();
+			view = new HugoView(new_capacity, "Hugo view");
+			bitmap->AddChild(view);
+		}
 	}
 
-	// If the text display has already been initialized, then recalculate
-	// for the new canvas dimensions
-	if (FIXEDCHARWIDTH)
-	{
-		hugo_settextmode();
-	}
+	// Clear whatever is newly exposed to the background color
+	view->SetLowColor(update_bgcolor);
+	if (rect.right > keep.right)
+		view->FillRect(BRect(keep.right+1, 0, rect.right, rect.bottom), B_SOLID_LOW);
+	if (rect.bottom > keep.bottom)
+		view->FillRect(BRect(0, keep.bottom+1, keep.right, rect.bottom), B_SOLID_LOW);
+
+	bitmap_rect = rect;
 	display_needs_repaint = true;
 
 	view->SetHighColor(current_text_color);
@@ -1409,6 +1500,14 @@ void HugoWindow::ResizeBitmap()
 	current_rect.bottom-=menubar->Bounds().Height();
 
 	resizing = false;
+	release_sem(resize_sem);
+
+	// If the text display has already been initialized, then have the
+	// engine thread recalculate for the new canvas dimensions
+	if (FIXEDCHARWIDTH)
+	{
+		ChangeDisplay(DISPLAY_RESIZED);
+	}
 }
 
 void HugoWindow::StoryMenu(int32 what)
@@ -1458,9 +1557,10 @@ HugoBitmap::HugoBitmap(BRect bounds, color_space space, bool accepts_views)
 
 bool HugoBitmap::Lock()
 {
-	// The engine thread can't lock the bitmap when the main
-	// thread is resizing the window
-	if (find_thread(NULL)==he_thread)
+	// The engine and picture threads can't lock the bitmap when
+	// the main thread is resizing the window
+	thread_id thread = find_thread(NULL);
+	if (thread==he_thread || thread==picture_thread)
 	{
 		if (window->resizing) return false;
 	}
@@ -1651,19 +1751,18 @@ void HugoVisibleView::MouseDown(BPoint point)
 	if (buttons & B_PRIMARY_MOUSE_BUTTON && modifiers() & B_CONTROL_KEY)
 		buttons = B_SECONDARY_MOUSE_BUTTON;
 		
-#ifdef USE_TEXTBUFFER
 	if (getline_active)
 	{
-		if (allow_text_selection && buttons==B_PRIMARY_MOUSE_BUTTON)
+		if (text_selection && buttons==B_PRIMARY_MOUSE_BUTTON)
 		{
 			bigtime_t interval, time = real_time_clock_usecs();
 			get_click_speed(&interval);
 			
-			// Double-click
+			// Double-click types the word that was clicked on
 			if (time-last_mouse < interval)
 			{
-				char *w = TB_FindWord((int)point.x, (int)point.y);
-				if (w)
+				char w[MAXBUFFER];
+				if (GetDisplayWord(point, w, sizeof(w)))
 				{
 					if (current_text_x + hugo_textwidth(w) < physical_windowwidth)
 					{
@@ -1676,23 +1775,24 @@ void HugoVisibleView::MouseDown(BPoint point)
 			
 			last_mouse = time;
 			
+			// Dragging selects text; holding the button down
+			// without moving brings up the context menu
 			while (real_time_clock_usecs()-time < interval) 
 			{
 				GetMouse(&skip, &buttons);
 				if (buttons!=B_PRIMARY_MOUSE_BUTTON)
 					return;
+				if (fabs(skip.x-point.x) > 2 || fabs(skip.y-point.y) > 2)
+				{
+					SelectText(point);
+					return;
+				}
 				snooze(5000);
 			}
 		}
 				
 		buttons = B_SECONDARY_MOUSE_BUTTON;
 	}
-#else
-	if (getline_active)
-	{
-		buttons = B_SECONDARY_MOUSE_BUTTON;
-	}
-#endif
 
 	if (buttons & B_PRIMARY_MOUSE_BUTTON)
 	{
@@ -1744,6 +1844,79 @@ void HugoVisibleView::MouseDown(BPoint point)
 #endif
 }
 
+// The most text copied by selecting it
+#define MAX_SELECTION 32768
+
+// Inverts the text between <a> and <b>, to show or hide a selection
+static void InvertSelection(BView *v, const display_position *a,
+	const display_position *b)
+{
+	int32 line;
+
+	if (b->line < a->line || (b->line==a->line && b->x < a->x))
+	{
+		const display_position *p = a;
+		a = b;
+		b = p;
+	}
+
+	for (line=a->line; line<=b->line; line++)
+	{
+		BRect rect = GetDisplayLineRect(line);
+		if (line==a->line) rect.left = a->x;
+		if (line==b->line) rect.right = b->x-1;
+		if (rect.IsValid()) v->InvertRect(rect);
+	}
+}
+
+// Follows the mouse from <point> until the button is released,
+// highlighting the text along the way, and copies that text to the
+// clipboard
+void HugoVisibleView::SelectText(BPoint point)
+{
+	display_position start, end, pos;
+	BPoint where;
+	uint32 buttons;
+	bool shown = false;
+
+	if (!FindDisplayPosition(point, &start)) return;
+	end = start;
+
+	do
+	{
+		GetMouse(&where, &buttons);
+		if (FindDisplayPosition(where, &pos) &&
+			(pos.line!=end.line || pos.span!=end.span || pos.offset!=end.offset))
+		{
+			if (shown) InvertSelection(this, &start, &end);
+			end = pos;
+			InvertSelection(this, &start, &end);
+			Sync();
+			shown = true;
+		}
+		snooze(20000);
+	}
+	while (buttons & B_PRIMARY_MOUSE_BUTTON);
+
+	if (!shown) return;
+
+	// Restore the unhighlighted display from the bitmap
+	Draw(Bounds());
+
+	char *text = (char *)malloc(MAX_SELECTION);
+	if (!text) return;
+	int32 len = GetDisplayText(&start, &end, text, MAX_SELECTION);
+	if (len && be_clipboard->Lock())
+	{
+		be_clipboard->Clear();
+		BMessage *clip = be_clipboard->Data();
+		clip->AddData("text/plain", B_MIME_TYPE, text, len);
+		be_clipboard->Commit();
+		be_clipboard->Unlock();
+	}
+	free(text);
+}
+
 void HugoVisibleView::MouseMoved(BPoint point, uint32 transit, const BMessage *msg)
 {
 	// Whenever the mouse moves over the lower-right corner of the window,
@@ -38,11 +38,16 @@ class HugoWindow : public BWindow
 public:
 	bool isactive;
 	bool resizing;
+	sem_id resize_sem;	// held by ResizeBitmap() while <resizing>
 	
 	// current_rect is (0, 0) based, even though it physically appears
 	// below the menubar
 	BRect current_rect;
 
+	// The part of the off-screen bitmap in use, which may be smaller
+	// than the bitmap itself (see ResizeBitmap())
+	BRect bitmap_rect;
+
 	HugoWindow(BRect frame);
 	virtual void MessageReceived(BMessage *msg);
 	virtual	bool QuitRequested();
@@ -84,6 +89,7 @@ public:
 	virtual void KeyDown(const char *bytes, int32 numBytes);
 	virtual void MouseDown(BPoint point);
 	virtual void MouseMoved(BPoint point, uint32 transit, const BMessage *message);
+	void SelectText(BPoint point);
 	virtual void HandleContextMenu(BPoint point);
 };
 
@@ -131,7 +137,9 @@ enum
 	MSG_UNFREEZE_WINDOWS,
 	MSG_RESET_DISPLAY,
 	MSG_SHOW_COMPASS,
-	MSG_SHOW_SCROLLBACK
+	MSG_SHOW_SCROLLBACK,
+
+	MSG_REDRAW_DISPLAY	// sent by UpdateDisplay()
 };
 
 // Faux-keypress codes
@@ -141,7 +149,8 @@ enum
 	CTRL_RIGHT_KEY,
 	BACKSPACE_KEY,
 	OVERRIDE_UPDATING,
-	RESTORE_UPDATING
+	RESTORE_UPDATING,
+	REDRAW_INPUT_LINE
 };
 
 // rgb_color struct manipulation
@@ -159,6 +168,7 @@ extern "C" void process_he_thread_request(int32);
 { \
 	if (quit_he_thread) exit_thread(he_thread_running = 0); \
 	if (he_thread_request) process_he_thread_request(he_thread_request); \
+	if (display_changes) UpdateDisplay(); \
 	snooze(50000); \
 }
 
@@ -201,6 +211,8 @@ void PushKeypress(int k);
 int PullKeypress(void);
 void ConstrainCursor(void);
 void FlushBuffer(void);
+void ResetFontMetrics(void);
+void ScreenResized(void);
 rgb_color hugo_color(int c);
 
 extern bool override_client_updating;
@@ -213,9 +225,18 @@ extern char prop_font_precalc_done;
 
 // From picture.cpp:
 BFile *TrytoOpenBFile(char *name, char *where);
+bool TrytoFindFile(char *name, char *where, char *found);
+void WaitForPictures(BRect rect);
+void WaitForPictures(void);
+void ExitPictures(void);
+void RedisplayPicture(const char *source_key, char *filename, long pos,
+	long length, BRect window);
+
+extern thread_id picture_thread;
 
 // From sound.cpp:
 int InitPlayer(void);
+void ExitPlayer(void);
 void SuspendAudio(void);
 void ResumeAudio(void);
 extern "C"
@@ -225,6 +246,10 @@ void hugo_stopmusic(void);
 }
 
 extern bool audio_factory_suspended;
+extern size_t module_cache_budget;
+extern int32 music_crossfade;
+extern size_t sample_cache_budget, max_cached_sample;
+extern int32 sample_polyphony;
 
 // From video.cpp:
 extern "C"
@@ -11,7 +11,8 @@ Mikmod driver for BeOS R5
 
 */
 
-#include <SoundPlayer.h>
+#include "CPUFeatures.h"
+#include "Mixer.h"
 
 extern "C"
 {
@@ -24,50 +25,157 @@ sem_id _mm_mutex_lists;
 sem_id _mm_mutex_vars;
 }
 
-//int16 *tmp_buffer;		// for B_AUDIO_FLOAT format
+// MikMod's software mixer, as a voice of output_mixer.  It renders
+// 16-bit stereo; with a B_AUDIO_FLOAT format, that goes through a
+// scratch buffer (of the format's buffer_size in frames) and is
+// converted to floats, which the mixer can take as they are.
+class MikModVoice : public MixerVoice
+{
+public:
+	MikModVoice();
+	virtual ~MikModVoice();
+
+	bool SetOutput(uint32 sample_format);
+	virtual int32 Read(void *data, int32 frames);
+
+private:
+	int16 *scratch;
+	int32 scratch_frames;
+	bool ended;
+};
+
+void MikModEnded(void);		// in sound.cpp
 
+#if defined (HAVE_X86_SIMD)
 
-void Be_Mix( void *thecookie, void *buffer, size_t size,
-		const media_raw_audio_format &format )
+// These convert as many samples as they can for ShortToFloat(), 16 or
+// 8 at a time, and return how far they got; the SSE2 one starts at <i>
+TARGET_AVX2
+static int32 ShortToFloatAVX2(const int16 *src, float *dest, int32 count)
 {
-	if(!Player_Active()) Player_Stop();
- 	
-	switch( format.format )
+	__m256 s8 = _mm256_set1_ps(1.0/32768.0);
+	int32 i = 0;
+
+	for (; i+16 <= count; i += 16)
 	{
-		case media_raw_audio_format::B_AUDIO_SHORT:
-		{
-			uint16 *buf = (uint16 *)buffer;
-			VC_WriteBytes( (SBYTE *)buffer, size  );
-			for( size_t x = 0; x < size >> 1;x++)
-				buf[x]= (buf[x]);
-		}
-		break;
-/*
-		case media_raw_audio_format::B_AUDIO_FLOAT:
-		{
-			float *buf = (float *)buffer;
-			if( (size >> 1) < 32768)
-			{
-				VC_WriteBytes( (SBYTE *)tmp_buffer, size >> 1 );
-				float val =1.0/32800.0;
-				for( unsigned int x = 0; x < size >> 2; x ++ )
-				{
-					buf[x] = ((float)tmp_buffer[x]) * val;
-   				}
-			}
-			break;
-		}
-*/
-		default:
-			break;
-	}		
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src+i));
+		__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+		_mm256_storeu_ps(dest+i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), s8));
+		_mm256_storeu_ps(dest+i+8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), s8));
+	}
+	return i;
+}
+
+TARGET_SSE2
+static int32 ShortToFloatSSE2(const int16 *src, float *dest, int32 count,
+	int32 i)
+{
+	__m128 s4 = _mm_set1_ps(1.0/32768.0);
+
+	for (; i+8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src+i));
+		// (Sign-extended by putting each sample in the top half)
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dest+i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s4));
+		_mm_storeu_ps(dest+i+4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s4));
+	}
+	return i;
+}
+
+#endif	// HAVE_X86_SIMD
+
+// Converts <count> 16-bit samples to floats from -1 to 1
+static void ShortToFloat(const int16 *src, float *dest, int32 count)
+{
+	const float scale = 1.0/32768.0;
+	int32 i = 0;
+
+#if defined (HAVE_X86_SIMD)
+	if (CPUHasAVX2())
+		i = ShortToFloatAVX2(src, dest, count);
+	if (CPUHasSSE2())
+		i = ShortToFloatSSE2(src, dest, count, i);
+#endif
+	for (; i<count; i++)
+		dest[i] = (float)src[i]*scale;
+}
+
+MikModVoice::MikModVoice()
+{
+	scratch = NULL;
+	scratch_frames = 0;
+	ended = false;
+}
+
+MikModVoice::~MikModVoice()
+{
+	free( scratch );
+}
+
+bool MikModVoice::SetOutput(uint32 sample_format)
+{
+	media_raw_audio_format format;
+	uint32 sample_size = (sample_format==media_raw_audio_format::B_AUDIO_FLOAT) ?
+		sizeof(float) : sizeof(int16);
+
+	format.format 		= sample_format;
+	format.channel_count	= 2; 
+	format.frame_rate	= md_mixfreq;
+	format.byte_order	= B_MEDIA_HOST_ENDIAN;
+	format.buffer_size	= MIXER_BUFFER_FRAMES*2*sample_size;
+
+	if (!SetFormat( format )) return false;
+
+	free( scratch );
+	scratch = NULL;
+	if (sample_format==media_raw_audio_format::B_AUDIO_FLOAT)
+	{
+		scratch_frames = format.buffer_size/(2*sample_size);
+		scratch = (int16 *)malloc( scratch_frames*2*sizeof(int16) );
+		if (!scratch) return false;
+	}
+	return true;
+}
+
+int32 MikModVoice::Read(void *data, int32 frames)
+{
+	// A module that's come to its end is stopped by the music thread,
+	// not here:  Player_Stop() from the callback could take this voice
+	// out of the mixer while it's mixing
+	if (!Player_Active())
+	{
+		if (!ended) MikModEnded();
+		ended = true;
+		return 0;
+	}
+	ended = false;
+
+	if (!scratch)
+		return VC_WriteBytes( (SBYTE *)data, frames*4 ) / 4;
+
+	float *out = (float *)data;
+	int32 done = 0, count;
+
+	while (done < frames)
+	{
+		count = frames - done;
+		if (count > scratch_frames) count = scratch_frames;
+		count = VC_WriteBytes( (SBYTE *)scratch, count*4 ) / 4;
+		if (count <= 0) break;
+		ShortToFloat( scratch, out+done*2, count*2 );
+		done += count;
+	}
+	return done;
 }
 
 /****************************************************************************
 ** Actual Driver
 *****************************************************************************/
-BSoundPlayer			*soco_bsbp;
-media_raw_audio_format		soco_mf;
+MixerVoice			*mikmod_voice;
+static bool			mikmod_mixing = false;
 
 
 static BOOL Be_IsThere(void)
@@ -80,25 +188,31 @@ static void Be_Update(void)
 
 static BOOL Be_Init(void)
 {
-	if(VC_Init()) return 1;
+	MikModVoice *voice;
 
-	soco_mf.format 		= media_raw_audio_format::B_AUDIO_SHORT;
-	soco_mf.channel_count	= 2; 
-	soco_mf.frame_rate	= 44100;
-	soco_mf.byte_order	= B_MEDIA_LITTLE_ENDIAN;
-	soco_mf.buffer_size	= 8192; //4096;
+	if(VC_Init()) return 1;
 
-	soco_bsbp = new BSoundPlayer( &soco_mf, "MikMod", Be_Mix );
+	// Floats are what output_mixer mixes in
+	mikmod_voice = voice = new MikModVoice;
+	if (!voice->SetOutput( media_raw_audio_format::B_AUDIO_FLOAT ) &&
+		!voice->SetOutput( media_raw_audio_format::B_AUDIO_SHORT ))
+	{
+		delete mikmod_voice;
+		mikmod_voice = NULL;
+		VC_Exit();
+		return 1;
+	}
 
-//	tmp_buffer = (int16 *) malloc( 65536 );
-	
 	return 0;
 }
 
 static void Be_Exit( void )
 {
-	delete soco_bsbp;
-//	free( tmp_buffer );
+	if (mikmod_mixing) output_mixer.RemoveVoice( mikmod_voice );
+	mikmod_mixing = false;
+	delete mikmod_voice;
+	mikmod_voice = NULL;
+	VC_Exit();
 }
 
 
@@ -110,17 +224,20 @@ static BOOL Be_Reset(void)
 
 static BOOL Be_PlayStart(void)
 {
-	VC_PlayStart();
-	soco_bsbp->Start();
-	soco_bsbp->SetVolume( 1.0 ); 
-	soco_bsbp->SetHasData( true );
+	if (VC_PlayStart()) return 1;
+	if (!(mikmod_mixing = output_mixer.AddVoice( mikmod_voice )))
+	{
+		VC_PlayStop();
+		return 1;
+	}
 	
 	return 0;
 }
 
 static void Be_PlayStop(void)
 {
-	soco_bsbp->Stop();
+	if (mikmod_mixing) output_mixer.RemoveVoice( mikmod_voice );
+	mikmod_mixing = false;
 	VC_PlayStop();
 }
 
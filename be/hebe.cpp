@@ -11,6 +11,7 @@
 */	
 
 #include "behugo.h"
+#include "DisplayList.h"
 
 #include <Path.h>
 
@@ -46,6 +47,13 @@ int text_windowleft, text_windowtop, text_windowright, text_windowbottom,
 	text_windowwidth;
 bool override_client_updating = false;
 
+// The color indexes last set by hugo_settextcolor() and
+// hugo_setbackcolor(), kept for the display list
+static int last_text_color = -1, last_back_color = -1;
+
+// From herun.c:
+extern int physical_lowest_windowbottom;
+
 #if defined (DEBUGGER)
 void *AllocMemory(size_t size);
 #endif
@@ -428,6 +436,16 @@ GetKey:
 		case (OVERRIDE_UPDATING):
 			override_client_updating = true;
 			break;
+		case (REDRAW_INPUT_LINE):
+			/* The display has been redrawn (see UpdateDisplay()),
+			   and the text position moved to where the input now
+			   starts
+			*/
+			oldx = current_text_x;
+			oldy = current_text_y;
+			RedrawInputLine(0);
+			current_text_x = oldx + (int)current_font.StringWidth(buffer, c);
+			goto GetKey;
 		case (13):                      /* Enter */
 		{
 			full = 0;
@@ -633,6 +651,9 @@ RestoreCommand:
 
 void RedrawInputLine(int index)
 {
+	WaitForPictures(BRect(current_text_x, current_text_y-1,
+		physical_windowright, current_text_y+lineheight));
+
 	if (!bitmap->Lock()) return;
 	
 	// Erase the rectangle of the input line
@@ -669,6 +690,7 @@ void RedrawInputLine(int index)
 int hugo_iskeywaiting(void)
 {
 	FlushBuffer();
+	if (display_changes) UpdateDisplay();
 	return (keypress_count > 0)?1:0;
 }
 
@@ -711,6 +733,7 @@ int hugo_timewait(int n)
 	{
 		// Check for a quit request
 		if (quit_he_thread) exit_thread(he_thread_running = 0);
+		if (display_changes) UpdateDisplay();
 		
 		t2 = real_time_clock_usecs();
 		diff = (t2-t1)/1000;
@@ -830,6 +853,7 @@ void hugo_clearfullscreen(void)
    corner of the screen */
 
 	FlushBuffer();
+	WaitForPictures();
 
 	BRect rect(window->current_rect);
 	rect.bottom*=2;
@@ -842,10 +866,8 @@ void hugo_clearfullscreen(void)
 	}
 	
 	view->needs_updating = true;
+	RecordClear(rect, last_back_color);
 	
-#ifdef USE_TEXTBUFFER
-	TB_Clear(0, 0, (int)rect.Width(), (int)rect.Height());
-#endif
 	/* Must be set: */
 	currentpos = 0;
 	currentline = 1;
@@ -876,6 +898,10 @@ void hugo_clearwindow(void)
 		}
 	}
 
+	// Any picture still queued for this window would otherwise be
+	// drawn over the cleared area
+	WaitForPictures(rect);
+
 	if (bitmap->Lock())
 	{
 		view->SetLowColor(current_back_color);
@@ -888,6 +914,8 @@ void hugo_clearwindow(void)
 	*/
 	if (!inwindow) view->needs_updating = true;
 
+	RecordClear(rect, last_back_color);
+
 	/* Send a solid line to the scrollback buffer (unless the buffer is empty)... */
 	if (!inwindow && scrollback_pos!=0 &&
 		// ...preventing duplicate linebreaks
@@ -900,10 +928,6 @@ void hugo_clearwindow(void)
 		hugo_sendtoscrollback(line);
 	}
 	
-#ifdef USE_TEXTBUFFER
-	TB_Clear(physical_windowleft, physical_windowtop,
-		physical_windowright, physical_windowbottom);
-#endif
 	/* Must be set: */
 	currentpos = 0;
 	currentline = 1;
@@ -934,6 +958,27 @@ void hugo_settextmode(void)
 		SCREENWIDTH/FIXEDCHARWIDTH, SCREENHEIGHT/FIXEDLINEHEIGHT);
 }
 
+/* ScreenResized
+
+	Called on the engine thread after the window has been resized
+	(see UpdateDisplay()) to set the text display up for the new
+	size as hugo_settextmode() does (but without going back to the
+	default font), and do the engine-internal post-resize metric
+	tweaking.
+*/
+
+void ScreenResized(void)
+{
+	BRect rect(window->current_rect);
+	SCREENWIDTH = (int)rect.right;
+	SCREENHEIGHT = (int)rect.bottom;
+	hugo_settextwindow(1, 1,
+		SCREENWIDTH/FIXEDCHARWIDTH, SCREENHEIGHT/FIXEDLINEHEIGHT);
+
+	if (!inwindow && currentline > physical_windowheight/lineheight)
+		currentline = physical_windowheight/lineheight;
+}
+
 void hugo_settextwindow(int left, int top, int right, int bottom)
 {
 /* Again, coords. are passed as text coordinates with the top corner (1, 1) */
@@ -1017,6 +1062,7 @@ void ConstrainCursor(void)
 #define MAX_FLUSH_BUFFER 512
 static char flush_buffer[MAX_FLUSH_BUFFER] = "";
 static int flush_x, flush_y, flush_len;
+static int flush_screen_y;	// flush_y without any scroll_offset
 
 static char supposed_to_be_underlining = false;
 static char last_was_italic = false;
@@ -1030,14 +1076,22 @@ void FlushBuffer(void)
 	{
 		flush_buffer[flush_len] = '\0';
 
+		// With Be, we don't get an opaque background rectangle,
+		// so draw it (after any picture queued under it)
+		BRect rect(flush_x, flush_y,
+			flush_x+current_font.StringWidth(flush_buffer),
+			flush_y+lineheight-1);
+		WaitForPictures(rect);
+
+		RecordText(flush_buffer, BRect(rect.left, flush_screen_y,
+				rect.right, flush_screen_y+lineheight-1),
+			currentfont, current_font.Encoding(),
+			last_text_color, last_back_color,
+			supposed_to_be_underlining, last_was_italic);
+
 		if (bitmap->Lock())
 		{
-			// With Be, we don't get an opaque background rectangle,
-			// so draw it
 			view->SetLowColor(current_back_color);
-			BRect rect(flush_x, flush_y,
-				flush_x+current_font.StringWidth(flush_buffer),
-				flush_y+lineheight-1);
 				
 			// In theory, we'd like to make sure we don't clip any
 			// just-printed italic character, but it doesn't seem
@@ -1109,6 +1163,7 @@ void hugo_print(char *a)
 						flush_y = current_text_y;
 					else
 						flush_y = current_text_y+view->scroll_offset;
+					flush_screen_y = current_text_y;
 				}
 				
 				if ((smartformatting) &&
@@ -1218,10 +1273,21 @@ void hugo_scrollwindowup()	/* one "text" line */
 {
 	int source_x, source_y, dest_x, dest_y, width, height;
 
-#ifdef USE_TEXTBUFFER
-	if (lineheight >= ((currentfont&PROP_FONT)?prop_lineheight:FIXEDLINEHEIGHT)/2)
-		TB_Scroll();
-#endif
+	/* Scrolling moves what's already there, so queued pictures have
+	   to be drawn first; scrolling the full screen moves the whole
+	   "virtual window"
+	*/
+	if (inwindow)
+		WaitForPictures(BRect(physical_windowleft, physical_windowtop,
+			physical_windowright, physical_windowbottom));
+	else
+		WaitForPictures();
+
+	if (inwindow)
+		RecordScroll(BRect(physical_windowleft, physical_windowtop,
+			physical_windowright, physical_windowbottom), lineheight);
+	else
+		RecordScroll(BRect(0, physical_lowest_windowbottom, 1e6, 1e6), lineheight);
 
 	if (!bitmap->Lock()) return;
 	
@@ -1286,10 +1352,10 @@ long int precalc_charset_lengths[PRECALC_CHARS] = {
 };
 float precalc_charwidth[PRECALC_CHARS];
 char prop_font_precalc_done = false;
+static int last_font = -1;
 
 void hugo_font(int f)
 {
-	static int last_font = -1;
 	uint16 face = 0;
 	font_height h;
 	
@@ -1356,10 +1422,26 @@ void hugo_font(int f)
 	last_font = f;
 }
 
+/* ResetFontMetrics
+
+	Called when the user picks a different font or size, so that the
+	fixed and proportional metrics are recalculated and the current
+	font is set up again; otherwise hugo_font() would skip it as
+	unchanged.
+*/
+
+void ResetFontMetrics(void)
+{
+	int f = last_font;
+
+	last_font = -1;
+	hugo_font(0);
+	hugo_font(PROP_FONT);
+	if (f!=-1) hugo_font(f);
+}
+
 void hugo_settextcolor(int c)   /* foreground (print) color */
 {
-	static int last_text_color = -1;
-	
 	if (last_text_color==c) return;
 	
 	FlushBuffer();
@@ -1376,8 +1458,6 @@ void hugo_settextcolor(int c)   /* foreground (print) color */
 
 void hugo_setbackcolor(int c)   /* background color */
 {
-	static int last_back_color = -1;
-	
 	if (last_back_color==c) return;
 	
 	FlushBuffer();
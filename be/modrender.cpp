@@ -0,0 +1,252 @@
+/*
+	modrender.cpp
+
+	Renders MOD, S3M and XM music offline, as fast as it will go,
+	with MikMod set up just as InitPlayer() sets it up for BeHugo
+	(see MikModSetup.h).  It needs no sound device and nothing from
+	the Be API, so the music path can be benchmarked and checked for
+	regressions on a headless box; see the modrender target in the
+	Makefile.
+
+		modrender [-o out.wav] [-s seconds] file [resource]
+
+	<file> is either a module or a Hugo resource file with the
+	module <resource> in it.  The output is written to a WAV file
+	with -o, and otherwise thrown away.  Rendering stops at the end
+	of the module (which isn't looped), or after -s seconds of
+	output.
+
+	Reports how many frames were rendered per second, the longest
+	any one buffer took to render, and a checksum of the output to
+	compare between builds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mikmod.h>
+#include "MikModSetup.h"
+
+// Part of MikMod's interface for user-supplied drivers, which older
+// mikmod.h headers don't declare (drv_be.cpp gets it from
+// mikmod_internals.h)
+extern "C" ULONG VC_WriteBytes(SBYTE *buf, ULONG todo);
+
+// Frames rendered per call, as for the mixer's MIXER_BUFFER_FRAMES
+#define RENDER_BUFFER_FRAMES 1024
+
+// Longest the output can be, in seconds, without -s
+#define DEFAULT_SECONDS (30*60)
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static long ReadNumber(FILE *f, int bytes)
+{
+	long n = 0;
+
+	for (int i=0; i<bytes; i++)
+		n |= (long)(fgetc(f) & 0xff) << (i*8);
+	return n;
+}
+
+
+/* FindResourceData
+
+	Reads the index of the Hugo resource file <f> (the same way
+	ReadResourceIndex() in ResourcePrefetch.cpp does) and returns
+	where <name> starts in it, or -1 if it isn't there.
+*/
+
+static long FindResourceData(FILE *f, const char *name)
+{
+	char entry[256];
+	long start = -1, pos;
+	int bytes, count, n, c;
+
+	c = fgetc(f);
+	if (c=='R')
+		bytes = 3;
+	else if (c=='r')
+		bytes = 4;
+	else
+		return -1;
+
+	fgetc(f);			// version
+	count = (int)ReadNumber(f, 2);
+	ReadNumber(f, 2);		// index size
+
+	for (n=0; n<count; n++)
+	{
+		if ((c = fgetc(f))==EOF) return -1;
+		if (fread(entry, 1, c, f)!=(size_t)c) return -1;
+		entry[c] = '\0';
+		pos = ReadNumber(f, bytes);
+		ReadNumber(f, bytes);		// length
+		if (start < 0 && !strcmp(entry, name))
+			start = pos;
+	}
+
+	// Positions are relative to the end of the index
+	if (start >= 0) start += ftell(f);
+	return start;
+}
+
+static void WriteNumber(FILE *f, unsigned long n, int bytes)
+{
+	for (int i=0; i<bytes; i++)
+		fputc((n >> (i*8)) & 0xff, f);
+}
+
+// A RIFF WAVE header for <frames> of md_mixfreq 16-bit stereo
+static void WriteWAVHeader(FILE *f, unsigned long frames)
+{
+	unsigned long data_size = frames*4;
+
+	fwrite("RIFF", 1, 4, f);
+	WriteNumber(f, 36+data_size, 4);
+	fwrite("WAVEfmt ", 1, 8, f);
+	WriteNumber(f, 16, 4);
+	WriteNumber(f, 1, 2);			// PCM
+	WriteNumber(f, 2, 2);			// channels
+	WriteNumber(f, md_mixfreq, 4);
+	WriteNumber(f, md_mixfreq*4, 4);	// bytes per second
+	WriteNumber(f, 4, 2);			// bytes per frame
+	WriteNumber(f, 16, 2);
+	fwrite("data", 1, 4, f);
+	WriteNumber(f, data_size, 4);
+}
+
+static void Usage(void)
+{
+	fprintf(stderr, "usage: modrender [-o out.wav] [-s seconds] file [resource]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_name = NULL;
+	double seconds = DEFAULT_SECONDS, start, t, peak = 0.0;
+	unsigned long frames = 0, max_frames, checksum = 2166136261UL;
+	SWORD *buffer;
+	FILE *f, *out = NULL;
+	MODULE *module;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:s:"))!=-1)
+	{
+		switch (c)
+		{
+			case 'o':
+				out_name = optarg;
+				break;
+			case 's':
+				seconds = atof(optarg);
+				break;
+			default:
+				Usage();
+		}
+	}
+	if (optind!=argc-1 && optind!=argc-2) Usage();
+
+	// As InitPlayer(), but with the no-sound driver, since we're
+	// calling VC_WriteBytes() ourselves just as drv_be.cpp does
+	MikMod_RegisterDriver(&drv_nos);
+	SetupMikMod();
+	if (MikMod_Init(""))
+	{
+		fprintf(stderr, "modrender: %s\n", MikMod_strerror(MikMod_errno));
+		return 1;
+	}
+	MikMod_SetNumVoices(MAXCHANNELS, MAXCHANNELS);
+	MikMod_EnableOutput();
+
+	if (!(f = fopen(argv[optind], "rb")))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if (optind==argc-2)
+	{
+		long pos = FindResourceData(f, argv[optind+1]);
+		if (pos < 0)
+		{
+			fprintf(stderr, "modrender: no resource \"%s\" in %s\n",
+				argv[optind+1], argv[optind]);
+			return 1;
+		}
+		fseek(f, pos, SEEK_SET);
+	}
+	module = Player_LoadFP(f, MAXCHANNELS, 0);
+	fclose(f);
+	if (!module)
+	{
+		fprintf(stderr, "modrender: %s\n", MikMod_strerror(MikMod_errno));
+		return 1;
+	}
+	module->wrap = 0;
+	module->loop = 0;
+
+	if (out_name)
+	{
+		if (!(out = fopen(out_name, "wb")))
+		{
+			perror(out_name);
+			return 1;
+		}
+		WriteWAVHeader(out, 0);
+	}
+
+	buffer = (SWORD *)malloc(RENDER_BUFFER_FRAMES*4);
+	max_frames = (unsigned long)(seconds*md_mixfreq);
+
+	Player_Start(module);
+	start = Now();
+	while (Player_Active() && frames < max_frames)
+	{
+		unsigned long count = max_frames - frames, bytes;
+
+		if (count > RENDER_BUFFER_FRAMES) count = RENDER_BUFFER_FRAMES;
+
+		t = Now();
+		bytes = VC_WriteBytes((SBYTE *)buffer, count*4);
+		t = Now() - t;
+		if (t > peak) peak = t;
+		if (bytes==0) break;
+
+		// FNV-1a, over the samples as rendered
+		for (unsigned long i=0; i<bytes; i++)
+			checksum = ((checksum ^ ((UBYTE *)buffer)[i]) * 16777619UL) & 0xffffffffUL;
+
+		if (out) fwrite(buffer, 1, bytes, out);
+		frames += bytes/4;
+	}
+	t = Now() - start;
+	Player_Stop();
+
+	if (out)
+	{
+		fseek(out, 0, SEEK_SET);
+		WriteWAVHeader(out, frames);
+		fclose(out);
+	}
+
+	printf("%lu frames (%.1f s) in %.3f s:  %.0f frames/s, %.1fx realtime\n",
+		frames, (double)frames/md_mixfreq, t,
+		t > 0.0 ? frames/t : 0.0, t > 0.0 ? frames/(t*md_mixfreq) : 0.0);
+	printf("peak %.0f us per %d-frame buffer\n", peak*1e6, RENDER_BUFFER_FRAMES);
+	printf("checksum %08lx\n", checksum);
+
+	free(buffer);
+	Player_Free(module);
+	MikMod_Exit();
+	return 0;
+}
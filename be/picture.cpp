@@ -16,9 +16,16 @@
 #if !defined (NO_GRAPHICS)
 
 #include <DataIO.h>
+#include <Entry.h>
 #include <TranslationUtils.h>
 
 #include "behugo.h"
+#include "BitmapScale.h"
+#include "DisplayList.h"
+#include "PictureCache.h"
+#include "ResourceMap.h"
+#include "ResourcePrefetch.h"
+#include "SubsetIO.h"
 
 extern "C"
 {
@@ -28,12 +35,47 @@ int hugo_displaypicture(FILE *infile, long length);
 }
 
 BFile *TrytoOpenBFile(char *name, char *where);
-int DisplayBBitmap(BBitmap *img);
-int DisplayJPEG(BFile *file, long reslength);
+bool TrytoFindFile(char *name, char *where, char *found);
 
+#define PICTURE_KEY_LENGTH (MAXPATH*2+32)
+
+// A picture waiting to be (or being) decoded, scaled and drawn by
+// the picture thread
+struct picture_job
+{
+	subset_io_data *sid;
+	int type;
+	char key[PICTURE_KEY_LENGTH];
+	char source_key[PICTURE_KEY_LENGTH];
+	BRect window;		// the text window when it was queued
+	bool smoothing;
+	picture_job *next;
+};
+
+int DisplayBBitmap(BBitmap *img, picture_job *job);
+int DisplayJPEG(BPositionIO *io, picture_job *job);
+bool DisplayCachedPicture(picture_job *job);
 #ifdef USE_BILINEARSTRETCHBLT
-bool BilinearStretchBlt(BBitmap *dest_bmp, BBitmap *src_bmp);
+bool DisplayFromPyramid(picture_job *job);
 #endif
+void QueuePicture(picture_job *job);
+bool PicturePending(BRect rect);
+static picture_job *NewPictureJob(const char *source_key, BRect window);
+static int StartPictureJob(picture_job *job, char *filename, long pos, long length);
+
+// Levels of the downscale pyramid kept per picture, counting the
+// full-size original as level 0
+#define MAX_PYRAMID_LEVELS 8
+
+// How long the picture thread will wait for the window to show a
+// finished picture
+#define PICTURE_WINDOW_TIMEOUT 250000
+
+thread_id picture_thread = -1;
+static sem_id picture_job_sem, picture_done_sem;
+static BLocker picture_queue_lock("picture queue");
+static picture_job *picture_queue = NULL;	// oldest first
+static int32 pictures_pending = 0;
 
 
 int hugo_hasgraphics(void)
@@ -54,7 +96,23 @@ int hugo_hasgraphics(void)
 
 	Ultimately, graphic formats other than JPEG may be supported,
 	hence the identification of the type flag and the switch
-	at the end.
+	in RunPictureJob().
+
+	The decoding, scaling and drawing are done by the picture thread,
+	so this returns as soon as the picture is queued; the current
+	text window is reserved for it until it's drawn.  Anything that
+	draws over or reads back that part of the screen in the meantime
+	must call WaitForPictures() first.
+
+	Finished pictures are kept in picture_cache, keyed by resource
+	file, resource name, the size of the window they're fitted to,
+	and whether they were smoothed, so redrawing a picture that's
+	already been shown is just a blit, which is done right here
+	unless an earlier picture for the same part of the screen is
+	still queued.  Smoothed pictures that are much bigger than the
+	window also leave the levels of their downscale pyramid in the
+	cache, so that after the window is resized they can be rescaled
+	without decoding them again.
 
 	Returns false if it fails because of an ERROR.
 */
@@ -62,7 +120,8 @@ int hugo_hasgraphics(void)
 int hugo_displaypicture(FILE *infile, long reslength)
 {
 	long pos;
-	BFile *file;
+	picture_job *job;
+	char source_key[PICTURE_KEY_LENGTH];
 	
 	/* So that graphics can be dynamically enabled/disabled */
 	if (!hugo_hasgraphics())
@@ -71,71 +130,401 @@ int hugo_displaypicture(FILE *infile, long reslength)
 		return true;		/* not an error */
 	}
 	
-	// Reopen infile as a BFile at the same position
+	// Get infile's position so we can read the picture straight out
+	// of the (mapped) resource file
 	pos = ftell(infile);
 	fclose(infile);
+	if (pos==-1) return false;
+
+	if (resource_type!=JPEG_R)	/* unrecognized */
+	{
+#if defined (DEBUGGER)
+		SwitchtoDebugger();
+		DebugMessageBox("Picture Loading Error", "Unrecognized graphic format");
+		SwitchtoGame();
+#endif
+		return false;
+	}
+
+	// Uppercased, since that's how the prefetcher sees the names
+	sprintf(source_key, "%s|%s", loaded_filename, loaded_resname);
+	strupr(source_key);
+	job = NewPictureJob(source_key, BRect(physical_windowleft, physical_windowtop,
+		physical_windowright, physical_windowbottom));
+
 	// If the resource is not blank, we're using a resource file,
 	// so uppercase the name
 	if (strcpy(loaded_resname, "")) strupr(loaded_filename);
-	if (!(file = TrytoOpenBFile(loaded_filename, "games")))
-	{
-		if (!(file = TrytoOpenBFile(loaded_filename, "object")))
-		{
-			return false;
-		}
-	}
-	// Seek BFile to the same position infile was at
-	file->Seek((off_t)pos, SEEK_SET);	
 
 	/* Before doing any drawing, mainly because we need to make sure there
 	   is no scroll_offset, or anything like that:
 	*/
 	view->Update(false);
 
-	switch (resource_type)
+	RecordPicture(source_key, loaded_filename, pos, reslength);
+
+	return StartPictureJob(job, loaded_filename, pos, reslength);
+}
+
+
+/* RedisplayPicture
+
+	Called by RedrawDisplay() to display a picture again, fitted to
+	<window>, which is where the text window it was displayed in is
+	now.  As in hugo_displaypicture(), it's only drawn right away if
+	it's already in picture_cache at that size.
+*/
+
+void RedisplayPicture(const char *source_key, char *filename, long pos,
+	long length, BRect window)
+{
+	if (!hugo_hasgraphics()) return;
+
+	StartPictureJob(NewPictureJob(source_key, window), filename, pos, length);
+}
+
+
+/* NewPictureJob
+
+	Returns a job for the picture <source_key> (the file and resource
+	name, uppercased), to be fitted to <window>.
+*/
+
+static picture_job *NewPictureJob(const char *source_key, BRect window)
+{
+	picture_job *job = new picture_job;
+
+	job->sid = NULL;
+	job->type = JPEG_R;
+	job->window = window;
+	job->smoothing = graphics_smoothing;
+	job->next = NULL;
+
+	strcpy(job->source_key, source_key);
+	sprintf(job->key, "%s|%dx%d|%d", job->source_key,
+		window.IntegerWidth()+1, window.IntegerHeight()+1, graphics_smoothing);
+
+	return job;
+}
+
+
+/* StartPictureJob
+
+	Draws the picture right away if it's cached (and nothing queued
+	is still to be drawn under it); otherwise opens it at <pos> in
+	<filename> and queues it.
+*/
+
+static int StartPictureJob(picture_job *job, char *filename, long pos, long length)
+{
+	if (!PicturePending(job->window) && DisplayCachedPicture(job))
+	{
+		delete job;
+		return 1;
+	}
+
+	if (!(job->sid = OpenResourceSubset(filename, pos, length)))
+	{
+		delete job;
+		return false;
+	}
+
+	QueuePicture(job);
+
+	return 1;	// success
+}
+
+
+/* RunPictureJob
+
+	Called on the picture thread to decode, scale and draw a queued
+	picture, checking the cache and the pyramid first in case an
+	earlier job has left it there.
+*/
+
+static int RunPictureJob(picture_job *job)
+{
+	BPositionIO *io;
+	int result = 0;
+
+	if (DisplayCachedPicture(job)) return 1;
+#ifdef USE_BILINEARSTRETCHBLT
+	if (job->smoothing && DisplayFromPyramid(job)) return 1;
+#endif
+
+	// The prefetcher may have decoded it already
+	BBitmap *img = TakePrefetchedPicture(job->source_key);
+	if (img) return DisplayBBitmap(img, job);
+
+	io = job->sid->CreateIO();
+
+	switch (job->type)
 	{
 		case JPEG_R:
-			if (!DisplayJPEG(file, reslength)) goto Failed;
+			result = DisplayJPEG(io, job);
 			break;
+	}
 
-		default:        /* unrecognized */
-#if defined (DEBUGGER)
-			SwitchtoDebugger();
-			DebugMessageBox("Picture Loading Error", "Unrecognized graphic format");
-			SwitchtoGame();
+	delete io;
+	return result;
+}
+
+
+/* PictureThread
+
+	Runs queued pictures in order.  A job stays at the head of the
+	queue until it has been drawn, so that PicturePending() and
+	WaitForPictures() still see its window while it's in progress.
+*/
+
+static int32 PictureThread(void *data)
+{
+	picture_job *job;
+
+	while (acquire_sem(picture_job_sem)==B_OK)
+	{
+		picture_queue_lock.Lock();
+		job = picture_queue;
+		picture_queue_lock.Unlock();
+		if (!job) continue;
+
+		if (!RunPictureJob(job))
+		{
+#ifdef DEBUG_PICTURE
+fprintf(stderr, "PictureThread: couldn't display %s\n", job->key);
 #endif
-			goto Failed;
-	}
+		}
 
-	delete file;
-	return 1;	// success
+		picture_queue_lock.Lock();
+		picture_queue = job->next;
+		picture_queue_lock.Unlock();
+
+		delete job->sid;
+		delete job;
+		atomic_add(&pictures_pending, -1);
+		release_sem(picture_done_sem);
+	}
 
-Failed:
-	delete file;
 	return 0;
 }
 
 
+/* QueuePicture
+
+	Adds <job> to the end of the queue, starting the picture thread
+	the first time.  If the thread can't be started, the picture is
+	just displayed here.
+*/
+
+void QueuePicture(picture_job *job)
+{
+	if (picture_thread < B_OK)
+	{
+		picture_job_sem = create_sem(0, "picture jobs");
+		picture_done_sem = create_sem(0, "pictures done");
+		if (picture_job_sem >= B_OK && picture_done_sem >= B_OK)
+		{
+			picture_thread = spawn_thread(PictureThread, "Hugo picture thread",
+				B_NORMAL_PRIORITY, NULL);
+		}
+		if (picture_thread < B_OK || resume_thread(picture_thread)!=B_OK)
+		{
+			delete_sem(picture_job_sem);
+			delete_sem(picture_done_sem);
+			picture_thread = -1;
+
+			RunPictureJob(job);
+			delete job->sid;
+			delete job;
+			return;
+		}
+	}
+
+	picture_queue_lock.Lock();
+	picture_job **last = &picture_queue;
+	while (*last) last = &(*last)->next;
+	*last = job;
+	picture_queue_lock.Unlock();
+
+	atomic_add(&pictures_pending, 1);
+	release_sem(picture_job_sem);
+}
+
+
+/* ExitPictures
+
+	Called at quit, once the engine thread is done:  drops the
+	pictures still queued behind the one being drawn (if any), and
+	waits for the picture thread to finish that one and quit, so that
+	nothing is drawn while the window and bitmap are torn down.
+*/
+
+void ExitPictures(void)
+{
+	picture_job *job, *next;
+	status_t result;
+
+	if (picture_thread < B_OK) return;
+
+	picture_queue_lock.Lock();
+	next = picture_queue ? picture_queue->next : NULL;
+	if (picture_queue) picture_queue->next = NULL;
+	picture_queue_lock.Unlock();
+
+	while ((job = next))
+	{
+		next = job->next;
+		delete job->sid;
+		delete job;
+		atomic_add(&pictures_pending, -1);
+	}
+
+	// The thread quits once picture_job_sem is gone
+	delete_sem(picture_job_sem);
+	wait_for_thread(picture_thread, &result);
+	delete_sem(picture_done_sem);
+	picture_thread = -1;
+}
+
+
+/* PicturePending
+
+	Returns true if a queued picture (including one being drawn) is
+	reserved part of <rect>.
+*/
+
+bool PicturePending(BRect rect)
+{
+	bool pending = false;
+
+	if (pictures_pending==0) return false;
+
+	picture_queue_lock.Lock();
+	for (picture_job *job=picture_queue; job; job=job->next)
+	{
+		if (job->window.Intersects(rect))
+		{
+			pending = true;
+			break;
+		}
+	}
+	picture_queue_lock.Unlock();
+
+	return pending;
+}
+
+
+/* WaitForPictures
+
+	Blocks the engine thread until every queued picture that overlaps
+	<rect> (or, with no argument, every queued picture) is drawn.
+	Other threads--e.g., the main thread, which can get here from
+	HugoWindow::ResizeBitmap()--don't wait, since the picture thread
+	may itself be waiting for them.
+*/
+
+void WaitForPictures(BRect rect)
+{
+	if (find_thread(NULL)!=he_thread) return;
+
+	while (PicturePending(rect))
+	{
+		if (acquire_sem(picture_done_sem)!=B_OK) break;
+	}
+}
+
+void WaitForPictures(void)
+{
+	WaitForPictures(BRect(-1e6, -1e6, 1e6, 1e6));
+}
+
+
+/* LockPictureBitmap
+
+	Like the engine thread, the picture thread isn't allowed to lock
+	the bitmap while the window is being resized (see HugoBitmap::Lock()),
+	but rather than dropping the picture, it waits the resize out on
+	resize_sem, which ResizeBitmap() holds for as long as it takes.
+*/
+
+static bool LockPictureBitmap(void)
+{
+	while (!bitmap->Lock())
+	{
+		if (!window->resizing) return false;
+		if (acquire_sem(window->resize_sem)!=B_OK) return false;
+		release_sem(window->resize_sem);
+	}
+	return true;
+}
+
+
+/* ShowPicture
+
+	Brings <rect> of the bitmap to the visible view once the picture
+	thread has drawn a picture there, since the engine may already be
+	waiting for input and won't update the screen again until it
+	gets some.
+*/
+
+static void ShowPicture(BRect rect)
+{
+	view->needs_updating = true;
+
+	if (find_thread(NULL)==he_thread || override_client_updating)
+		return;
+
+	if (window->LockWithTimeout(PICTURE_WINDOW_TIMEOUT)==B_OK)
+	{
+		visible_view->Draw(rect);
+		window->Unlock();
+	}
+}
+
+
 /* TrytoOpenBFile
  * 
  *   is similar to hemisc.c's TrytoOpen, but returns a BFile.
  */
 
-extern char gamepath[];  // from hemisc.c
-
 BFile *TrytoOpenBFile(char *name, char *where)
 {
-	char drive[MAXDRIVE], dir[MAXDIR], fname[MAXFILENAME], ext[MAXEXT];
-	char envvar[32];
-	BFile *tempfile;
 	char temppath[MAXPATH];
+	BFile *tempfile;
 
-	/* Try to open the given, vanilla filename */
-	tempfile = new BFile(name, B_READ_ONLY);
+	if (!TrytoFindFile(name, where, temppath)) return NULL;
+
+	tempfile = new BFile(temppath, B_READ_ONLY);
 	if (tempfile->InitCheck()==B_OK)
 		return tempfile;
 	delete tempfile;
 
+	/* return NULL if not openable */
+	return NULL;
+}
+
+
+/* TrytoFindFile
+ * 
+ *   does the searching for TrytoOpenBFile (and ResourceMap::Map),
+ *   copying the path of the first existing file to <found>.
+ */
+
+extern char gamepath[];  // from hemisc.c
+
+bool TrytoFindFile(char *name, char *where, char *found)
+{
+	char drive[MAXDRIVE], dir[MAXDIR], fname[MAXFILENAME], ext[MAXEXT];
+	char envvar[32];
+	char temppath[MAXPATH];
+
+	/* Try the given, vanilla filename */
+	if (BEntry(name, true).IsFile())
+	{
+		strcpy(found, name);
+		return true;
+	}
+
 	hugo_splitpath(name, drive, dir, fname, ext);  /* file to open */
 
 	/* If the given filename doesn't already specify where to find it */
@@ -143,10 +532,11 @@ BFile *TrytoOpenBFile(char *name, char *where)
 	{
 		/* Check gamefile directory */
 		hugo_makepath(temppath, "", gamepath, fname, ext);
-		tempfile = new BFile(temppath, B_READ_ONLY);
-		if (tempfile->InitCheck()==B_OK)
-			return tempfile;
-		delete tempfile;
+		if (BEntry(temppath, true).IsFile())
+		{
+			strcpy(found, temppath);
+			return true;
+		}
 
 		/* Check environment variables */
 		strcpy(envvar, "hugo_");  /* make up the actual var. name */
@@ -155,33 +545,69 @@ BFile *TrytoOpenBFile(char *name, char *where)
 		if (getenv(strupr(envvar)))
 		{
 			hugo_makepath(temppath, "", getenv(strupr(envvar)), fname, ext);
+			if (BEntry(temppath, true).IsFile())
+			{
+				strcpy(found, temppath);
+				return true;
+			}
+		}
+	}
+
+	/* return false if not found */
+	return false;
+}
+
+
+/* DisplayCachedPicture
+ * 
+ *   draws the picture cached under the job's key, if there is one,
+ *   in the same place relative to its window; returns false if it
+ *   isn't cached.
+ */
 
-			tempfile = new BFile(temppath, B_READ_ONLY);
-			if (tempfile->InitCheck()==B_OK)
-				return tempfile;
-			delete tempfile;
+bool DisplayCachedPicture(picture_job *job)
+{
+	BBitmap *img = NULL;
+	BRect rect;
+
+	if (picture_cache.Lock())
+	{
+		img = picture_cache.Find(job->key, &rect);
+		rect.OffsetBy(job->window.left, job->window.top);
+		if (img && LockPictureBitmap())
+		{
+			view->DrawBitmap(img, rect);
+			bitmap->Unlock();
 		}
+#ifdef DEBUG_PICTURE
+fprintf(stderr, "DisplayCachedPicture: %s %s (%ld hits, %ld misses, %lu/%lu bytes)\n",
+	job->key, img?"hit":"miss", picture_cache.Hits(), picture_cache.Misses(),
+	picture_cache.Used(), picture_cache.Budget());
+#endif
+		picture_cache.Unlock();
 	}
 
-	/* return NULL if not openable */
-	return NULL;
+	if (img) ShowPicture(rect);
+
+	return (img!=NULL);
 }
 
 
-/* DisplayBBitmap
+/* FitPicture
  * 
- *   is called by the completed image-loading routine (such as
- *   DisplayJPEG) in order to copy the loaded BBitmap to visible_view.
+ *   returns where a picture with the given bounds goes in <window>:
+ *   centered, and shrunk to fit (keeping its aspect ratio) if it's
+ *   too big.
  */
 
-int DisplayBBitmap(BBitmap *img)
+static BRect FitPicture(BRect bounds, BRect window)
 {
 	float width, height, window_width, window_height, ratio;
-	window_width = physical_windowwidth-1.0;
-	window_height = physical_windowheight-1.0;
+	window_width = window.Width();
+	window_height = window.Height();
 	
-	width = img->Bounds().Width();
-	height = img->Bounds().Height();
+	width = bounds.Width();
+	height = bounds.Height();
 	
 	ratio = width/height;
 	if (width > window_width)
@@ -196,151 +622,197 @@ int DisplayBBitmap(BBitmap *img)
 	}
 
 	// floor() everything to match video bounds calculation
-	float x = floor(physical_windowleft + window_width/2.0 - width/2.0);
-	float y = floor(physical_windowtop + window_height/2.0 - height/2.0);
+	float x = floor(window.left + window_width/2.0 - width/2.0);
+	float y = floor(window.top + window_height/2.0 - height/2.0);
 	width = floor(width);
 	height = floor(height);
 
-	BRect rect(x, y, x+width, y+height);
+	return BRect(x, y, x+width, y+height);
+}
+
+
+/* DrawPicture
+ * 
+ *   draws the finished <img> at <rect> and hands it to picture_cache
+ *   under the job's key, or deletes it if it won't fit there.
+ */
 
-	if (bitmap->Lock())
+static int DrawPicture(BBitmap *img, BRect rect, picture_job *job)
+{
+	if (LockPictureBitmap())
 	{
-#ifdef USE_BILINEARSTRETCHBLT
-		if (!graphics_smoothing ||
-			((int)img->Bounds().Width()<=physical_windowwidth &&
-			(int)img->Bounds().Height()<=physical_windowheight))
-		{
-			view->DrawBitmap(img, rect);
-		}
-		else
-		{
-			BBitmap scaled_image(rect, B_RGB32);
-			BilinearStretchBlt(&scaled_image, img);
-			view->DrawBitmap(&scaled_image, rect);
-		}
-#else
 		view->DrawBitmap(img, rect);
-#endif
 		bitmap->Unlock();
 	}
+	ShowPicture(rect);
+
+	// Cache the finished picture relative to the window
+	rect.OffsetBy(-job->window.left, -job->window.top);
+	bool cached = false;
+	if (picture_cache.Lock())
+	{
+		cached = picture_cache.Add(job->key, img, rect);
+		picture_cache.Unlock();
+	}
+	if (!cached) delete img;
 		
 	return true;
 }
 
 
-/* DisplayJPEG */
+#ifdef USE_BILINEARSTRETCHBLT
+
+/* ScaleFromPyramid
+ * 
+ *   scales <level>, which is level <n> of the pyramid for a picture
+ *   whose full-size bounds are <full>, to fill <rect>.  First it
+ *   keeps halving it (with a 2x2 box filter) for as long as that
+ *   leaves it at least as big as <rect>, so that the final bilinear
+ *   scale is never more than 2:1 and every source pixel counts.  The
+ *   new levels are added to picture_cache as "<source_key>#n", with
+ *   <full> as their rect.  Returns the scaled bitmap, or NULL.
+ *
+ *   picture_cache must be locked by the caller.
+ */
 
-int DisplayJPEG(BFile *file, long reslength)
+static BBitmap *ScaleFromPyramid(BBitmap *level, int n, BRect full, BRect rect,
+	const char *source_key)
 {
-	// Create a BMemoryIO object to hold the image data
-	char *buffer;
-	if (!(buffer = (char *)malloc(reslength*sizeof(char)))) return false;
-	BMemoryIO memio(buffer, reslength);
-	
-	// Read the JPEG data into the buffer
-	file->Read(buffer, reslength);
-	
-	// Call the translator to read the JPEG data into a BBitmap
-	BBitmap *img = BTranslationUtils::GetBitmap(&memio);
+	BBitmap *built[MAX_PYRAMID_LEVELS], *scaled;
+	char level_key[MAXPATH*2+40];
+	int i, count = 0;
 
-	int result = false;
-	if (img!=NULL)
+	while (n+1 < MAX_PYRAMID_LEVELS &&
+		floor((level->Bounds().Width()+1)/2)-1 >= rect.Width() &&
+		floor((level->Bounds().Height()+1)/2)-1 >= rect.Height())
 	{
-		result = DisplayBBitmap(img);
-		delete img;
+		BBitmap *half = HalveBitmap(level);
+		if (!half) break;
+		built[count++] = level = half;
+		n++;
 	}
-	free(buffer);
-	return result;
-}
 
-//---------------------------------------------------------------------------
-// BilinearStretchBlt
-//---------------------------------------------------------------------------
+	// Scaled in bands on all CPUs; this returns once it's ready
+	// to blit
+	scaled = new BBitmap(rect, B_RGB32);
+	if (!scaled->IsValid() || !BilinearStretchBlt(scaled, level))
+	{
+		delete scaled;
+		scaled = NULL;
+	}
 
-#ifdef USE_BILINEARSTRETCHBLT
+	// Only now, since adding them may evict the level they were
+	// built from
+	for (i=0; i<count; i++)
+	{
+		sprintf(level_key, "%s#%d", source_key, n-count+1+i);
+		if (!picture_cache.Add(level_key, built[i], full))
+			delete built[i];
+	}
 
-inline rgb_color BitmapPixelAt(unsigned char *src, int bpr, int x, int y)
-{
-	rgb_color c;
-	c.red   = *(src + y*bpr + x*4+2);
-	c.green = *(src + y*bpr + x*4+1);
-	c.blue  = *(src + y*bpr + x*4);
-	return c;
+	return scaled;
 }
 
-inline void SetBitmapPixelAt(unsigned char *dest, int bpr, int x, int y, rgb_color c)
+
+/* DisplayFromPyramid
+ * 
+ *   if the pyramid for the picture is cached from an earlier, larger
+ *   display of it, scales it from the smallest cached level that's
+ *   still at least as big as it's going to be drawn, then displays
+ *   it and caches it under the job's key.  Returns false if it has to be
+ *   decoded instead.
+ */
+
+bool DisplayFromPyramid(picture_job *job)
 {
-	*(dest + y*bpr + x*4+2) = c.red;
-	*(dest + y*bpr + x*4+1) = c.green;
-	*(dest + y*bpr + x*4)   = c.blue;
-}
+	BBitmap *level = NULL, *img;
+	BRect full, rect, r;
+	char level_key[MAXPATH*2+40];
+	int i, n = 0;
 
-bool BilinearStretchBlt(BBitmap *dest_bmp, BBitmap *src_bmp)
-{
-	unsigned char *dest, *src;
-	int dest_width, dest_height, src_width, src_height;
-	int dest_bpr, src_bpr;
-	double nXFactor, nYFactor;
-	double fraction_x, fraction_y, one_minus_x, one_minus_y;
-	int ceil_x, ceil_y, floor_x, floor_y;
-	rgb_color c, c1, c2, c3, c4;
-	unsigned char b1, b2;
-	int x, y;
-
-	dest = (unsigned char *)dest_bmp->Bits();
-	dest_width = (int)dest_bmp->Bounds().Width();
-	dest_height = (int)dest_bmp->Bounds().Height();
-	dest_bpr = dest_bmp->BytesPerRow();
-	src = (unsigned char *)src_bmp->Bits();
-	src_width = (int)src_bmp->Bounds().Width();
-	src_height = (int)src_bmp->Bounds().Height();
-	src_bpr = src_bmp->BytesPerRow();
-	
-	nXFactor = (double)src_width/(double)dest_width;
-	nYFactor = (double)src_height/(double)dest_height;
+	if (!picture_cache.Lock()) return false;
 
-	for (x=0; x<=dest_width; x++)
-	for (y=0; y<=dest_height; y++)
+	for (i=1; i<MAX_PYRAMID_LEVELS; i++)
 	{
-		floor_x = (int)floor(x * nXFactor);
-		floor_y = (int)floor(y * nYFactor);
-		ceil_x = floor_x + 1;
-		if (ceil_x >= src_width) ceil_x = floor_x;
-		ceil_y = floor_y + 1;
-		if (ceil_y >= src_height) ceil_y = floor_y;
-		fraction_x = x * nXFactor - floor_x;
-		fraction_y = y * nYFactor - floor_y;
-		one_minus_x = 1.0 - fraction_x;
-		one_minus_y = 1.0 - fraction_y;
-
-		c1 = BitmapPixelAt(src, src_bpr, floor_x, floor_y);
-		c2 = BitmapPixelAt(src, src_bpr, ceil_x,  floor_y);
-		c3 = BitmapPixelAt(src, src_bpr, floor_x, ceil_y);
-		c4 = BitmapPixelAt(src, src_bpr, ceil_x,  ceil_y);
-
-		// Blue
-		b1 = (unsigned char)(one_minus_x * c1.blue + fraction_x * c2.blue);
-		b2 = (unsigned char)(one_minus_x * c3.blue + fraction_x * c4.blue);
-		c.blue = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
-
-		// Green
-		b1 = (unsigned char)(one_minus_x * c1.green + fraction_x * c2.green);
-		b2 = (unsigned char)(one_minus_x * c3.green + fraction_x * c4.green);
-		c.green = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
-
-		// Red
-		b1 = (unsigned char)(one_minus_x * c1.red + fraction_x * c2.red);
-		b2 = (unsigned char)(one_minus_x * c3.red + fraction_x * c4.red);
-		c.red = (unsigned char)(one_minus_y * (double)(b1) + fraction_y * (double)(b2));
-
-		SetBitmapPixelAt(dest, dest_bpr, x, y, c);
+		sprintf(level_key, "%s#%d", job->source_key, i);
+		if (!(img = picture_cache.Find(level_key, &r))) break;
+		if (i==1)
+		{
+			full = r;
+			rect = FitPicture(full, job->window);
+		}
+		if (img->Bounds().Width() < rect.Width() ||
+			img->Bounds().Height() < rect.Height())
+		{
+			break;
+		}
+		level = img;
+		n = i;
 	}
 
-	return true;
+	img = NULL;
+	if (level) img = ScaleFromPyramid(level, n, full, rect, job->source_key);
+	picture_cache.Unlock();
+
+	if (img==NULL) return false;
+	return DrawPicture(img, rect, job);
 }
 
 #endif	// USE_BILINEARSTRETCHBLT
 
+
+/* DisplayBBitmap
+ * 
+ *   is called by the completed image-loading routine (such as
+ *   DisplayJPEG) in order to copy the loaded BBitmap to visible_view.
+ *   It takes ownership of <img>; the finished (possibly scaled)
+ *   bitmap goes into picture_cache under the job's key.
+ */
+
+int DisplayBBitmap(BBitmap *img, picture_job *job)
+{
+	BRect rect = FitPicture(img->Bounds(), job->window);
+
+#ifdef USE_BILINEARSTRETCHBLT
+	if (job->smoothing &&
+		((int)img->Bounds().Width()>job->window.IntegerWidth()+1 ||
+		(int)img->Bounds().Height()>job->window.IntegerHeight()+1))
+	{
+		// If it can't be scaled here, DrawBitmap() will do it
+		BBitmap *scaled_image = NULL;
+		if (picture_cache.Lock())
+		{
+			scaled_image = ScaleFromPyramid(img, 0, img->Bounds(), rect, job->source_key);
+			picture_cache.Unlock();
+		}
+		if (scaled_image)
+		{
+			delete img;
+			img = scaled_image;
+		}
+	}
+#endif
+
+	return DrawPicture(img, rect, job);
+}
+
+
+/* DisplayJPEG
+
+	Decodes straight from <io>, which is either a view of the mapped
+	resource file or a subset of a BFile positioned at the picture,
+	so there's no intermediate copy of the JPEG data.
+*/
+
+int DisplayJPEG(BPositionIO *io, picture_job *job)
+{
+	// Call the translator to read the JPEG data into a BBitmap
+	BBitmap *img = BTranslationUtils::GetBitmap(io);
+
+	if (img==NULL) return false;
+	return DisplayBBitmap(img, job);
+}
+
 #else	// NO_GRAPHICS
 
 extern "C"
@@ -361,4 +833,23 @@ int hugo_displaypicture(FILE *infile)
 
 }  // extern "C"
 
+thread_id picture_thread = -1;
+
+void ExitPictures(void)
+{
+}
+
+void WaitForPictures(BRect rect)
+{
+}
+
+void WaitForPictures(void)
+{
+}
+
+void RedisplayPicture(const char *source_key, char *filename, long pos,
+	long length, BRect window)
+{
+}
+
 #endif  // NO_GRAPHICS
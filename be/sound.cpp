@@ -18,7 +18,8 @@
 	It must be closed before returning.
 	
 	- A MediaView is used for playback of media-kit-supported formats
-	  like MP3 (AudioView) and WAV (SampleView).
+	  like MP3 (AudioView) and WAV (SampleView).  Short samples are
+	  decoded once and played from memory instead.
 	
 	- The MIDI Kit is used for playback of MIDI.
 
@@ -42,13 +43,19 @@ long FindResource(char *filename, char *resname);
 
 #if !defined (NO_SOUND)
 
+#include <MediaFile.h>
+#include <MediaTrack.h>
 #include <MidiSynthFile.h>
-#include <SoundPlayer.h>
 
 #include "behugo.h"
+#include "MediaControl.h"
 #include "MediaView.h"
+#include "Mixer.h"
 #define MIKMODAPI
 #include "mikmod.h"
+#include "MikModSetup.h"
+#include "ResourceMap.h"
+#include "ResourcePrefetch.h"
 #include "SubsetIO.h"
 
 #undef DEBUGGER
@@ -56,13 +63,6 @@ long FindResource(char *filename, char *resname);
 // From temp.cpp:
 int CreateResourceCache(char **tempfilename, FILE *file, long length);
 
-int hugo_playmusic_MediaView(FILE *infile, long reslength, char loop_flag);
-int hugo_playmusic_MIDI(FILE *infile, long reslength, char loop_flag);
-int hugo_playmusic_MikMod(FILE *infile, long reslength, char loop_flag);
-void hugo_stopmusic_MediaView(void);
-void hugo_stopmusic_MIDI(void);
-void hugo_stopmusic_MikMod(void);
-
 char audio_init_failed = true;
 MODULE *modfile;
 char music_is_playing = false;
@@ -70,12 +70,32 @@ int music_volume = 100;
 char sample_is_playing = false;
 int sample_volume = 100;
 bool audio_factory_suspended = false;
+int32 music_crossfade = 0;		// in ms
 
 #define MUSIC_MEDIAVIEW 1
 #define MUSIC_MIDI	2
 #define MUSIC_MIKMOD    3
 
-#define MAXCHANNELS 32			/* for MikMod */
+// A change of music for the music thread to make; it owns whatever
+// is in here once it's posted
+struct music_request
+{
+	char type;			// one of the above, or 0 to stop
+	char loop;
+	int volume;
+	char *key;			// MUSIC_MIKMOD:  see CacheModule()
+	FILE *stream;			//   the module to load
+	void *data;			//   what <stream> reads, if not mapped
+	subset_io_data *sid;		// MUSIC_MEDIAVIEW
+	char *tempfile;			// MUSIC_MIDI
+	BEntry *entry;
+};
+
+static char *ResourcePath(void);
+static bool OpenModule(music_request *r, FILE *f, long reslength);
+static bool OpenMIDI(music_request *r, FILE *f, long reslength);
+static void PostMusicRequest(music_request *r);
+static void ExitSamples(void);
 
 
 //--------------------------------------------------------------------
@@ -98,34 +118,72 @@ void PrintAudioError(void)
 }
 
 
-/* hugo_playmusic */
+/* hugo_playmusic
+
+	Only gets the music ready to be read (without decoding any of
+	it) and hands it to the music thread, which loads it and swaps
+	it for whatever's playing; see ChangeMusic().  If it fails, the
+	current music is stopped, as it would have been anyway.
+
+	Returns false if it fails because of an ERROR.
+*/
 
 int hugo_playmusic(FILE *infile, long reslength, char loop_flag)
 {
-	// It's important to call hugo_stopmusic() first, since this
-	// will take care of deleting any tempfiles
-	if (music_is_playing) hugo_stopmusic();
+	music_request *r;
+	long fpos;
 
 #ifdef DEBUG_SOUND
 fprintf(stderr, "hugo_playmusic(infile, %ld, %d)\n", reslength, loop_flag);
 fprintf(stderr, "[%s: %s]\n", loaded_filename, loaded_resname);
-#endif	
+#endif
+	r = new music_request;
+	memset(r, 0, sizeof(music_request));
+	r->loop = loop_flag;
+	r->volume = music_volume;
+
 	switch (resource_type)
 	{
 		case MOD_R:
 		case S3M_R:
 		case XM_R:
-			return hugo_playmusic_MikMod(infile, reslength, loop_flag);
+			if (audio_init_failed)
+			{
+				PrintAudioError();
+				fclose(infile);
+				delete r;
+				return true;	/* not an error */
+			}
+			if (!OpenModule(r, infile, reslength)) goto Error;
+			r->type = MUSIC_MIKMOD;
+			break;
 #if !defined (COMPILE_V25)
 		case MP3_R:
-			return hugo_playmusic_MediaView(infile, reslength, loop_flag);
+			// Get a view of the (mapped) resource file
+			fpos = ftell(infile);
+			fclose(infile);
+			if (fpos==-1) goto Error;
+			if (!(r->sid = OpenResourceSubset(ResourcePath(), fpos, reslength)))
+				goto Error;
+			r->type = MUSIC_MEDIAVIEW;
+			break;
 		case MIDI_R:
-			return hugo_playmusic_MIDI(infile, reslength, loop_flag);
+			if (!OpenMIDI(r, infile, reslength)) goto Error;
+			r->type = MUSIC_MIDI;
+			break;
 #endif
 		default:
 			fclose(infile);
-			return false;	// error
+			goto Error;
 	}
+
+	PostMusicRequest(r);
+	return true;
+
+Error:
+	r->type = 0;
+	PostMusicRequest(r);
+	return false;
 }
 
 
@@ -133,15 +191,14 @@ fprintf(stderr, "[%s: %s]\n", loaded_filename, loaded_resname);
 
 void hugo_stopmusic(void)
 {
+	music_request *r;
+
 #ifdef DEBUG_SOUND
 fprintf(stderr, "hugo_stopmusic()\n");
 #endif
-	if (music_is_playing==MUSIC_MEDIAVIEW)
-		hugo_stopmusic_MediaView();
-	else if (music_is_playing==MUSIC_MIDI)
-		hugo_stopmusic_MIDI();
-	else if (music_is_playing==MUSIC_MIKMOD)
-		hugo_stopmusic_MikMod();
+	r = new music_request;
+	memset(r, 0, sizeof(music_request));
+	PostMusicRequest(r);
 }
 
 
@@ -149,7 +206,25 @@ fprintf(stderr, "hugo_stopmusic()\n");
 
 void hugo_musicvolume(int vol)
 {
+	if (vol==music_volume) return;
 	music_volume = vol;
+
+	// The module playing, if any, and any MediaView music
+	if (!audio_init_failed)
+	{
+		output_mixer.Lock();
+		Player_SetVolume((vol*128)/100);
+		output_mixer.Unlock();
+	}
+	media_control.VolumeChanged();
+}
+
+static char *ResourcePath(void)
+{
+	if (!strcmp(loaded_filename, ""))
+		return loaded_resname;
+	else
+		return loaded_filename;
 }
 
 
@@ -157,122 +232,164 @@ void hugo_musicvolume(int vol)
 // MediaView playback:
 //--------------------------------------------------------------------
 
-static MediaView *audioview;
-static thread_id audio_thread;
-static bool audio_loop;
+// Music, or a sample too long to cache, played by a MediaView on its
+// own AudioThread
+struct media_stream
+{
+	subset_io_data *sid;
+	MediaView *view;
+	char loop;
+	float volume;
+	const int *setting;	// music_volume or sample_volume
+	char *playing;		// cleared if it finishes by itself
+	bool failed;
+	volatile bool stop;
+	bigtime_t fade;		// to fade in over, when it starts
+	sem_id ready;		// released once it's ready to play (or failed)
+	sem_id go;		// and then it waits on this to start playing
+	port_id port;		// its media_control channel
+	thread_id thread;
+};
 
 int32 AudioThread(void *data)
 {
-	bool is_suspended = false;
-	float suspended_vol = 1.0;
-		
-	subset_io_data *sid = (subset_io_data *)data;
-	
-	audioview = new MediaView(BRect(0, 0, 0, 0), "audioview", B_FOLLOW_NONE);
-	SubsetIO *sio = new SubsetIO(sid->file, sid->start, sid->start+sid->length);
-	if (audioview->SetMediaSource(sio)!=B_NO_ERROR) goto Exit;
+	media_stream *m = (media_stream *)data;
+	MediaView *audioview;
 
-	audioview->loop = audio_loop;
-	audioview->SetVolume((float)music_volume/100.0);
-#ifdef DEBUG_SOUND
-fprintf(stderr, "AudioThread: audioview->SetVolume(%f)\n", (float)music_volume/100.0);
-#endif
+	audioview = m->view = new MediaView(BRect(0, 0, 0, 0), "audioview", B_FOLLOW_NONE);
+	BPositionIO *sio = m->sid->CreateIO();
+	if (audioview->SetMediaSource(sio)!=B_NO_ERROR)
+	{
+		m->failed = true;
+		release_sem(m->ready);
+		goto Exit;
+	}
+
+	audioview->loop = m->loop;
+	audioview->SetNotifyPort(m->port);
+	release_sem(m->ready);
+	if (acquire_sem(m->go)!=B_OK || m->stop) goto Exit;
+
+	if (media_control.AudioSuspended())
+		audioview->SetVolume(0.0);
+	else if (m->fade)
+	{
+		audioview->SetVolume(0.0);
+		audioview->FadeVolume(m->volume, m->fade);
+	}
+	else
+		audioview->SetVolume(m->volume);
 	audioview->Control(MEDIA_PLAY);
-	music_is_playing = MUSIC_MEDIAVIEW;
-	
-	while (audioview->IsPlaying() && music_is_playing)
+
+	// MEDIA_CONTROL_FINISHED needs nothing done:  it's only to wake
+	// us up to find it's no longer playing
+	while (audioview->IsPlaying())
 	{
-		// Suspend
-		if ((!enable_audio || audio_factory_suspended) && !is_suspended)
+		switch (media_control.Wait(m->port))
 		{
-			suspended_vol = audioview->Volume();
+			case MEDIA_CONTROL_VOLUME:
+				// (Not if it's being faded out for other music)
+				if (m->stop) break;
+				m->volume = (float)*m->setting/100.0;
+				// fall through
+			case MEDIA_CONTROL_AUDIO:
+				audioview->SetVolume(media_control.AudioSuspended() ? 0.0 : m->volume);
 #ifdef DEBUG_SOUND
-fprintf(stderr, "AudioThread: suspended_vol = %f\n", suspended_vol);
+fprintf(stderr, "AudioThread: audioview->SetVolume(%f)\n", audioview->Volume());
 #endif
-			audioview->SetVolume(0.0);
-#ifdef DEBUG_SOUND
-fprintf(stderr, "AudioThread suspend: audioview->SetVolume(0.0)\n");
-#endif
-			is_suspended = true;
+				break;
+			case MEDIA_CONTROL_STOP:
+			case MEDIA_CONTROL_QUIT:
+				audioview->Control(MEDIA_STOP);
+				break;
 		}
-		// Resume
-		else if ((enable_audio && !audio_factory_suspended) && is_suspended)
-		{
-			audioview->SetVolume(suspended_vol);
-#ifdef DEBUG_SOUND
-fprintf(stderr, "AudioThread resume: audioview->SetVolume(%f)\n", suspended_vol);
-#endif
-			is_suspended = false;
-		}
-		
-		if (quit_he_thread)
-		{
-			audioview->Control(MEDIA_STOP);
-			break;
-		}
-		snooze(20000);
 	}
-	
-	// In case we got here by clearing music_is_playing in hugo_stopmusic()
-	if (audioview->IsPlaying()) audioview->Control(MEDIA_STOP);
 
 Exit:
-	music_is_playing = false;
+	// Unless it was stopped in favour of other music, it's over
+	if (!m->stop) *m->playing = false;
 	delete audioview;
-	delete sid;
+	m->view = NULL;
+	delete m->sid;
+	m->sid = NULL;
 	delete sio;
 	return 0;
 }
 
 
-/* hugo_playmusic_MediaView
+/* LoadMediaStream
 
-	Returns false if it fails because of an ERROR.
+	Starts an AudioThread on <sid> (which it takes over) and waits
+	for it to be ready to play.  Returns NULL if it fails.
 */
 
-int hugo_playmusic_MediaView(FILE *infile, long reslength, char loop_flag)
+static media_stream *LoadMediaStream(subset_io_data *sid, char loop, int volume,
+	const int *setting, char *playing)
 {
-	long fpos = ftell(infile);
-	fclose(infile);
-	if (fpos==-1) return false;
-	
-	char *path;
-	if (!strcmp(loaded_filename, ""))
-		path = loaded_resname;
+	media_stream *m = new media_stream;
+	status_t result;
+
+	m->sid = sid;
+	m->view = NULL;
+	m->loop = loop;
+	m->volume = (float)volume/100.0;
+	m->setting = setting;
+	m->playing = playing;
+	m->failed = false;
+	m->stop = false;
+	m->fade = 0;
+	m->ready = create_sem(0, "media stream ready");
+	m->go = create_sem(0, "media stream go");
+	m->port = media_control.Open("media stream");
+
+	if (m->port < B_OK)
+		m->thread = B_ERROR;
 	else
-		path = loaded_filename;
-
-	// Create a BFile from the path and position it; AudioThread
-	// will delete it
-	BFile *file;
-	if (!(file = TrytoOpenBFile(path, "games")))
+		m->thread = spawn_thread(AudioThread, "MediaView audio thread", B_NORMAL_PRIORITY, m);
+	if (m->thread < B_OK)
 	{
-		if (!(file = TrytoOpenBFile(path, "object")))
-		{
-			return false;
-		}
+		delete m->sid;
+		m->failed = true;
 	}
-	if (file->InitCheck()!=B_OK)
+	else
 	{
-		delete file;
-		return false;
+		resume_thread(m->thread);
+		acquire_sem(m->ready);
 	}
 
-	subset_io_data *sid = new subset_io_data(file, fpos, reslength);
-
-	audio_loop = loop_flag;
-		
-	// Launch the AudioThread
-	audio_thread = spawn_thread(AudioThread, "MediaView audio thread", B_NORMAL_PRIORITY, sid);
-	resume_thread(audio_thread);
-	
-	return true;
+	if (m->failed)
+	{
+		if (m->thread >= B_OK) wait_for_thread(m->thread, &result);
+		if (m->port >= B_OK) media_control.Close(m->port);
+		delete_sem(m->ready);
+		delete_sem(m->go);
+		delete m;
+		return NULL;
+	}
+	return m;
 }
 
+static void StartMediaStream(media_stream *m, bigtime_t fade)
+{
+#ifdef DEBUG_SOUND
+fprintf(stderr, "StartMediaStream: volume %f, fade %Ld\n", m->volume, fade);
+#endif
+	m->fade = fade;
+	release_sem(m->go);
+}
 
-void hugo_stopmusic_MediaView(void)
+static void StopMediaStream(media_stream *m)
 {
-	music_is_playing = false;
+	status_t result;
+
+	m->stop = true;
+	media_control.Post(m->port, MEDIA_CONTROL_STOP);
+	release_sem(m->go);
+	wait_for_thread(m->thread, &result);
+	media_control.Close(m->port);
+	delete_sem(m->ready);
+	delete_sem(m->go);
+	delete m;
 }
 
 
@@ -281,31 +398,53 @@ void hugo_stopmusic_MediaView(void)
 //--------------------------------------------------------------------
 
 static char *midi_tempfile = NULL;
-static thread_id midi_thread;
+static thread_id midi_thread = -1;
+static bool midi_loop;
+static port_id midi_port = -1;
+
+// Deletes the tempfile a MIDI resource was copied to
+static void RemoveTempfile(char *tempfile)
+{
+	entry_ref ref;
+
+	if (get_ref_for_path(tempfile, &ref)==B_OK)
+	{
+		BEntry del(&ref, false);
+		del.Remove();
+	}
+	free(tempfile);
+}
+
+// The synth's hook for when the file's done
+static void MIDIFinished(int32 port)
+{
+	media_control.Post(port, MEDIA_CONTROL_FINISHED);
+}
 
 int32 MIDIThread(void *data)
 {
-	bool is_suspended = false;
-		
+	bool is_suspended = false, stop = false;
+
 	BEntry *entry = (BEntry *)data;
 	entry_ref ref;
 	entry->GetRef(&ref);
-	
+
 	BMidiSynthFile file;
 	file.LoadFile(&ref);
-	file.EnableLooping(audio_loop);
+	file.EnableLooping(midi_loop);
 	be_synth->SetSynthVolume((double)music_volume/(double)100);
 #ifdef DEBUG_SOUND
 fprintf(stderr, "MIDIThread: be_synth->SetSynthVolume(%f)\n", (float)((double)music_volume/(double)100));
 #endif
 
+	file.SetFileHook(MIDIFinished, midi_port);
+
 	file.Start();
-	music_is_playing = MUSIC_MIDI;
-	
-	while (!file.IsFinished() && music_is_playing)
+
+	while (!stop && !file.IsFinished())
 	{
 		// Suspend
-		if ((!enable_audio || audio_factory_suspended) && !is_suspended)
+		if (media_control.AudioSuspended() && !is_suspended)
 		{
 			file.Pause();
 #ifdef DEBUG_SOUND
@@ -314,7 +453,7 @@ fprintf(stderr, "MIDIThread suspend: file.Pause()\n");
 			is_suspended = true;
 		}
 		// Resume
-		else if ((enable_audio && !audio_factory_suspended) && is_suspended)
+		else if (!media_control.AudioSuspended() && is_suspended)
 		{
 			file.Resume();
 #ifdef DEBUG_SOUND
@@ -322,14 +461,14 @@ fprintf(stderr, "MIDI resume: file.Resume()\n");
 #endif
 			is_suspended = false;
 		}
-		
-		if (quit_he_thread)
+
+		switch (media_control.Wait(midi_port))
 		{
-			music_is_playing = false;
-			break;
+			case MEDIA_CONTROL_STOP:
+			case MEDIA_CONTROL_QUIT:
+				stop = true;
+				break;
 		}
-		
-		snooze(20000);
 	}
 
 	delete entry;
@@ -338,99 +477,106 @@ exit_thread(0);
 }
 
 
-/* hugo_playmusic_MIDI
+/* OpenMIDI
+
+	Returns false if it fails.
 
-	Returns false if it fails because of an ERROR.
-	
 	Note that we have to use a tempfile to load the MIDI file, since
 	Be's MIDI Kit expects these to be standalone files, not part of a
 	concatenated resource file.
 */
 
-int hugo_playmusic_MIDI(FILE *infile, long reslength, char loop_flag)
+static bool OpenMIDI(music_request *r, FILE *infile, long reslength)
 {
-	if (!CreateResourceCache(&midi_tempfile, infile, reslength)) return false;
+	if (!CreateResourceCache(&r->tempfile, infile, reslength)) return false;
 
 	// Create a BEntry from tempfile; MIDIThread will delete it
-	BEntry *entry = new BEntry(midi_tempfile, false);
-	if (entry->InitCheck()!=B_OK) return false;
-	
-	audio_loop = loop_flag;
-		
+	r->entry = new BEntry(r->tempfile, false);
+	return (r->entry->InitCheck()==B_OK);
+}
+
+static void StartMIDI(music_request *r)
+{
+	midi_tempfile = r->tempfile;
+	r->tempfile = NULL;
+	midi_loop = r->loop;
+	if ((midi_port = media_control.Open("MIDI")) < B_OK) return;
+
 	// Launch the MIDIThread
-	midi_thread = spawn_thread(MIDIThread, "MediaView MIDI thread", B_NORMAL_PRIORITY, entry);
-	resume_thread(midi_thread);
-	
-	return true;
+	midi_thread = spawn_thread(MIDIThread, "MediaView MIDI thread", B_NORMAL_PRIORITY, r->entry);
+	if (midi_thread >= B_OK && resume_thread(midi_thread)==B_OK)
+		r->entry = NULL;
 }
 
-void hugo_stopmusic_MIDI(void)
+static void StopMIDI(void)
 {
-	music_is_playing = false;
+	status_t result;
+
+	if (midi_port >= B_OK) media_control.Post(midi_port, MEDIA_CONTROL_STOP);
+	if (midi_thread >= B_OK) wait_for_thread(midi_thread, &result);
+	midi_thread = -1;
+	if (midi_port >= B_OK) media_control.Close(midi_port);
+	midi_port = -1;
 
 	// If a midi_tempfile exists, delete it
 	if (midi_tempfile)
 	{
-		entry_ref ref;
-		if (get_ref_for_path(midi_tempfile, &ref)==B_OK)
-		{
-			BEntry del(&ref, false);
-			del.Remove();
-		}
-		free(midi_tempfile);
+		RemoveTempfile(midi_tempfile);
 		midi_tempfile = NULL;
 	}
 }
 
- 
+
 //--------------------------------------------------------------------
 // MikMod playback:
 //--------------------------------------------------------------------
- 
-// The timer that will run the MikMod player:
 
-static thread_id mikmod_thread;
-extern BSoundPlayer *soco_bsbp;  // from MikMod's drv_be.cpp
+// MikMod is run entirely from output_mixer's callback:  the driver's
+// VC_WriteBytes() advances the player tick by tick as it renders, so
+// there's nothing to poll.  Suspending and resuming are done by
+// SuspendAudio() and ResumeAudio() as enable_audio and
+// audio_factory_suspended change.
+
+extern MixerVoice *mikmod_voice;  // from MikMod's drv_be.cpp
+static bool mikmod_suspended = false;
 
-int32 MikModThread(void *data)
+
+/* SuspendAudio
+
+	Called when enable_audio is cleared or audio_factory_suspended
+	is set.
+*/
+
+void SuspendAudio(void)
 {
-	bool is_suspended = false;
-		
-	while (true)
-	{
-		if (quit_he_thread)
-		{
-			exit_thread(0);
-			break;		// unnecessary
-		}
-		
-		// Suspend
-		if ((!enable_audio || audio_factory_suspended) && !is_suspended)
-		{
-			if (!Player_Paused()) Player_TogglePause();
-			soco_bsbp->SetVolume(0.0);
+	if (audio_init_failed || mikmod_suspended) return;
+
+	if (!Player_Paused()) Player_TogglePause();
+	mikmod_voice->SetGain(0.0);
 #ifdef DEBUG_SOUND
-fprintf(stderr, "MikModThread suspend: soco_bsbp->SetVolume(0.0)\n");
+fprintf(stderr, "SuspendAudio: mikmod_voice->SetGain(0.0)\n");
 #endif
-			is_suspended = true;
-		}
-		// Resume
-		else if ((enable_audio && !audio_factory_suspended) && is_suspended)
-		{
-			if (Player_Paused()) Player_TogglePause();
-			soco_bsbp->SetVolume(1.0);
+	mikmod_suspended = true;
+}
+
+
+/* ResumeAudio
+
+	Called when enable_audio is set or audio_factory_suspended is
+	cleared; does nothing unless both allow it.
+*/
+
+void ResumeAudio(void)
+{
+	if (audio_init_failed || !mikmod_suspended) return;
+	if (!enable_audio || audio_factory_suspended) return;
+
+	if (Player_Paused()) Player_TogglePause();
+	mikmod_voice->SetGain(1.0);
 #ifdef DEBUG_SOUND
-fprintf(stderr, "MikModThread resume: soco_bsbp->SetVolume(1.0)\n");
+fprintf(stderr, "ResumeAudio: mikmod_voice->SetGain(1.0)\n");
 #endif
-			is_suspended = false;
-		}
-
-		MikMod_Update();
-		// 20 ms resolution
-		snooze(20000);
-	}
-exit_thread(0);
-	return 0;
+	mikmod_suspended = false;
 }
 
 
@@ -440,21 +586,9 @@ extern MDRIVER drv_be;
 
 int InitPlayer(void)
 {
-	MikMod_RegisterLoader(&load_mod);	/* module loaders */
-	MikMod_RegisterLoader(&load_s3m);
-	MikMod_RegisterLoader(&load_xm);
-
 //	MikMod_RegisterAllDrivers();		/* valid audio drivers */
 	MikMod_RegisterDriver(&drv_be);
-
-	md_mixfreq = 44100;			/* standard mixing frequency */
-	md_mode = DMODE_16BITS | DMODE_STEREO |
-		// software mixing
-		DMODE_SOFT_MUSIC | DMODE_SOFT_SNDFX;
-	md_device = 0;				/* standard device: autodetect */
-
-	// This is 6 by default, but that's too much
-	md_reverb = 0;
+	SetupMikMod();
 
 	if (MikMod_Init(""))			/* initialize driver */
 	{
@@ -466,156 +600,1059 @@ int InitPlayer(void)
 	/* Start the player here and keep it running globally */
 	MikMod_SetNumVoices(MAXCHANNELS, MAXCHANNELS);
 	MikMod_EnableOutput();
-	// Start the timer
-	mikmod_thread = spawn_thread(MikModThread, "MikMod thread", B_NORMAL_PRIORITY, NULL);
-	resume_thread(mikmod_thread);
+	if (!enable_audio || audio_factory_suspended) SuspendAudio();
 
 	return true;
 }
 
 
-/* hugo_playmusic_MikMod
+// Loaded modules are kept, most recently used first, so that going
+// back to a piece of music doesn't mean loading it (and its samples)
+// all over again.  They're bounded by module_cache_budget bytes of
+// sample data--which MikMod's software mixer keeps as 16-bit--and by
+// MAX_CACHED_MODULES, since every cached sample holds one of MikMod's
+// sample handles.  The module that's playing is never freed.
 
-	Returns false if it fails because of an ERROR.
+#define DEFAULT_MODULE_CACHE_SIZE (8*1024*1024)
+#define MAX_CACHED_MODULES 8
+
+struct cached_module
+{
+	char *key;
+	MODULE *module;
+	size_t bytes;
+	cached_module *next;
+};
+
+size_t module_cache_budget = DEFAULT_MODULE_CACHE_SIZE;
+static cached_module *module_cache = NULL;
+static size_t module_cache_used = 0;
+static bool modfile_cached = false;
+
+static size_t ModuleSize(MODULE *m)
+{
+	size_t bytes = sizeof(MODULE);
+
+	for (int i=0; i<m->numsmp; i++)
+		bytes += m->samples[i].length*2;
+	return bytes;
+}
+
+// Returns the module cached under <key> (making it the most recently
+// used), or NULL
+static MODULE *FindModule(const char *key)
+{
+	cached_module *c, **prev;
+
+	for (prev=&module_cache; (c = *prev); prev=&c->next)
+	{
+		if (!strcmp(c->key, key))
+		{
+			*prev = c->next;
+			c->next = module_cache;
+			module_cache = c;
+			return c->module;
+		}
+	}
+	return NULL;
+}
+
+// Frees the least recently used modules until there's room for
+// <bytes> more, and returns false if there isn't
+static bool EvictModules(size_t bytes)
+{
+	cached_module *c, **prev, **last;
+	int count;
+
+	while (true)
+	{
+		last = NULL;
+		count = 0;
+		for (prev=&module_cache; (c = *prev); prev=&c->next)
+		{
+			count++;
+			if (c->module!=modfile) last = prev;
+		}
+		if (module_cache_used+bytes <= module_cache_budget && count < MAX_CACHED_MODULES)
+			return true;
+		if (!last) return false;
+
+		c = *last;
+		*last = c->next;
+		module_cache_used -= c->bytes;
+		Player_Free(c->module);
+		free(c->key);
+		delete c;
+	}
+}
+
+// Frees every cached module but the one playing, returning false if
+// there weren't any
+static bool FlushModules(void)
+{
+	cached_module *c, **prev;
+	bool freed = false;
+
+	for (prev=&module_cache; (c = *prev); )
+	{
+		if (c->module==modfile)
+		{
+			prev = &c->next;
+			continue;
+		}
+		*prev = c->next;
+		module_cache_used -= c->bytes;
+		Player_Free(c->module);
+		free(c->key);
+		delete c;
+		freed = true;
+	}
+	return freed;
+}
+
+// Returns false if <m> isn't cached, and so has to be freed when it's
+// done with
+static bool CacheModule(const char *key, MODULE *m)
+{
+	size_t bytes = ModuleSize(m);
+	cached_module *c;
+
+	if (bytes > module_cache_budget || !EvictModules(bytes)) return false;
+
+	c = new cached_module;
+	c->key = strdup(key);
+	c->module = m;
+	c->bytes = bytes;
+	c->next = module_cache;
+	module_cache = c;
+	module_cache_used += bytes;
+
+#ifdef DEBUG_SOUND
+fprintf(stderr, "CacheModule(\"%s\"): %ld bytes, %ld of %ld used\n",
+	key, (long)bytes, (long)module_cache_used, (long)module_cache_budget);
+#endif
+	return true;
+}
+
+
+/* OpenModule
+
+	Gets the module in <f> ready for the music thread to load:  as
+	a stream over the mapped resource file if it can be, so it's
+	read straight out of the page cache.  Otherwise, since <f> can't
+	be kept, its bytes are copied into memory and streamed from
+	there; it's still loaded on the music thread.  Returns false if
+	it fails.
 */
 
-int hugo_playmusic_MikMod(FILE *f, long reslength, char loop_flag)
+static bool OpenModule(music_request *r, FILE *f, long reslength)
 {
-	if (audio_init_failed)
+	long fpos = ftell(f);
+
+	r->key = (char *)malloc(strlen(loaded_filename)+strlen(loaded_resname)+2);
+	if (!r->key)
 	{
-		PrintAudioError();
 		fclose(f);
-		return true;	/* not an error */
+		return false;
 	}
+	sprintf(r->key, "%s|%s", loaded_filename, loaded_resname);
+	strupr(r->key);
 
-//	MikMod_Reset(NULL);
-Player_Stop();
+	if (fpos!=-1)
+	{
+		ResourceMap *map;
+		char *path = ResourcePath();
+		if (!(map = ResourceMap::Map(path, "games")))
+			map = ResourceMap::Map(path, "object");
+		if (map && (r->stream = map->Stream(fpos, reslength)))
+			PrefetchAccessed(map, fpos);
+	}
 
-	// The file is already positioned
-	modfile = Player_LoadFP(f, MAXCHANNELS, 0);
+	if (!r->stream && reslength > 0 && (r->data = malloc(reslength)))
+	{
+		if (fread(r->data, 1, reslength, f)==(size_t)reslength)
+			r->stream = fmemopen(r->data, reslength, "rb");
+	}
 	fclose(f);
 
-	if (modfile)
-	{
-		if (loop_flag)
-			modfile->wrap = 1;
-		else
-			modfile->wrap = 0;
+	return (r->stream!=NULL);
+}
 
-		soco_bsbp->SetVolumeDB(1.0);
 
-		Player_SetVolume((music_volume*128)/100);
-		Player_Start(modfile);
+/* LoadModule
 
-		// This extra bit of encouragement to shut up is apparently needed,
-		// not just in MikModThread
-		if (!enable_audio || audio_factory_suspended)
-		{
-			soco_bsbp->SetVolume(0.0);
-		}
+	Returns the module for <r> (or NULL), setting *replay if it was
+	already loaded and so has to be started over, and *cached if it's
+	kept in the cache.  Loading only takes sample handles MikMod's
+	mixer isn't using, so the current module plays on meanwhile.
+*/
+
+static MODULE *LoadModule(music_request *r, bool *replay, bool *cached)
+{
+	MODULE *m;
 
-		music_is_playing = MUSIC_MIKMOD;
-		
-		return true;
+	*replay = *cached = false;
+
+	// A module we already have just gets started over
+	if ((m = FindModule(r->key)))
+	{
+		*replay = *cached = true;
+		return m;
 	}
+
+	m = Player_LoadFP(r->stream, MAXCHANNELS, 0);
+
+	// MikMod's mixer has only so many sample handles, and the cached
+	// modules may be holding most of them; if so, let them go and try
+	// again
+	if (!m && FlushModules() && fseek(r->stream, 0, SEEK_SET)==0)
+		m = Player_LoadFP(r->stream, MAXCHANNELS, 0);
+
+	if (m)
+		*cached = CacheModule(r->key, m);
 #if defined (DEBUGGER)
 	else
 		DebugMessageBox("Sound Library Error", MikMod_strerror(MikMod_errno));
 #endif
-	return false;
+	return m;
 }
 
 
-void hugo_stopmusic_MikMod(void)
+/* StartModule
+
+	Starts <m>, fading it in over <fade> if that's nonzero.  Called
+	with output_mixer locked, so that it starts between buffers; it
+	only sets up MikMod's player, which is quick, since the callback
+	waits for the lock.
+*/
+
+static void StartModule(MODULE *m, music_request *r, bool replay, bigtime_t fade)
 {
-	if (audio_init_failed) return;
+	if (r->loop)
+		m->wrap = 1;
+	else
+		m->wrap = 0;
+
+	Player_Start(m);
+	if (replay) Player_SetPosition(0);
 
-	if (music_is_playing)
+	// Only sets the volume of the module that's been started
+	Player_SetVolume((r->volume*128)/100);
+
+	// Player_Start() unpauses the player, so stay quiet if
+	// we're suspended
+	if (mikmod_suspended)
+	{
+		if (!Player_Paused()) Player_TogglePause();
+		mikmod_voice->SetGain(0.0);
+	}
+	else if (fade)
 	{
-		music_is_playing = false;
-		modfile->numpos = 0;
-		
-		Player_Free(modfile);
+		mikmod_voice->SetGain(0.0);
+		mikmod_voice->FadeTo(1.0, fade);
+	}
+	else
+		mikmod_voice->SetGain(1.0);
+}
+
+// Frees <m> once it's no longer playing, unless it's cached
+static void ReleaseModule(MODULE *m, bool cached)
+{
+	if (!cached)
+	{
+		m->numpos = 0;
+		Player_Free(m);
 	}
 }
 
 
 //--------------------------------------------------------------------
-// Sample playback:
+// Music thread:
 //--------------------------------------------------------------------
- 
-static MediaView *sampleview;
-static thread_id sample_thread;
-static bool sample_loop;
-static bool sample_deleted = true;
 
-int32 SampleThread(void *data)
+// Loading music--reading a module and all its samples into MikMod,
+// or finding and opening a MediaView's tracks--can take long enough
+// to be heard as a gap, and used to be done on the engine thread
+// with the old music already stopped.  Now hugo_playmusic() just
+// posts a request, and the music thread loads the new music while
+// the old plays on, then swaps them between mixer buffers (or
+// crossfades over music_crossfade ms).  Only the latest request is
+// kept:  one that's replaced before the thread gets to it is dropped.
+
+static BLocker music_lock("music lock");
+static music_request *pending_music = NULL;
+static sem_id music_sem = -1;
+static thread_id music_thread = -1;
+
+// What the music thread has playing
+static char current_music = 0;
+static media_stream *current_media = NULL;
+
+static void FreeMusicRequest(music_request *r)
 {
-	bool is_suspended = false;
-	float suspended_vol = 1.0;
-	
-sample_deleted = false;
+	if (r->stream) fclose(r->stream);
+	free(r->data);
+	free(r->key);
+	delete r->sid;
+	delete r->entry;
+	if (r->tempfile) RemoveTempfile(r->tempfile);
+	delete r;
+}
 
-	subset_io_data *sid = (subset_io_data *)data;
-	
-	sampleview = new MediaView(BRect(0, 0, 0, 0), "sampleview", B_FOLLOW_NONE);
-	SubsetIO *sio = new SubsetIO(sid->file, sid->start, sid->start+sid->length);
-	if (sampleview->SetMediaSource(sio)!=B_NO_ERROR) goto Exit;
 
-	sampleview->loop = sample_loop;
-	sampleview->SetVolume((float)sample_volume/100.0);
+/* ChangeMusic
+
+	Loads the music in <r>, if any, then stops the current music and
+	starts the new.  If the new music fails to load, the current
+	music is just stopped.
+*/
+
+static void ChangeMusic(music_request *r)
+{
+	char old = current_music;
+	MODULE *old_module = modfile, *module = NULL;
+	bool old_cached = modfile_cached, cached = false, replay = false;
+	media_stream *old_media = current_media, *media = NULL;
+	bigtime_t fade = 0;
+
 #ifdef DEBUG_SOUND
-fprintf(stderr, "SampleThread: sampleview->SetVolume(%f)\n", (float)sample_volume/100.0);
+fprintf(stderr, "ChangeMusic: %d to %d\n", old, r->type);
 #endif
-	
-	sampleview->Control(MEDIA_PLAY);
-	sample_is_playing = true;
+	// MIDI isn't played through the mixer, so it can't overlap
+	// anything
+	if (old==MUSIC_MIDI)
+	{
+		StopMIDI();
+		old = 0;
+	}
 
-	while (sampleview->IsPlaying() && sample_is_playing)
+	if (r->type==MUSIC_MIKMOD)
 	{
-		
-		// Suspend
-		if ((!enable_audio || audio_factory_suspended) && !is_suspended)
+		if (!(module = LoadModule(r, &replay, &cached))) r->type = 0;
+	}
+	else if (r->type==MUSIC_MEDIAVIEW)
+	{
+		media = LoadMediaStream(r->sid, r->loop, r->volume, &music_volume,
+			&music_is_playing);
+		r->sid = NULL;
+		if (!media) r->type = 0;
+	}
+
+	// There's only the one MikMod player, so two modules can't be
+	// crossfaded; they're just swapped
+	if (music_crossfade > 0 && old && (r->type==MUSIC_MIKMOD || r->type==MUSIC_MEDIAVIEW)
+		&& !(old==MUSIC_MIKMOD && r->type==MUSIC_MIKMOD)
+		&& !media_control.AudioSuspended())
+	{
+		fade = (bigtime_t)music_crossfade*1000;
+	}
+
+	if (fade)
+	{
+		if (old==MUSIC_MIKMOD)
+			mikmod_voice->FadeTo(0.0, fade);
+		else
 		{
-			suspended_vol = sampleview->Volume();
+			old_media->stop = true;		// (see AudioThread())
+			old_media->view->FadeVolume(0.0, fade);
+		}
+
+		output_mixer.Lock();
+		if (module)
+			StartModule(module, r, replay, fade);
+		else
+			StartMediaStream(media, fade);
+		output_mixer.Unlock();
+
+		snooze(fade);
+		if (old==MUSIC_MIKMOD) Player_Stop();
+	}
+	else
+	{
+		// With the mixer locked, the old music's last buffer is
+		// followed directly by the new music's first
+		output_mixer.Lock();
+		if (old==MUSIC_MIKMOD && !module)
+			Player_Stop();
+		else if (old==MUSIC_MEDIAVIEW)
+		{
+			old_media->stop = true;
+			old_media->view->SetVolume(0.0);
+		}
+
+		if (module)
+			StartModule(module, r, replay, 0);
+		else if (media)
+			StartMediaStream(media, 0);
+		output_mixer.Unlock();
+	}
+
+	// Now the old music can be torn down
+	if (old==MUSIC_MIKMOD && old_module!=module)
+		ReleaseModule(old_module, old_cached);
+	else if (old==MUSIC_MEDIAVIEW)
+		StopMediaStream(old_media);
+
+	if (r->type==MUSIC_MIDI) StartMIDI(r);
+
+	modfile = module;
+	modfile_cached = cached;
+	current_media = media;
+	current_music = r->type;
+	music_is_playing = r->type;
+}
+
+static int32 mikmod_ended = 0;
+
+/* MikModEnded
+
+	Called from output_mixer's callback (by the MikMod driver) when
+	a module that doesn't loop comes to its end.  It's stopped on the
+	music thread.
+*/
+
+void MikModEnded(void)
+{
+	atomic_or(&mikmod_ended, 1);
+	if (music_sem >= B_OK)
+		release_sem_etc(music_sem, 1, B_DO_NOT_RESCHEDULE);
+}
+
+int32 MusicThread(void *data)
+{
+	music_request *r;
+
+	while (acquire_sem(music_sem)==B_OK)
+	{
+		music_lock.Lock();
+		r = pending_music;
+		pending_music = NULL;
+		music_lock.Unlock();
+
+		if (r)
+		{
+			ChangeMusic(r);
+			FreeMusicRequest(r);
+		}
+
+		// (Unless a new module has been started since)
+		if (atomic_and(&mikmod_ended, 0) && current_music==MUSIC_MIKMOD)
+		{
+			output_mixer.Lock();
+			if (!Player_Active())
+			{
+				Player_Stop();
+				music_is_playing = 0;
+			}
+			output_mixer.Unlock();
+		}
+	}
+	return 0;
+}
+
+
+/* PostMusicRequest
+
+	Hands <r> to the music thread (starting it the first time),
+	replacing any request it hasn't gotten to yet.
+*/
+
+static void PostMusicRequest(music_request *r)
+{
+	music_request *dropped;
+
+	music_lock.Lock();
+	if (music_thread < B_OK)
+	{
+		if (music_sem < B_OK) music_sem = create_sem(0, "music requests");
+		if (music_sem >= B_OK)
+			music_thread = spawn_thread(MusicThread, "music thread", B_NORMAL_PRIORITY, NULL);
+		if (music_thread < B_OK || resume_thread(music_thread)!=B_OK)
+		{
+			// No thread, so change the music here instead
+			music_thread = -1;
+			music_lock.Unlock();
+			ChangeMusic(r);
+			FreeMusicRequest(r);
+			return;
+		}
+	}
+	dropped = pending_music;
+	pending_music = r;
+	music_lock.Unlock();
+
+	// The thread was already released for the one it missed
+	if (dropped)
+		FreeMusicRequest(dropped);
+	else
+		release_sem(music_sem);
+}
+
+
+/* ExitPlayer
+
+	Called at quit, once the engine thread is done.  The sample
+	thread and the music thread are waited for, and whatever they
+	still have playing is stopped, before MikMod is shut down and
+	the app (with output_mixer) goes away.
+*/
+
+void ExitPlayer(void)
+{
+	music_request *r;
+	status_t result;
+
+	ExitSamples();
+
+	// Deleting music_sem lets the thread finish what it's doing
+	// and then quit
+	music_lock.Lock();
+	if (music_sem >= B_OK) delete_sem(music_sem);
+	music_sem = -1;
+	music_lock.Unlock();
+	if (music_thread >= B_OK) wait_for_thread(music_thread, &result);
+	music_thread = -1;
+
+	if (pending_music) FreeMusicRequest(pending_music);
+	pending_music = NULL;
+
+	r = new music_request;
+	memset(r, 0, sizeof(music_request));
+	ChangeMusic(r);
+	FreeMusicRequest(r);
+
+	if (audio_init_failed) return;
+
+	// (Nothing's playing now, so this frees them all)
+	FlushModules();
+
+	MikMod_Exit();
+	audio_init_failed = true;
+}
+
+
+//--------------------------------------------------------------------
+// Sample playback:
+//--------------------------------------------------------------------
+
+// Short samples are decoded once, the whole of them, and kept as PCM
+// (most recently used first, bounded by sample_cache_budget bytes).
+// They're played by a pool of SampleVoices that stay in output_mixer,
+// so a sample is heard from the mixer's next buffer.  Up to
+// sample_polyphony play at once; past that, the one started longest
+// ago is cut off for the new one.  Samples that would decode to more
+// than max_cached_sample bytes are streamed from the resource file by
+// a MediaView instead, one at a time.
+//
+// hugo_playsample() and hugo_stopsample() don't wait for any of this:
+// they queue commands for the sample thread, which does the decoding,
+// starting and stopping.
+
+#define DEFAULT_SAMPLE_CACHE_SIZE (2*1024*1024)
+#define DEFAULT_MAX_CACHED_SAMPLE (256*1024)
+#define MAX_SAMPLE_VOICES 8
+#define DEFAULT_SAMPLE_POLYPHONY 4
+
+// The widest frame a cached sample can have (stereo, up to 32 bits);
+// the voices are allocated for it up front, and anything wider is
+// streamed
+#define MAX_SAMPLE_FRAME_BYTES 8
+
+struct cached_sample
+{
+	char *key;
+	media_raw_audio_format format;
+	uint8 *data;
+	int32 frames;
+	size_t bytes;
+	cached_sample *next;
+};
+
+size_t sample_cache_budget = DEFAULT_SAMPLE_CACHE_SIZE;
+size_t max_cached_sample = DEFAULT_MAX_CACHED_SAMPLE;
+int32 sample_polyphony = DEFAULT_SAMPLE_POLYPHONY;
+static cached_sample *sample_cache = NULL;
+static size_t sample_cache_used = 0;
+
+// Plays cached samples out of memory
+class SampleVoice : public MixerVoice
+{
+public:
+	SampleVoice();
+	virtual int32 Read(void *data, int32 frames);
+
+	// Called with output_mixer locked
+	void Start(cached_sample *s, bool l, float g, uint32 count);
+	void Stop() { sample = NULL; }
+
+	bool IsPlaying() const { return sample && sample_pos < sample->frames; }
+
+	cached_sample *sample;
+	uint32 started;		// samples_started when it was started
+
+private:
+	bool loop;
+	uint32 frame_bytes;
+	int32 sample_pos;		// in the sample's frames
+};
+
+static SampleVoice *sample_voices[MAX_SAMPLE_VOICES];
+static int32 sample_voice_count = 0;
+static uint32 samples_started = 0;
+static media_stream *sample_stream = NULL;
+
+SampleVoice::SampleVoice()
+{
+	media_raw_audio_format f = media_raw_audio_format::wildcard;
+
+	sample = NULL;
+	started = 0;
+	loop = false;
+	frame_bytes = 0;
+	sample_pos = 0;
+
+	// Just so it can be added to the mixer before it has a sample,
+	// with room for any sample's format
+	f.frame_rate = MIXER_FRAME_RATE;
+	f.channel_count = 2;
+	f.format = media_raw_audio_format::B_AUDIO_FLOAT;
+	f.byte_order = B_MEDIA_HOST_ENDIAN;
+	if (SetFormat(f)) Reserve(MAX_SAMPLE_FRAME_BYTES);
+}
+
+void SampleVoice::Start(cached_sample *s, bool l, float g, uint32 count)
+{
+	// No allocating, since the voice was made with room for any
+	// sample's format (and this also drops whatever's left of the
+	// last sample)
+	if (!SetFormat(s->format))
+	{
+		sample = NULL;
+		return;
+	}
+	sample = s;
+	loop = l;
+	started = count;
+	frame_bytes = (s->format.format & media_raw_audio_format::B_AUDIO_SIZE_MASK)
+		* s->format.channel_count;
+	sample_pos = 0;
+	SetGain(g);
+}
+
+// Called from output_mixer's callback
+int32 SampleVoice::Read(void *data, int32 frames)
+{
+	uint8 *out = (uint8 *)data;
+	int32 done = 0, count;
+
+	if (!sample) return 0;
+
+	while (done < frames && sample_pos < sample->frames)
+	{
+		count = sample->frames - sample_pos;
+		if (count > frames-done) count = frames-done;
+		memcpy(out+done*frame_bytes, sample->data+sample_pos*frame_bytes, count*frame_bytes);
+		sample_pos += count;
+		done += count;
+
+		if (sample_pos==sample->frames && loop) sample_pos = 0;
+	}
+
+	// Keep time, but quietly, while audio is off
+	if (media_control.AudioSuspended())
+	{
+		memset(out, (sample->format.format==media_raw_audio_format::B_AUDIO_UCHAR)?0x80:0,
+			done*frame_bytes);
+	}
+
+	return done;
+}
+
+// Returns the sample cached under <key> (making it the most recently
+// used), or NULL
+static cached_sample *FindSample(const char *key)
+{
+	cached_sample *c, **prev;
+
+	for (prev=&sample_cache; (c = *prev); prev=&c->next)
+	{
+		if (!strcmp(c->key, key))
+		{
+			*prev = c->next;
+			c->next = sample_cache;
+			sample_cache = c;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static void FreeSample(cached_sample *c)
+{
+	free(c->data);
+	free(c->key);
+	delete c;
+}
+
+// Frees the least recently used samples until there's room for
+// <bytes> more, and returns false if there isn't.  A sample a voice
+// still has isn't freed, even if it's done playing, since the
+// mixer's callback may be looking at it.
+static bool EvictSamples(size_t bytes)
+{
+	cached_sample *c, **prev, **last;
+	int32 i;
+
+	while (sample_cache_used+bytes > sample_cache_budget)
+	{
+		last = NULL;
+		for (prev=&sample_cache; (c = *prev); prev=&c->next)
+		{
+			for (i=0; i<sample_voice_count; i++)
+				if (sample_voices[i]->sample==c) break;
+			if (i==sample_voice_count) last = prev;
+		}
+		if (!last) return false;
+
+		c = *last;
+		*last = c->next;
+		sample_cache_used -= c->bytes;
+		FreeSample(c);
+	}
+	return true;
+}
+
+
+/* DecodeSample
+
+	Decodes all of the sample in <sid> and caches it under <key>.
+	Returns NULL if it can't be decoded, has frames wider than
+	MAX_SAMPLE_FRAME_BYTES, or would come to more than
+	max_cached_sample bytes (or won't fit in the cache).
+*/
+
+static cached_sample *DecodeSample(const char *key, subset_io_data *sid)
+{
+	BPositionIO *sio = sid->CreateIO();
+	BMediaFile *file = new BMediaFile(sio);
+	BMediaTrack *track = NULL;
+	cached_sample *c = NULL;
+	media_format mf;
+	uint32 frame_bytes;
+	size_t bytes, size;
+	int64 frames, count;
+	uint8 *data = NULL;
+	int32 i;
+
+	if (file->InitCheck()!=B_OK) goto Exit;
+
+	// The first audio track, decoded to whatever raw format suits it
+	for (i=0; i<file->CountTracks() && !track; i++)
+	{
+		if (!(track = file->TrackAt(i))) break;
+		if (track->EncodedFormat(&mf)!=B_NO_ERROR ||
+			(mf.type!=B_MEDIA_RAW_AUDIO && mf.type!=B_MEDIA_ENCODED_AUDIO))
+		{
+			file->ReleaseTrack(track);
+			track = NULL;
+		}
+	}
+	if (!track) goto Exit;
+
+	mf.type = B_MEDIA_RAW_AUDIO;
+	mf.u.raw_audio = media_raw_audio_format::wildcard;
+	if (track->DecodedFormat(&mf)!=B_NO_ERROR) goto Exit;
+
+	frame_bytes = (mf.u.raw_audio.format & media_raw_audio_format::B_AUDIO_SIZE_MASK)
+		* mf.u.raw_audio.channel_count;
+	if (frame_bytes==0 || frame_bytes > MAX_SAMPLE_FRAME_BYTES ||
+		(frames = track->CountFrames()) <= 0)
+	{
+		goto Exit;
+	}
+	bytes = frames*frame_bytes;
+	if (bytes > max_cached_sample || !EvictSamples(bytes)) goto Exit;
+
+	// ReadFrames() always reads a whole buffer, so leave room for one
+	// more, in case CountFrames() was short
+	size = bytes + mf.u.raw_audio.buffer_size;
+	if (!(data = (uint8 *)malloc(size))) goto Exit;
+	for (frames=0; frames*frame_bytes + mf.u.raw_audio.buffer_size <= size; frames+=count)
+	{
+		if (track->ReadFrames((char *)(data+frames*frame_bytes), &count)!=B_OK || count <= 0)
+			break;
+	}
+	if (frames==0) goto Exit;
+
+	c = new cached_sample;
+	c->key = strdup(key);
+	c->format = mf.u.raw_audio;
+	c->data = data;
+	c->frames = (int32)frames;
+	c->bytes = frames*frame_bytes;
+	c->next = sample_cache;
+	sample_cache = c;
+	sample_cache_used += c->bytes;
+	data = NULL;
+
 #ifdef DEBUG_SOUND
-fprintf(stderr, "SampleThread: suspended_vol = %f\n", suspended_vol);
+fprintf(stderr, "DecodeSample(\"%s\"): %ld bytes, %ld of %ld used\n",
+	key, (long)c->bytes, (long)sample_cache_used, (long)sample_cache_budget);
 #endif
-			sampleview->SetVolume(0.0);
+
+Exit:
+	free(data);
+	if (track) file->ReleaseTrack(track);
+	delete file;
+	delete sio;
+	return c;
+}
+
+// Returns a voice that's done playing, or else the one that was
+// started longest ago
+static SampleVoice *FindSampleVoice(void)
+{
+	SampleVoice *v = NULL;
+
+	for (int32 i=0; i<sample_voice_count; i++)
+	{
+		if (!sample_voices[i]->IsPlaying()) return sample_voices[i];
+		if (!v || (int32)(sample_voices[i]->started - v->started) < 0)
+			v = sample_voices[i];
+	}
+	return v;
+}
+
+
+#define SAMPLE_PLAY 1
+#define SAMPLE_STOP 2
+#define SAMPLE_VOLUME 3
+
+struct sample_command
+{
+	char type;
+	char loop;
+	int volume;
+	char *key;			// see hugo_playsample()
+	subset_io_data *sid;
+	sample_command *next;
+};
+
+static BLocker sample_lock("sample lock");
+static sample_command *sample_queue = NULL, **sample_queue_end = &sample_queue;
+static sem_id sample_sem = -1;
+static thread_id sample_thread = -1;
+
+static void FreeSampleCommand(sample_command *c)
+{
+	free(c->key);
+	delete c->sid;
+	delete c;
+}
+
+static void PlaySample(sample_command *c)
+{
+	cached_sample *s;
+	SampleVoice *v;
+
+	if (!(s = FindSample(c->key)) && !(s = DecodeSample(c->key, c->sid)))
+	{
+		// Too long (or wide) to cache, so it's streamed
+		if (sample_stream) StopMediaStream(sample_stream);
+		sample_stream = LoadMediaStream(c->sid, c->loop, c->volume, &sample_volume,
+			&sample_is_playing);
+		c->sid = NULL;
+		if (sample_stream)
+		{
+			StartMediaStream(sample_stream, 0);
+			sample_is_playing = true;
+		}
+		return;
+	}
+
+	if (!(v = FindSampleVoice())) return;
+
 #ifdef DEBUG_SOUND
-fprintf(stderr, "SampleThread suspend: sampleview->SetVolume(0.0)\n");
+fprintf(stderr, "PlaySample(\"%s\"): voice %s\n", c->key, v->IsPlaying()?"stolen":"free");
 #endif
-			is_suspended = true;
+	output_mixer.Lock();
+	v->Start(s, c->loop, (float)c->volume/100.0, ++samples_started);
+	output_mixer.Unlock();
+	sample_is_playing = true;
+}
+
+static void StopSamples(void)
+{
+	output_mixer.Lock();
+	for (int32 i=0; i<sample_voice_count; i++)
+		sample_voices[i]->Stop();
+	output_mixer.Unlock();
+
+	if (sample_stream)
+	{
+		StopMediaStream(sample_stream);
+		sample_stream = NULL;
+	}
+	sample_is_playing = false;
+}
+
+// Sets the gain of the samples playing (a streamed one hears about
+// it from media_control)
+static void SetSampleVolume(int volume)
+{
+	for (int32 i=0; i<sample_voice_count; i++)
+	{
+		if (sample_voices[i]->IsPlaying())
+			sample_voices[i]->SetGain((float)volume/100.0);
+	}
+}
+
+// Runs the commands posted by PostSampleCommand()
+static void RunSampleCommand(sample_command *c)
+{
+	if (c->type==SAMPLE_PLAY)
+		PlaySample(c);
+	else if (c->type==SAMPLE_VOLUME)
+		SetSampleVolume(c->volume);
+	else
+		StopSamples();
+	FreeSampleCommand(c);
+}
+
+int32 SampleThread(void *data)
+{
+	sample_command *c;
+	int32 count = sample_polyphony;
+
+	// The voices are made once, here, and never leave the mixer
+	if (count < 1) count = 1;
+	if (count > MAX_SAMPLE_VOICES) count = MAX_SAMPLE_VOICES;
+	for (sample_voice_count=0; sample_voice_count<count; sample_voice_count++)
+	{
+		SampleVoice *v = new SampleVoice;
+		if (!output_mixer.AddVoice(v))
+		{
+			delete v;
+			break;
 		}
-		// Resume
-		else if ((enable_audio && !audio_factory_suspended) && is_suspended)
+		sample_voices[sample_voice_count] = v;
+	}
+
+	while (acquire_sem(sample_sem)==B_OK)
+	{
+		sample_lock.Lock();
+		if ((c = sample_queue))
 		{
-			sampleview->SetVolume(suspended_vol);
-#ifdef DEBUG_SOUND
-fprintf(stderr, "SampleThread resume: sampleview->SetVolume(%f)\n", suspended_vol);
-#endif
-			is_suspended = false;
+			if (!(sample_queue = c->next)) sample_queue_end = &sample_queue;
 		}
-		
-		if (quit_he_thread)
+		sample_lock.Unlock();
+
+		if (c) RunSampleCommand(c);
+	}
+	return 0;
+}
+
+
+/* PostSampleCommand
+
+	Queues <c> for the sample thread (starting it the first time).
+	A stop drops whatever's still queued ahead of it, since it would
+	only be stopped again.
+*/
+
+static void PostSampleCommand(sample_command *c)
+{
+	sample_command *dropped = NULL, *next;
+
+	c->next = NULL;
+
+	sample_lock.Lock();
+	if (sample_thread < B_OK)
+	{
+		if (sample_sem < B_OK) sample_sem = create_sem(0, "sample commands");
+		if (sample_sem >= B_OK)
+			sample_thread = spawn_thread(SampleThread, "sample thread", B_NORMAL_PRIORITY, NULL);
+		if (sample_thread < B_OK || resume_thread(sample_thread)!=B_OK)
 		{
-			sampleview->Control(MEDIA_STOP);
-			break;
+			// No thread, and so no voices; only streaming works
+			sample_thread = -1;
+			sample_lock.Unlock();
+			RunSampleCommand(c);
+			return;
 		}
-		snooze(20000);
 	}
-	
-	// In case we got here by clearing music_is_playing in hugo_stopsample()
-	if (sampleview->IsPlaying()) sampleview->Control(MEDIA_STOP);
+	if (c->type==SAMPLE_STOP)
+	{
+		dropped = sample_queue;
+		sample_queue = NULL;
+		sample_queue_end = &sample_queue;
+	}
+	*sample_queue_end = c;
+	sample_queue_end = &c->next;
+	sample_lock.Unlock();
 
-Exit:
+	// (The thread is released for every command posted, so it'll
+	// just find nothing for the ones dropped)
+	release_sem(sample_sem);
+
+	for (; dropped; dropped=next)
+	{
+		next = dropped->next;
+		FreeSampleCommand(dropped);
+	}
+}
+
+
+/* ExitSamples
+
+	Called by ExitPlayer():  shuts the sample thread down the way
+	the music thread is, then takes the voices out of the mixer and
+	frees them and the cache.
+*/
+
+static void ExitSamples(void)
+{
+	sample_command *c, *next;
+	cached_sample *s;
+	status_t result;
+	int32 i;
+
+	sample_lock.Lock();
+	if (sample_sem >= B_OK) delete_sem(sample_sem);
+	sample_sem = -1;
+	c = sample_queue;
+	sample_queue = NULL;
+	sample_queue_end = &sample_queue;
+	sample_lock.Unlock();
+	if (sample_thread >= B_OK) wait_for_thread(sample_thread, &result);
+	sample_thread = -1;
+
+	for (; c; c=next)
+	{
+		next = c->next;
+		FreeSampleCommand(c);
+	}
+
+	if (sample_stream)
+	{
+		StopMediaStream(sample_stream);
+		sample_stream = NULL;
+	}
 	sample_is_playing = false;
-	delete sampleview;
-	delete sid;
-	delete sio;
-sample_deleted = true;
-exit_thread(0);
-	return 0;
+
+	for (i=0; i<sample_voice_count; i++)
+	{
+		output_mixer.RemoveVoice(sample_voices[i]);
+		delete sample_voices[i];
+	}
+	sample_voice_count = 0;
+
+	while ((s = sample_cache))
+	{
+		sample_cache = s->next;
+		FreeSample(s);
+	}
+	sample_cache_used = 0;
 }
 
 
@@ -631,7 +1668,7 @@ int hugo_playsample(FILE *infile, long reslength, char loop_flag)
 	if (fpos==-1) return false;
 	
 #ifdef DEBUG_SOUND
-fprintf(stderr, "hugo_playmusic(infile, %ld, %d)\n", reslength, loop_flag);
+fprintf(stderr, "hugo_playsample(infile, %ld, %d)\n", reslength, loop_flag);
 fprintf(stderr, "[%s: %s]\n", loaded_filename, loaded_resname);
 #endif
 	char *path;
@@ -640,31 +1677,29 @@ fprintf(stderr, "[%s: %s]\n", loaded_filename, loaded_resname);
 	else
 		path = loaded_filename;
 
-	// Create a BFile from the path and position it; VideoThread
-	// will delete it when it deletes the subset_io_data
-	BFile *file;
-	if (!(file = TrytoOpenBFile(path, "games")))
+	sample_command *c = new sample_command;
+	c->type = SAMPLE_PLAY;
+	c->loop = loop_flag;
+	c->volume = sample_volume;
+
+	// Samples are cached under the same sort of key as modules
+	c->key = (char *)malloc(strlen(loaded_filename)+strlen(loaded_resname)+2);
+	if (c->key)
 	{
-		if (!(file = TrytoOpenBFile(path, "object")))
-		{
-			return false;
-		}
+		sprintf(c->key, "%s|%s", loaded_filename, loaded_resname);
+		strupr(c->key);
 	}
-	if (file->InitCheck()!=B_OK)
+
+	// Get a view of the (mapped) resource file
+	c->sid = OpenResourceSubset(path, fpos, reslength);
+
+	if (!c->key || !c->sid)
 	{
-		delete file;
+		FreeSampleCommand(c);
 		return false;
 	}
+	PostSampleCommand(c);
 
-	subset_io_data *sid = new subset_io_data(file, fpos, reslength);
-
-	sample_loop = loop_flag;
-		
-	// Launch the SampleThread
-while (!sample_deleted) snooze(1000);
-	sample_thread = spawn_thread(SampleThread, "MediaView sample thread", B_NORMAL_PRIORITY, sid);
-	resume_thread(sample_thread);
-	
 	return true;
 }
 
@@ -674,13 +1709,32 @@ void hugo_stopsample(void)
 #ifdef DEBUG_SOUND
 fprintf(stderr, "hugo_stopsample()\n");
 #endif
-	sample_is_playing = false;
+	sample_command *c = new sample_command;
+	c->type = SAMPLE_STOP;
+	c->key = NULL;
+	c->sid = NULL;
+	PostSampleCommand(c);
 }
 
 
 void hugo_samplevolume(int vol)
 {
+	sample_command *c;
+
+	if (vol==sample_volume) return;
 	sample_volume = vol;
+
+	// Only if there's a sample thread, which may have samples playing
+	if (sample_thread >= B_OK)
+	{
+		c = new sample_command;
+		c->type = SAMPLE_VOLUME;
+		c->volume = vol;
+		c->key = NULL;
+		c->sid = NULL;
+		PostSampleCommand(c);
+	}
+	media_control.VolumeChanged();
 }
 
 
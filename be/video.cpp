@@ -5,9 +5,12 @@
 #ifndef COMPILE_V25
 
 #include <File.h>
+#include <Locker.h>
 
 #include "behugo.h"
+#include "MediaControl.h"
 #include "MediaView.h"
+#include "ResourceMap.h"
 #include "SubsetIO.h"
 
 extern "C"
@@ -20,7 +23,9 @@ int hugo_playvideo(HUGO_FILE, long, char, char, int);
 }
 
 MediaView *videoview;
-static thread_id video_thread;
+static BLocker video_lock("video lock");	// for the next two
+static thread_id video_thread = -1;
+static port_id video_port = -1;		// VideoThread's media_control channel
 static float video_volume = 100.0;
 static bool video_loop = false;
 static BRect video_rect;
@@ -36,22 +41,42 @@ int hugo_hasvideo(void)
 }
 
 
-/* hugo_stopvideo */
+/* WaitForVideo
+
+	Waits for a VideoThread started by hugo_playvideo() to finish.
+	It locks the window on its way out, so this mustn't be called
+	with the window locked.
+*/
+
+static void WaitForVideo(void)
+{
+	thread_id thread;
+	status_t result;
+
+	video_lock.Lock();
+	thread = video_thread;
+	video_lock.Unlock();
+
+	if (thread >= B_OK) wait_for_thread(thread, &result);
+}
+
+
+/* hugo_stopvideo
+
+	Called from the window thread, too (for B_ESCAPE, or when
+	graphics are turned off), which can't wait for VideoThread; then
+	the next hugo_playvideo() waits for it instead.
+*/
 
 void hugo_stopvideo(void)
 {
-	if (video_playing)
-	{
-// This way of stopping the video seems to cause a race condition
-// with window->Lock():
-//		videoview->Control(MEDIA_STOP);
-//		while (video_playing)
-//		{
-//			snooze(5000);
-//		}
-		video_playing = false;
-		snooze(50000);
-	}
+	video_lock.Lock();
+	if (video_port >= B_OK)
+		media_control.Post(video_port, MEDIA_CONTROL_STOP);
+	video_lock.Unlock();
+	video_playing = false;
+
+	if (!window->IsLocked()) WaitForVideo();
 }
 
 
@@ -59,16 +84,18 @@ void hugo_stopvideo(void)
 
 int32 VideoThread(void *data)
 {
-	bool is_suspended = false;
-	float suspended_vol = 1.0;
-		
 	float w = 0.0;
 	float h = 0.0;
 	subset_io_data *sid = (subset_io_data *)data;
+	port_id port;
+
+	video_lock.Lock();
+	port = video_port;
+	video_lock.Unlock();
 	
 	videoview = new MediaView(BRect(0, 0, 0, 0), "videoview", B_FOLLOW_NONE);
 	visible_view->AddChild(videoview);
-	SubsetIO *sio = new SubsetIO(sid->file, sid->start, sid->start+sid->length);
+	BPositionIO *sio = sid->CreateIO();
 	if (videoview->SetMediaSource(sio)!=B_NO_ERROR) goto Exit;
 
 	if (window->Lock())
@@ -77,13 +104,18 @@ int32 VideoThread(void *data)
 		window_width = video_rect.Width();
 		window_height = video_rect.Height();
 
+		// Fill as much of the window as the video's aspect ratio
+		// allows, scaling up as well as down; without an overlay,
+		// MediaView scales the frames as it decodes them
 		videoview->GetPreferredSize(&w, &h);
 		ratio = w/h;
-		if (w > window_width) w = window_width;
-		if (h > window_height) h = window_height;
-		
-		if (w/h > ratio) w = h*ratio;
-		if (w/h < ratio) h = w/ratio;
+		w = window_width;
+		h = w/ratio;
+		if (h > window_height)
+		{
+			h = window_height;
+			w = h*ratio;
+		}
 
 		videoview->MoveTo(
 			video_rect.left + window_width/2.0 - w/2.0,
@@ -95,37 +127,30 @@ int32 VideoThread(void *data)
 	}
 
 	videoview->loop = video_loop;
-	videoview->SetVolume((float)video_volume/100.0);
+	videoview->SetNotifyPort(port);
+	videoview->SetVolume(media_control.AudioSuspended() ? 0.0 : (float)video_volume/100.0);
 
 	videoview->Control(MEDIA_PLAY);
 	video_playing = true;
 	
-	while (videoview->IsPlaying() && video_playing)
+	// Stopped by hugo_stopvideo() (including when graphics are
+	// turned off), or woken by MEDIA_CONTROL_FINISHED to find it's
+	// done
+	while (videoview->IsPlaying())
 	{
-		// Suspend
-		if ((!enable_audio || audio_factory_suspended) && !is_suspended)
+		switch (media_control.Wait(port))
 		{
-			suspended_vol = videoview->Volume();
-			videoview->SetVolume(0);
-			is_suspended = true;
+			case MEDIA_CONTROL_AUDIO:
+			case MEDIA_CONTROL_VOLUME:
+				videoview->SetVolume(media_control.AudioSuspended() ?
+					0.0 : (float)video_volume/100.0);
+				break;
+			case MEDIA_CONTROL_STOP:
+			case MEDIA_CONTROL_QUIT:
+				videoview->Control(MEDIA_STOP);
+				break;
 		}
-		// Resume
-		else if ((enable_audio && !audio_factory_suspended) && is_suspended)
-		{
-			videoview->SetVolume(suspended_vol);
-			is_suspended = false;
-		}
-		
-		if (!display_graphics || quit_he_thread)
-		{
-			videoview->Control(MEDIA_STOP);
-			break;
-		}
-		snooze(20000);
 	}
-	
-	// In case we exit by clearing video_playing in hugo_stopvideo()
-	if (videoview->IsPlaying()) videoview->Control(MEDIA_STOP);
 
 Exit:
 	if (window->Lock())
@@ -139,6 +164,12 @@ Exit:
 	if (!quit_he_thread) delete videoview;
 	delete sid;
 	delete sio;
+
+	// (So that hugo_stopvideo() doesn't post to it once it's closed)
+	video_lock.Lock();
+	video_port = -1;
+	media_control.Close(port);
+	video_lock.Unlock();
 	return 0;
 }
 
@@ -163,27 +194,32 @@ int hugo_playvideo(HUGO_FILE infile, long reslength,
 	else
 		path = loaded_filename;
 
-	// Create a BFile from the path and position it; VideoThread
-	// will delete it when it deletes the subset_io_data
-	BFile *file;
-	if (!(file = TrytoOpenBFile(path, "games")))
-	{
-		if (!(file = TrytoOpenBFile(path, "object")))
-		{
-			return false;
-		}
-	}
-	if (file->InitCheck()!=B_OK)
+	// Get a view of the (mapped) resource file; VideoThread
+	// will delete it
+	subset_io_data *sid = OpenResourceSubset(path, fpos, reslength);
+	if (!sid) return false;
+
+	// Stop any video that's still going (a looping one never ends
+	// by itself), and wait for it, since one stopped from the window
+	// thread may still be finishing
+	hugo_stopvideo();
+
+	// VideoThread will close it
+	video_lock.Lock();
+	video_port = media_control.Open("video");
+	video_lock.Unlock();
+	if (video_port < B_OK)
 	{
-		delete file;
+		delete sid;
 		return false;
 	}
 
-	subset_io_data *sid = new subset_io_data(file, fpos, reslength);
-
 	// Figure out the area the video will play back in
 	video_rect = BRect(physical_windowleft, physical_windowtop,
 		physical_windowright, physical_windowbottom);
+
+	// Don't let a queued picture land on top of it
+	WaitForPictures(video_rect);
 	// Set up some playback params for VideoThread
 	video_volume = volume;
 	video_loop = loop_flag;
@@ -197,8 +233,21 @@ int hugo_playvideo(HUGO_FILE infile, long reslength,
 	// ...otherwise launch a thread and get out of here
 	else
 	{
-		video_thread = spawn_thread(VideoThread, "MediaView video thread", B_NORMAL_PRIORITY, sid);
-		resume_thread(video_thread);
+		thread_id thread;
+
+		video_lock.Lock();
+		thread = spawn_thread(VideoThread, "MediaView video thread", B_NORMAL_PRIORITY, sid);
+		if (thread < B_OK || resume_thread(thread)!=B_OK)
+		{
+			if (thread >= B_OK) kill_thread(thread);
+			media_control.Close(video_port);
+			video_port = -1;
+			video_lock.Unlock();
+			delete sid;
+			return false;
+		}
+		video_thread = thread;
+		video_lock.Unlock();
 	}
 	
 	return true;